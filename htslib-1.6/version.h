@@ -0,0 +1 @@
+#define HTS_VERSION "1.6"
@@ -0,0 +1,123 @@
+/*   gea2bgea.c  --
+ *   convert GenomeElementAnnotation file into binary GEA (BGEA) and build CSI index for it
+ *
+ * Demo:
+ *
+ * gea2bgea -o toy.bgea toy.gea.gz
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "utils.h"
+#include "gea.h"
+#include "htslib/hts.h"
+#include "htslib/bgzf.h"
+#include "htslib/tbx.h"
+#include "htslib/kstring.h"
+#include "htslib/hts_endian.h"
+
+static int usage()
+{
+    fprintf(stderr, "gea2bgea -o out.bgea in.gea.gz\n"
+            "Options:\n"
+            "  -o output_file     Output BGEA file, index will be written to output_file.csi.\n"
+            "  -m min_shift       Minimal interval size of CSI index, 2^INT. [14]\n"
+            "\n"
+            "Records should be sorted by position and grouped by contig.\n"
+        );
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *input_fname = NULL;
+    const char *output_fname = NULL;
+    int min_shift = 14;
+    int i;
+    for ( i = 1; i < argc; ) {
+        const char *a = argv[i++];
+        const char **var = 0;
+        if ( strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0 ) return usage();
+        else if ( strcmp(a, "-o") == 0 && output_fname == NULL ) var = &output_fname;
+        else if ( strcmp(a, "-m") == 0 ) {
+            if ( i == argc ) error("Missing an argument after %s.", a);
+            min_shift = atoi(argv[i++]);
+            if ( min_shift < 8 || min_shift > 30 ) error("Bad -m argument, %d.", min_shift);
+            continue;
+        }
+        if ( var != 0 ) {
+            if ( i == argc ) error("Missing an argument after %s.", a);
+            *var = argv[i++];
+            continue;
+        }
+        if ( input_fname == NULL ) {
+            input_fname = a;
+            continue;
+        }
+        error("Unknown argument : %s, use -h to see help information.", a);
+    }
+    if ( input_fname == NULL || output_fname == NULL ) return usage();
+
+    htsFile *fp = hts_open(input_fname, "r");
+    if ( fp == NULL ) error("%s : %s.", input_fname, strerror(errno));
+    struct gea_hdr *hdr_in = gea_hdr_read(fp);
+    if ( hdr_in == NULL ) error("Failed to read header of %s.", input_fname);
+    // parse records with the header as it is read back from BGEA, so ids in the records are consistent
+    struct gea_hdr *hdr = gea_hdr_duplicate(hdr_in);
+    if ( hdr == NULL ) error("Failed to duplicate header of %s.", input_fname);
+    gea_hdr_destroy(hdr_in);
+
+    htsFile *out = hts_open(output_fname, "wb");
+    if ( out == NULL ) error("%s : %s.", output_fname, strerror(errno));
+    if ( bea_hdr_write(out, hdr) ) error("Failed to write header to %s.", output_fname);
+
+    int n_ctg = hdr->n[GEA_DT_CTG];
+    int n_lvls = (TBX_MAX_SHIFT - min_shift + 2) / 3;
+    hts_idx_t *idx = hts_idx_init(0, HTS_FMT_CSI, bgzf_tell(out->fp.bgzf), min_shift, n_lvls);
+    // index ids are assigned in the order of appearance, contig names are kept in the meta block
+    int *tids = (int*)malloc((n_ctg > 0 ? n_ctg : 1)*sizeof(int));
+    for ( i = 0; i < n_ctg; ++i ) tids[i] = -1;
+    int n_tid = 0;
+    kstring_t names = {0,0,0};
+
+    struct gea_record *v = gea_init();
+    for ( ;; ) {
+        if ( gea_read(fp, hdr, v) ) break;
+        // undefined contigs are appended to header by gea_read()
+        if ( v->rid < 0 || v->rid >= n_ctg )
+            error("Contig %s is not defined in the header of %s.", v->rid >= 0 && v->rid < hdr->n[GEA_DT_CTG] ? hdr->id[GEA_DT_CTG][v->rid].key : ".", input_fname);
+        const char *chrom = hdr->id[GEA_DT_CTG][v->rid].key;
+        if ( tids[v->rid] == -1 ) {
+            tids[v->rid] = n_tid++;
+            kputs(chrom, &names);
+            kputc('\0', &names);
+        }
+        gea_unpack(hdr, v, GEA_UN_TRANS|GEA_UN_CIGAR);
+        if ( bgea_write(out, hdr, v) ) error("Failed to write %s.", output_fname);
+        if ( hts_idx_push(idx, tids[v->rid], v->chromStart, v->chromEnd, bgzf_tell(out->fp.bgzf), 1) < 0 )
+            error("Failed to index %s:%d-%d, is %s sorted?", chrom, v->chromStart, v->chromEnd, input_fname);
+    }
+    gea_destroy(v);
+
+    if ( bgzf_flush(out->fp.bgzf) ) error("Failed to write %s.", output_fname);
+    hts_idx_finish(idx, bgzf_tell(out->fp.bgzf));
+
+    // tabix style meta, preset, sc, bc, ec, meta_char, line_skip, l_nm, then contig names
+    int32_t conf[7] = { TBX_UCSC, 1, 2, 3, '#', 0, names.l };
+    uint8_t *meta = (uint8_t*)malloc(28 + names.l);
+    for ( i = 0; i < 7; ++i ) i32_to_le(conf[i], meta + i*4);
+    if ( names.l ) memcpy(meta + 28, names.s, names.l);
+    hts_idx_set_meta(idx, 28 + names.l, meta, 0);
+
+    if ( hts_close(out) ) error("Failed to close %s.", output_fname);
+    if ( hts_idx_save(idx, output_fname, HTS_FMT_CSI) ) error("Failed to save index of %s.", output_fname);
+
+    hts_idx_destroy(idx);
+    hts_close(fp);
+    gea_hdr_destroy(hdr);
+    free(tids);
+    free(names.s);
+    return 0;
+}
@@ -3,61 +3,234 @@
 #include "anno_col.h"
 #include "htslib/vcf.h"
 #include "htslib/hts.h"
+#include "htslib/bgzf.h"
 #include "htslib/kstring.h"
 #include "number.h"
-#include "stack_lite.h"
+#include "htslib/kseq.h"
+#include "htslib/khash_str2int.h"
 
-// icol start from 0
-static char *tsv_get_column(struct anno_bed_tsv *t, int icol)
+static struct {
+    int preload; // load whole database into memory
+} anno_bed_options = {
+    .preload = 0,
+};
+
+void anno_bed_set_preload(int preload)
+{
+    anno_bed_options.preload = preload;
+}
+
+// Preloaded BED database. Records of each contig are sorted by start and laid out as an implicit interval tree
+// (same as cgranges), max is the largest end of the subtree rooted at each record. Values of configured columns
+// are interned, each record keeps n_col string ids, -1 for missing. Numbers of the interned strings are parsed
+// at the same time.
+struct bed_intv {
+    int start;
+    int end;
+    int max;
+};
+struct bed_tree_ctg {
+    int n, m;
+    int root_k; // level of root node, -1 if empty
+    struct bed_intv *a;
+    int *vals;
+};
+struct bed_tree {
+    int n_ctg; // indexed by tabix id
+    struct bed_tree_ctg *ctg;
+    int n_col;
+    int n_str, m_str;
+    char **strs;
+    struct anno_bed_num *nums;
+    void *hash;
+};
+
+static int bed_tree_intern(struct bed_tree *t, const char *s)
 {
-    if ( icol >= t->n_field ) {
-        warnings("Out of column.");
-        return NULL;
+    int id;
+    if ( khash_str2int_get(t->hash, s, &id) == 0 ) return id;
+    char *d = strdup(s);
+    id = khash_str2int_inc(t->hash, d);
+    if ( t->n_str == t->m_str ) {
+        t->m_str = t->m_str == 0 ? 64 : t->m_str<<1;
+        t->strs = realloc(t->strs, t->m_str*sizeof(char*));
+        t->nums = realloc(t->nums, t->m_str*sizeof(struct anno_bed_num));
     }
-    return t->string.s + t->fields[icol];
+    assert(id == t->n_str);
+    t->nums[t->n_str].i = str2int(d);
+    t->nums[t->n_str].f = atof(d);
+    t->strs[t->n_str++] = d;
+    return id;
 }
-static char *func_region_string_generate(struct anno_bed_file *file, bcf1_t *line, struct anno_col *col)
+
+// Set max of each node, return the level of root.
+static int bed_tree_index(struct bed_intv *a, int n)
 {
-    struct anno_bed_buffer *buffer = file->buffer;
-    if ( buffer->cached == 0 )
-        return NULL;
+    int i, last_i = 0, last = 0, k;
+    if ( n == 0 ) return -1;
+    // leaves
+    for ( i = 0; i < n; i += 2 ) last_i = i, a[i].max = last = a[i].end;
+    // internal nodes, bottom up
+    for ( k = 1; 1<<k <= n; ++k ) {
+        int x = 1<<(k-1), i0 = (x<<1) - 1, step = x<<2;
+        for ( i = i0; i < n; i += step ) {
+            int el = a[i-x].max;
+            int er = i + x < n ? a[i+x].max : last;
+            int e = a[i].end;
+            if ( e < el ) e = el;
+            if ( e < er ) e = er;
+            a[i].max = e;
+        }
+        // last_i points to the parent of the rightmost node
+        last_i = last_i>>k&1 ? last_i - x : last_i + x;
+        if ( last_i < n && a[last_i].max > last ) last = a[last_i].max;
+    }
+    return k - 1;
+}
 
-    struct anno_stack *s = anno_stack_init();
-    int i;
-    int end = line->pos +line->rlen;
-    for ( i = buffer->i; i < buffer->cached; ++i ) {
-        struct anno_bed_tsv *t = buffer->buffer[i];
-        if ( buffer->end_pos_for_skip == 0 || buffer->end_pos_for_skip < t->end ) buffer->end_pos_for_skip = t->end;
-        if ( line->pos > buffer->end_pos_for_skip ) {
-            buffer->i = i;
-            continue;
+// Find records overlapped with [start, end), indexes are kept in b->hits in the file order.
+static int bed_tree_query(struct bed_tree *t, int tid, int start, int end, struct anno_bed_buffer *b)
+{
+    struct { int x, k, w; } stack[64], z;
+    int n_stack = 0;
+    b->n_hit = 0;
+    b->hit_tid = tid;
+    if ( tid < 0 || tid >= t->n_ctg ) return 0;
+    struct bed_tree_ctg *c = &t->ctg[tid];
+    struct bed_intv *a = c->a;
+    int n = c->n;
+    if ( c->root_k < 0 ) return 0;
+
+#define push_hit(i) do {                                                \
+        if ( b->n_hit == b->m_hit ) {                                   \
+            b->m_hit = b->m_hit == 0 ? 16 : b->m_hit<<1;                \
+            b->hits = realloc(b->hits, b->m_hit*sizeof(int));           \
+        }                                                               \
+        b->hits[b->n_hit++] = i;                                        \
+    } while(0)
+    
+    stack[n_stack].k = c->root_k, stack[n_stack].x = (1<<c->root_k) - 1, stack[n_stack++].w = 0;
+    while ( n_stack ) {
+        z = stack[--n_stack];
+        if ( z.k <= 3 ) {
+            // small subtree, scan all the nodes
+            int i, i0 = z.x >> z.k << z.k, i1 = i0 + (1<<(z.k+1)) - 1;
+            if ( i1 >= n ) i1 = n;
+            for ( i = i0; i < i1 && a[i].start < end; ++i )
+                if ( start < a[i].end ) push_hit(i);
         }
+        else if ( z.w == 0 ) {
+            // left child not processed yet
+            int y = z.x - (1<<(z.k-1));
+            stack[n_stack].x = z.x, stack[n_stack].k = z.k, stack[n_stack++].w = 1;
+            if ( y >= n || a[y].max > start )
+                stack[n_stack].x = y, stack[n_stack].k = z.k - 1, stack[n_stack++].w = 0;
+        }
+        else if ( z.x < n && a[z.x].start < end ) {
+            if ( start < a[z.x].end ) push_hit(z.x);
+            stack[n_stack].x = z.x + (1<<(z.k-1)), stack[n_stack].k = z.k - 1, stack[n_stack++].w = 0;
+        }
+    }
+#undef push_hit
+    return b->n_hit;
+}
 
-        if ( end < t->start ) break;
+// Return interned id of the value, -1 for missing.
+static inline int bed_tree_value_id(struct bed_tree *t, int tid, int i, int icol)
+{
+    return t->ctg[tid].vals[i*t->n_col + icol];
+}
 
-        if ( line->pos < t->start || line->pos >= t->end ) continue;
-        
-        char *name = tsv_get_column(t, col->icol);
-        if ( name == NULL )
-            warnings("Failed to retrieve record, %s, %s, %s, %d.", file->fname, col->hdr_key, col->curr_name, col->curr_line);
-        else
-            anno_stack_push(s, name);    
+static struct bed_tree *bed_tree_init(struct anno_bed_file *f)
+{
+    struct bed_tree *t = malloc(sizeof(*t));
+    memset(t, 0, sizeof(*t));
+    const char **names = tbx_seqnames(f->idx, &t->n_ctg);
+    if ( names ) free(names);
+    t->ctg = calloc(t->n_ctg > 0 ? t->n_ctg : 1, sizeof(struct bed_tree_ctg));
+    t->n_col = f->n_col;
+    t->hash = khash_str2int_init();
+
+    htsFile *fp = hts_open(f->fname, "r");
+    if ( fp == NULL ) error("%s : %s.", f->fname, strerror(errno));
+    kstring_t str = {0,0,0}, skipped = {0,0,0};
+    int i, n, m_s = 0, *s = NULL, lineno = 0, last_tid = -1;
+    for ( ;; ) {
+        if ( hts_getline(fp, KS_SEP_LINE, &str) < 0 ) break;
+        ++lineno;
+        if ( lineno <= f->idx->conf.line_skip || str.s[0] == f->idx->conf.meta_char ) continue;
+        n = ksplit_core(str.s, '\t', &m_s, &s);
+        if ( n < 3 ) continue;
+        int tid = tbx_name2id(f->idx, str.s);
+        if ( tid < 0 ) {
+            // warn once for each block of the contig
+            if ( skipped.l == 0 || strcmp(skipped.s, str.s) ) {
+                warnings("Contig %s is not found in the index of %s, skipped.", str.s, f->fname);
+                skipped.l = 0;
+                kputs(str.s, &skipped);
+            }
+            continue;
+        }
+        skipped.l = 0;
+        struct bed_tree_ctg *c = &t->ctg[tid];
+        // records of a contig should be in one block
+        if ( tid != last_tid && c->n )
+            error("%s is not sorted, %s is split into separate blocks.", f->fname, str.s);
+        last_tid = tid;
+        if ( c->n == c->m ) {
+            c->m = c->m == 0 ? 32 : c->m<<1;
+            c->a = realloc(c->a, c->m*sizeof(struct bed_intv));
+            c->vals = realloc(c->vals, c->m*t->n_col*sizeof(int));
+        }
+        struct bed_intv *v = &c->a[c->n];
+        v->start = str2int(str.s + s[1]);
+        v->end   = str2int(str.s + s[2]);
+        if ( c->n && c->a[c->n-1].start > v->start )
+            error("%s is not sorted, %s:%d.", f->fname, str.s, v->start);
+        int *vals = c->vals + c->n*t->n_col;
+        for ( i = 0; i < t->n_col; ++i ) {
+            int icol = f->cols[i].icol;
+            if ( icol >= n ) {
+                warnings("Out of column. %s, %s:%d.", f->fname, str.s, v->start);
+                vals[i] = -1;
+            }
+            else vals[i] = bed_tree_intern(t, str.s + s[icol]);
+        }
+        c->n++;
     }
-    kstring_t string = {0,0,0};
-    for ( i = 0; i < s->l; ++i ) {
-        if ( i ) kputc(',', &string);
-        kputs(s->a[i], &string);
+    for ( i = 0; i < t->n_ctg; ++i ) t->ctg[i].root_k = bed_tree_index(t->ctg[i].a, t->ctg[i].n);
+    free(s);
+    free(str.s);
+    free(skipped.s);
+    hts_close(fp);
+    return t;
+}
+
+static void bed_tree_destroy(struct bed_tree *t)
+{
+    int i;
+    for ( i = 0; i < t->n_ctg; ++i ) {
+        if ( t->ctg[i].m ) {
+            free(t->ctg[i].a);
+            free(t->ctg[i].vals);
+        }
     }
-    anno_stack_destroy(s);
-    return string.s;
+    free(t->ctg);
+    // strings are owned by the hash
+    khash_str2int_destroy_free(t->hash);
+    free(t->strs);
+    free(t->nums);
+    free(t);
 }
-static struct anno_bed_tsv *anno_bed_tsv_init()
+
+static struct anno_bed_tsv *anno_bed_tsv_init(int n_col)
 {
     struct anno_bed_tsv *t = malloc(sizeof(*t));
     t->n_field = 0;
     t->fields = NULL;
     t->string.l = t->string.m =0;
     t->string.s = 0;
+    t->nums = malloc((n_col > 0 ? n_col : 1)*sizeof(struct anno_bed_num));
     return t;
 }
 static void anno_bed_tsv_clean(struct anno_bed_tsv *t)
@@ -76,9 +249,10 @@ static void anno_bed_tsv_destroy(struct anno_bed_tsv *t)
         free(t->fields);
     if ( t->string.m )
         free(t->string.s);
+    free(t->nums);
     free(t);
 }
-static int string2tsv(struct anno_bed_tsv *t)
+static int string2tsv(struct anno_bed_file *f, struct anno_bed_tsv *t)
 {
     int *arr = ksplit(&t->string, '\t', &t->n_field);
     if ( arr )
@@ -96,12 +270,143 @@ static int string2tsv(struct anno_bed_tsv *t)
     assert(t->n_field > 3);
     t->start = str2int(t->string.s + t->fields[1]);
     t->end   = str2int(t->string.s + t->fields[2]);
+
+    // parse numeric columns once here, instead of every time the record is hit
+    int i;
+    for ( i = 0; i < f->n_col; ++i ) {
+        int icol = f->cols[i].icol;
+        if ( icol >= t->n_field ) {
+            warnings("Out of column. %s, %s:%d.", f->fname, t->string.s, t->start);
+            continue;
+        }
+        if ( f->updates[i].type == BCF_HT_INT ) t->nums[i].i = str2int(t->string.s + t->fields[icol]);
+        else if ( f->updates[i].type == BCF_HT_REAL ) t->nums[i].f = atof(t->string.s + t->fields[icol]);
+    }
     return 0;
 
   failed_convert:
     return 1;
 }
 
+// Collect cached records overlapped with the line into b->hits, in the file order.
+static int anno_bed_buffer_hits(struct anno_bed_file *file, bcf1_t *line)
+{
+    struct anno_bed_buffer *buffer = file->buffer;
+    int i, end = line->pos + line->rlen;
+    buffer->n_hit = 0;
+    for ( i = buffer->i; i < buffer->cached; ++i ) {
+        struct anno_bed_tsv *t = buffer->buffer[i];
+        if ( buffer->end_pos_for_skip == 0 || buffer->end_pos_for_skip < t->end ) buffer->end_pos_for_skip = t->end;
+        if ( line->pos > buffer->end_pos_for_skip ) {
+            buffer->i = i;
+            continue;
+        }
+
+        if ( end < t->start ) break;
+
+        if ( line->pos < t->start || line->pos >= t->end ) continue;
+
+        if ( buffer->n_hit == buffer->m_hit ) {
+            buffer->m_hit = buffer->m_hit == 0 ? 16 : buffer->m_hit<<1;
+            buffer->hits = realloc(buffer->hits, buffer->m_hit*sizeof(int));
+        }
+        buffer->hits[buffer->n_hit++] = i;
+    }
+    return buffer->n_hit;
+}
+
+// Value of column c of the h-th overlapped record, NULL if missing.
+static inline const char *anno_bed_hit_value(struct anno_bed_file *f, int h, int c)
+{
+    struct anno_bed_buffer *b = f->buffer;
+    if ( f->tree ) {
+        int id = bed_tree_value_id(f->tree, b->hit_tid, b->hits[h], c);
+        return id < 0 ? NULL : f->tree->strs[id];
+    }
+    struct anno_bed_tsv *t = b->buffer[b->hits[h]];
+    int icol = f->cols[c].icol;
+    return icol < t->n_field ? t->string.s + t->fields[icol] : NULL;
+}
+
+// Number of column c of the h-th overlapped record, NULL if missing.
+static inline const struct anno_bed_num *anno_bed_hit_num(struct anno_bed_file *f, int h, int c)
+{
+    struct anno_bed_buffer *b = f->buffer;
+    if ( f->tree ) {
+        int id = bed_tree_value_id(f->tree, b->hit_tid, b->hits[h], c);
+        return id < 0 ? NULL : &f->tree->nums[id];
+    }
+    return &b->buffer[b->hits[h]]->nums[c];
+}
+
+// Check if column c of two hits has the same value, value of h1 should not be missing.
+static inline int anno_bed_hit_same(struct anno_bed_file *f, int h1, int h2, int c)
+{
+    struct anno_bed_buffer *b = f->buffer;
+    if ( f->tree ) // values are interned, compare the ids
+        return bed_tree_value_id(f->tree, b->hit_tid, b->hits[h1], c) == bed_tree_value_id(f->tree, b->hit_tid, b->hits[h2], c);
+    const char *s = anno_bed_hit_value(f, h2, c);
+    return s && strcmp(anno_bed_hit_value(f, h1, c), s) == 0;
+}
+
+// Fill all columns from the overlapped records of this line in one pass, then update INFO in a batch.
+// String values are deduplicated and joined by ',', numbers and flags are taken from the first value.
+static int anno_bed_update_line(struct anno_bed_file *f, bcf1_t *line)
+{
+    struct anno_bed_buffer *b = f->buffer;
+    int i, j, c;
+    for ( c = 0; c < f->n_col; ++c ) {
+        f->values[c].n = 0;
+        f->values[c].str.l = 0;
+    }
+    for ( i = 0; i < b->n_hit; ++i ) {
+        for ( c = 0; c < f->n_col; ++c ) {
+            const char *s = anno_bed_hit_value(f, i, c);
+            if ( s == NULL ) continue;
+            for ( j = 0; j < i; ++j )
+                if ( anno_bed_hit_same(f, i, j, c) ) break;
+            if ( j < i ) continue;
+            struct anno_bed_value *v = &f->values[c];
+            if ( v->n++ == 0 ) v->first = i;
+            if ( f->updates[c].type == BCF_HT_STR ) {
+                if ( v->n > 1 ) kputc(',', &v->str);
+                kputs(s, &v->str);
+            }
+        }
+    }
+    for ( c = 0; c < f->n_col; ++c ) {
+        struct anno_bed_value *v = &f->values[c];
+        struct info_update *u = &f->updates[c];
+        const struct anno_bed_num *num;
+        u->skip = v->n == 0;
+        if ( u->skip ) continue;
+        switch ( u->type ) {
+            case BCF_HT_STR:
+                u->values = v->str.s;
+                break;
+            case BCF_HT_INT:
+                // v->first is never a missing value, checked anyway
+                num = anno_bed_hit_num(f, v->first, c);
+                u->skip = num == NULL;
+                u->values = num ? &num->i : NULL;
+                break;
+            case BCF_HT_REAL:
+                num = anno_bed_hit_num(f, v->first, c);
+                u->skip = num == NULL;
+                u->values = num ? &num->f : NULL;
+                break;
+            case BCF_HT_FLAG: {
+                // a single missing value does not set the flag
+                const char *s = anno_bed_hit_value(f, v->first, c);
+                u->skip = v->n == 1 && s[0] == '.' && s[1] == 0;
+                u->values = NULL;
+                break;
+            }
+        }
+    }
+    return bcf_update_info_fixed_n(line, f->updates, f->n_col);
+}
+
 static int anno_bed_update_buffer(struct anno_bed_file *file, bcf_hdr_t *hdr, bcf1_t *line)
 {
     assert(file->idx);
@@ -131,6 +436,7 @@ static int anno_bed_update_buffer(struct anno_bed_file *file, bcf_hdr_t *hdr, bc
     buffer->end_pos_for_skip = 0;
         
     hts_itr_t *itr = tbx_itr_queryi(file->idx, tid, line->pos, line->pos + line->rlen);
+    file->stat.n_query++;
     if ( itr == NULL )
         return 1;
 
@@ -145,7 +451,7 @@ static int anno_bed_update_buffer(struct anno_bed_file *file, bcf_hdr_t *hdr, bc
             buffer->buffer = realloc(buffer->buffer, sizeof(void*)*buffer->max);
             int i;
             for ( i = 8; i > 0; --i)
-                buffer->buffer[buffer->max-i] = anno_bed_tsv_init();
+                buffer->buffer[buffer->max-i] = anno_bed_tsv_init(file->n_col);
         }
 
         struct anno_bed_tsv *t = buffer->buffer[buffer->cached];
@@ -154,7 +460,7 @@ static int anno_bed_update_buffer(struct anno_bed_file *file, bcf_hdr_t *hdr, bc
         if ( tbx_itr_next(file->fp, file->idx, itr, &t->string) < 0 )
             break;
         
-        if ( string2tsv(t) )
+        if ( string2tsv(file, t) )
             continue;
         
         // Skip if variant located outside of target region.
@@ -209,6 +515,7 @@ int anno_bed_update_buffer_chunk(struct anno_bed_file *f, bcf_hdr_t *hdr, struct
     b->i = 0;
     
     hts_itr_t *itr = tbx_itr_queryi(f->idx, tid, pool->curr_start, pool->curr_end+1);
+    f->stat.n_query++;
     if ( itr == NULL )
         return 0;
 
@@ -223,7 +530,7 @@ int anno_bed_update_buffer_chunk(struct anno_bed_file *f, bcf_hdr_t *hdr, struct
             b->buffer = realloc(b->buffer, sizeof(void*)*b->max);
             int i;
             for ( i = 8; i > 0; --i)
-                b->buffer[b->max-i] = anno_bed_tsv_init();
+                b->buffer[b->max-i] = anno_bed_tsv_init(f->n_col);
         }
 
         struct anno_bed_tsv *t = b->buffer[b->cached];
@@ -232,7 +539,7 @@ int anno_bed_update_buffer_chunk(struct anno_bed_file *f, bcf_hdr_t *hdr, struct
         if ( tbx_itr_next(f->fp, f->idx, itr, &t->string) < 0 )
             break;
         
-        if ( string2tsv(t) )
+        if ( string2tsv(f, t) )
             continue;
 
         b->cached++;
@@ -251,108 +558,72 @@ int anno_bed_update_buffer_chunk(struct anno_bed_file *f, bcf_hdr_t *hdr, struct
     return b->cached;
 
 }
+static int anno_bed_name2id(struct anno_bed_file *f, bcf_hdr_t *hdr, bcf1_t *line)
+{
+    struct anno_bed_buffer *b = f->buffer;
+    int tid = tbx_name2id(f->idx, bcf_seqname(hdr, line));
+    if ( tid == -1 ) {
+        if ( b->no_such_chrom == 0 ) {
+            warnings("No chromosome %s found in database %s.", bcf_seqname(hdr, line), f->fname);
+            b->no_such_chrom = 1;
+        }
+    }
+    else b->no_such_chrom = 0;
+    return tid;
+}
+
 int anno_bed_core(struct anno_bed_file *file, bcf_hdr_t *hdr, bcf1_t *line)
 {
-    int i;
+    if ( file->tree ) {
+        int tid = anno_bed_name2id(file, hdr, line);
+        if ( tid == -1 ) return 0;
+        if ( bed_tree_query(file->tree, tid, line->pos, line->pos+1, file->buffer) == 0 ) return 0;
+    }
     // no record found
-    if ( anno_bed_update_buffer(file, hdr, line) == 0)
+    else if ( anno_bed_update_buffer(file, hdr, line) == 0 || anno_bed_buffer_hits(file, line) == 0 )
         return 0;
-    
-    for ( i = 0; i < file->n_col; ++i ) {
-        struct anno_col *col = &file->cols[i];
-        col->curr_name = bcf_seqname(hdr, line);
-        col->curr_line = line->pos+1;
-        if ( col->func.bed(file, hdr, line, col) ) {
-            warnings("Failed to update %s for record %s:%d.", col->hdr_key, col->curr_name, col->curr_line);
-        }
-    }
+
+    if ( anno_bed_update_line(file, line) )
+        warnings("Failed to update record %s:%d.", bcf_seqname(hdr, line), line->pos+1);
     return 0;
 }
 
 int anno_bed_chunk(struct anno_bed_file *f, bcf_hdr_t *hdr, struct anno_pool *pool )
 {
-    int i = 0, j = 0;
+    int i = 0, tid = -1;
     struct anno_bed_buffer *b = f->buffer;
     b->cached = 0;
 
-    if ( anno_bed_update_buffer_chunk(f, hdr, pool) == 0 )
+    if ( f->tree ) {
+        // all records in a chunk are on the same chromosome
+        tid = anno_bed_name2id(f, hdr, pool->curr_line);
+        if ( tid == -1 ) return 0;
+    }
+    else if ( anno_bed_update_buffer_chunk(f, hdr, pool) == 0 )
         return 0;
         
     for ( i = pool->i_chunk; i < pool->n_chunk; ++i) {
         bcf1_t *line = pool->readers[i];
 
         if ( bcf_get_variant_types(line) == VCF_REF ) continue;
-        bcf_unpack(line, BCF_UN_INFO);
-            
-        for ( j = 0; j < f->n_col; ++j ) {
-            struct anno_col *col = &f->cols[j];
-            col->curr_name = bcf_seqname(hdr, line);
-            col->curr_line = line->pos+1;
-            if ( col->func.bed(f, hdr, line, col) ) 
-                warnings("Failed to update %s for record %s:%d.", col->hdr_key, col->curr_name, col->curr_line);
+        // overlapped records are retrieved once for all the columns
+        if ( f->tree ) {
+            if ( bed_tree_query(f->tree, tid, line->pos, line->pos+1, b) == 0 ) continue;
         }
+        else if ( anno_bed_buffer_hits(f, line) == 0 ) continue;
+
+        f->stat.n_match++;
+        if ( anno_bed_update_line(f, line) )
+            warnings("Failed to update record %s:%d.", bcf_seqname(hdr, line), line->pos+1);
     }
     return 0;
 }
-// setter functions
-static int anno_bed_setter_info_string(struct anno_bed_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col) {
-    struct anno_bed_buffer *b = file->buffer;
-    int ret;
-    if ( col->replace == REPLACE_MISSING ) {
-        ret = bcf_get_info_string(hdr, line, col->hdr_key, &b->tmps, &b->mtmps);
-        if ( ret > 0 && (b->tmps[0]!='.'||b->tmps[1]!= 0)) return 0;
-    }
-    char *string = func_region_string_generate(file, line, col);
-    if ( string == NULL ) return 0;
-    ret = bcf_update_info_string_fixed(hdr, line, col->hdr_key, string);
-    free(string);
-    return ret;
-}
-
-static int anno_bed_setter_info_int32(struct anno_bed_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col) {
-    struct anno_bed_buffer *b = file->buffer;
-    int ret;
-    if ( col->replace == REPLACE_MISSING ) {
-        ret = bcf_get_info_string(hdr, line, col->hdr_key, &b->tmps, &b->mtmps);
-        if ( ret > 0 && (b->tmps[0]!='.'||b->tmps[1]!= 0)) return 0;
-    }
-    char *string = func_region_string_generate(file, line, col);
-    if ( string == NULL ) return 0;
-    int v = str2int(string);
-    ret = bcf_update_info_int32_fixed(hdr, line, col->hdr_key, &v, 1);
-    free(string);
-    return ret;
-}
-
-static int anno_bed_setter_info_flag(struct anno_bed_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col) {
-    struct anno_bed_buffer *b = file->buffer;
-    int ret;
-    if ( col->replace == REPLACE_MISSING ) {
-        ret = bcf_get_info_string(hdr, line, col->hdr_key, &b->tmps, &b->mtmps);
-        if ( ret > 0 && (b->tmps[0]!='.'||b->tmps[1]!= 0)) return 0;
-    }
-    char *string = func_region_string_generate(file, line, col);
-    if ( string == NULL ) return 0;
-    if ( string[0] == '.' && string[1] == 0 ) { free(string); return 0; }
-    
-    ret = bcf_update_info_flag(hdr, line, col->hdr_key, NULL, 1);
-    free(string);
-    return ret;
-}
 
-static int anno_bed_setter_info_float(struct anno_bed_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col) {
-    struct anno_bed_buffer *b = file->buffer;
-    int ret;
-    if ( col->replace == REPLACE_MISSING ) {
-        ret = bcf_get_info_string(hdr, line, col->hdr_key, &b->tmps, &b->mtmps);
-        if ( ret > 0 && (b->tmps[0]!='.'||b->tmps[1]!= 0)) return 0;
-    }
-    char *string = func_region_string_generate(file, line, col);
-    if ( string == NULL ) return 0;
-    float v = atof(string);
-    ret = bcf_update_info_float_fixed(hdr, line, col->hdr_key, &v, 1);
-    free(string);
-    return ret;
+void anno_bed_file_stat(struct anno_bed_file *f, struct anno_stat *s)
+{
+    BGZF *b = f->fp ? hts_get_bgzfp(f->fp) : NULL;
+    anno_stat_add(s, &f->stat);
+    if ( b ) s->n_byte += b->uncompressed_address;
 }
 
 struct anno_bed_file *anno_bed_file_init(bcf_hdr_t *hdr, const char *fname, char *column)
@@ -379,6 +650,9 @@ struct anno_bed_file *anno_bed_file_init(bcf_hdr_t *hdr, const char *fname, char
     b->cached = 0;
     b->max = 0;
     b->buffer = NULL;
+    b->hit_tid = -1;
+    b->n_hit = b->m_hit = 0;
+    b->hits = NULL;
 
     f->buffer = b;
 
@@ -458,19 +732,9 @@ struct anno_bed_file *anno_bed_file_init(bcf_hdr_t *hdr, const char *fname, char
 
             switch ( bcf_hdr_id2type(hdr, BCF_HL_INFO, hdr_id) ) {
                 case BCF_HT_FLAG:
-                    col->func.bed = anno_bed_setter_info_flag;
-                    break;
-
                 case BCF_HT_INT:
-                    col->func.bed = anno_bed_setter_info_int32;
-                    break;
-                    
                 case BCF_HT_REAL:
-                    col->func.bed = anno_bed_setter_info_float;
-                    break;
-
                 case BCF_HT_STR:
-                    col->func.bed = anno_bed_setter_info_string;
                     break;
 
                 default:
@@ -505,6 +769,8 @@ struct anno_bed_file *anno_bed_file_init(bcf_hdr_t *hdr, const char *fname, char
     }
 
     // check inited columns
+    f->values = calloc(f->n_col > 0 ? f->n_col : 1, sizeof(struct anno_bed_value));
+    f->updates = calloc(f->n_col > 0 ? f->n_col : 1, sizeof(struct info_update));
     for ( i = 0; i < f->n_col; ++i ) {
         struct anno_col *col = &f->cols[i];
         if ( col->hdr_key && col->icol == -1 )
@@ -515,9 +781,22 @@ struct anno_bed_file *anno_bed_file_init(bcf_hdr_t *hdr, const char *fname, char
         col->number = bcf_hdr_id2length(hdr, BCF_HL_INFO, hdr_id);
         if ( col->number == BCF_VL_A || col->number == BCF_VL_R || col->number == BCF_VL_G )
             error("Only support fixed INFO number for tag %s. Please reset type of it.", col->hdr_key);        
+
+        struct info_update *u = &f->updates[i];
+        u->key = hdr_id;
+        u->type = bcf_hdr_id2type(hdr, BCF_HL_INFO, hdr_id);
+        u->replace = col->replace;
+        u->n = 1;
     }
 
     free(string.s);
+
+    if ( anno_bed_options.preload ) {
+        f->tree = bed_tree_init(f);
+        // records are in memory now, the file handler is not needed any more
+        hts_close(f->fp);
+        f->fp = NULL;
+    }
     
     return f;
 }
@@ -529,11 +808,14 @@ struct anno_bed_file *anno_bed_file_duplicate(struct anno_bed_file *f)
     
     d->fname = f->fname;
 
-    // not directly copy the address, but reopen file and index, because tabix is NOT thread-safe !    
-    d->fp = hts_open(f->fname, "r");
-    assert(d->fp);
-    d->idx = tbx_index_load(f->fname);
-    assert(d->idx);
+    // reopen the file because file handler is NOT thread-safe, but the tabix index is
+    // read-only after loading, so share it with the original handler
+    d->tree = f->tree;
+    if ( d->tree == NULL ) {
+        d->fp = hts_open(f->fname, "r");
+        assert(d->fp);
+    }
+    d->idx = f->idx;
     d->overlapped = f->overlapped;
 
     // init buffer
@@ -545,6 +827,9 @@ struct anno_bed_file *anno_bed_file_duplicate(struct anno_bed_file *f)
     b->cached = 0;
     b->max = 0;
     b->buffer = NULL;
+    b->hit_tid = -1;
+    b->n_hit = b->m_hit = 0;
+    b->hits = NULL;
     d->buffer = b;
     
     d->n_col = f->n_col;
@@ -553,23 +838,36 @@ struct anno_bed_file *anno_bed_file_duplicate(struct anno_bed_file *f)
     for ( i = 0; i < d->n_col; ++i )
         anno_col_copy(&f->cols[i], &d->cols[i]);
 
+    d->values = calloc(d->n_col > 0 ? d->n_col : 1, sizeof(struct anno_bed_value));
+    d->updates = malloc((d->n_col > 0 ? d->n_col : 1)*sizeof(struct info_update));
+    memcpy(d->updates, f->updates, d->n_col*sizeof(struct info_update));
+
     return d;
 }
 
-void anno_bed_file_destroy(struct anno_bed_file *f)
+// l is the thread index, the shared index is only freed by thread 0
+void anno_bed_file_destroy(struct anno_bed_file *f, int l)
 {
-    hts_close(f->fp);
-    tbx_destroy(f->idx);
+    if ( f->fp ) hts_close(f->fp);
+    if ( l == 0 ) {
+        tbx_destroy(f->idx);
+        if ( f->tree ) bed_tree_destroy(f->tree);
+    }
     int i;
-    for ( i = 0; i < f->n_col; ++i ) free(f->cols[i].hdr_key);
+    for ( i = 0; i < f->n_col; ++i ) {
+        free(f->cols[i].hdr_key);
+        free(f->values[i].str.s);
+    }
     free(f->cols);
+    free(f->values);
+    free(f->updates);
     struct anno_bed_buffer *b = f->buffer;
     for ( i = 0; i < b->max; ++i ) {
         struct anno_bed_tsv *t = b->buffer[i];
         anno_bed_tsv_destroy(t);
     }
-    //if ( b->tmps ) free(b->tmps);
     if ( b->buffer ) free(b->buffer);
+    if ( b->m_hit ) free(b->hits);
     free(b);
     free(f);
 }
@@ -751,25 +1049,21 @@ int bcfanno_bed()
     
     for ( ;; ) {
         struct anno_pool *arg = anno_reader(args.fp_input, args.hdr_out, args.n_record);
-        if ( arg->n_reader == 0 )
+        if ( arg->n_reader == 0 ) {
+            anno_pool_release(arg);
             break;
+        }
         arg->arg = &args;
-        int block;
-        do {
-            block = thread_pool_dispatch2(p, q, anno_bed, arg, 1);
-            if ( ( r = thread_pool_next_result(q) ) ) {
-                // generate output
-                struct anno_pool *data = (struct anno_pool*)r->data;
-                int i;
-                for ( i = 0; i < data->n_reader; ++i ) {
-                    bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
-                    bcf_destroy(data->readers[i]);
-                }
-                free(data->readers);
-                thread_pool_delete_result(r, 1);
-            }
-            // flush output
-        } while ( block == -1);
+        // sleep until the input queue has room, and write the ordered results meanwhile
+        while ( thread_pool_dispatch3(p, q, anno_bed, arg, &r) == 1 ) {
+            // generate output
+            struct anno_pool *data = (struct anno_pool*)r->data;
+            int i;
+            for ( i = 0; i < data->n_reader; ++i )
+                bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
+            anno_pool_release(data);
+            thread_pool_delete_result(r, 0);
+        }
     }
 
     thread_pool_process_flush(q);
@@ -777,15 +1071,14 @@ int bcfanno_bed()
         // generate output
         struct anno_pool *data = (struct anno_pool*)r->data;
         int i;
-        for ( i = 0; i < data->n_reader; ++i ) {
+        for ( i = 0; i < data->n_reader; ++i )
             bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
-            bcf_destroy(data->readers[i]);
-        }
-        free(data->readers);
-        thread_pool_delete_result(r, 1);
+        anno_pool_release(data);
+        thread_pool_delete_result(r, 0);
     }
     thread_pool_process_destroy(q);
     thread_pool_destroy(p);
+    anno_pool_freelist_destroy();
     return 0;
 }
 
@@ -796,7 +1089,7 @@ void release_memory()
     bcf_hdr_destroy(args.hdr_out);
     int i;
     for ( i = 0; i < args.n_thread; ++i )
-        anno_bed_file_destroy(args.files[i]);
+        anno_bed_file_destroy(args.files[i], i);
     free(args.files);
 }
 
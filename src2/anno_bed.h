@@ -6,13 +6,21 @@
 #include "htslib/kstring.h"
 #include "htslib/tbx.h"
 #include "anno_pool.h"
+#include "anno_stats.h"
 
+// Numeric columns are parsed once when the record is read, int or float is picked by the tag type.
+struct anno_bed_num {
+    int i;
+    float f;
+};
 struct anno_bed_tsv {
     int  n_field;
     int *fields;
     int  start;
     int  end;
     kstring_t string;
+    // indexed by column of anno_bed_file::cols
+    struct anno_bed_num *nums;
 };
 struct anno_bed_buffer {
     int no_such_chrom;
@@ -24,9 +32,22 @@ struct anno_bed_buffer {
     int end_pos_for_skip;
     int max;
     struct anno_bed_tsv **buffer;
-    int mtmps;
-    char *tmps;
+    // overlapped records of current line, index of buffer or tree
+    int hit_tid;
+    int n_hit, m_hit;
+    int *hits;
 };
+// Whole BED database in memory, shared read-only by all threads, see anno_bed.c
+struct bed_tree;
+struct info_update;
+
+// Values of one column retrieved from overlapped records of current line.
+struct anno_bed_value {
+    int n;          // distinct values
+    int first;      // hit of the first value, numbers are taken from it
+    kstring_t str;  // values joined by ',', only for string tags
+};
+
 struct anno_bed_file {
     //int id;
     const char *fname;
@@ -37,12 +58,23 @@ struct anno_bed_file {
     int n_col;
     struct anno_col *cols;
     struct anno_bed_buffer *buffer;
+    // set if --preload-bed, records are queried from memory instead of tabix
+    struct bed_tree *tree;
+    // per column values and INFO updates of current line, filled in one pass
+    struct anno_bed_value *values;
+    struct info_update *updates;
+    // counters of this handler, see anno_stats.h
+    struct anno_stat stat;
 };
 
 extern int anno_bed_core(struct anno_bed_file *file, bcf_hdr_t *hdr, bcf1_t *line);
 extern struct anno_bed_file *anno_bed_file_init(bcf_hdr_t *hdr, const char *fname, char *column);
 extern struct anno_bed_file *anno_bed_file_duplicate(struct anno_bed_file *f);
-extern void anno_bed_file_destroy(struct anno_bed_file *f);
+extern void anno_bed_file_destroy(struct anno_bed_file *f, int l);
 extern int anno_bed_chunk(struct anno_bed_file *file, bcf_hdr_t *hdr, struct anno_pool *pool );
+// Add counters of this handler and bytes inflated from the database to s.
+extern void anno_bed_file_stat(struct anno_bed_file *f, struct anno_stat *s);
+// load whole BED databases into memory and share them between threads, set before init the files
+extern void anno_bed_set_preload(int preload);
 
 #endif
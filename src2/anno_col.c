@@ -1,5 +1,7 @@
 #include "anno_col.h"
 #include "htslib/vcf.h"
+#include "htslib/hts_endian.h"
+#include "htslib/khash.h"
 
 void anno_col_clean(struct anno_col *c) {
     if ( c->hdr_key ) free(c->hdr_key);
@@ -12,6 +14,7 @@ void anno_col_copy(struct anno_col *src, struct anno_col *dest) {
     dest->replace = src->replace;
     dest->number = src->number;
     dest->hdr_key = strdup(src->hdr_key);
+    dest->hdr_id = src->hdr_id;
     dest->func = src->func;
     dest->curr_name = src->curr_name;
     dest->curr_line = src->curr_line;
@@ -38,54 +41,48 @@ static inline uint8_t *bcf_unpack_info_core1(uint8_t *ptr, bcf_info_t *info)
     return ptr;
 }
 
-int bcf_update_info_fixed(const bcf_hdr_t *hdr, bcf1_t *line, const char *key, const void *values, int n, int type)
+// Encode key and values of an INFO tag, appended to str.
+static void bcf_info_encode(kstring_t *str, int inf_id, const void *values, int n, int type)
 {
-    // Is the field already present?
-    int i, inf_id = bcf_hdr_id2int(hdr,BCF_DT_ID,key);
-    if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_INFO,inf_id) ) return -1;    // No such INFO field in the header
-    if ( !(line->unpacked & BCF_UN_INFO) ) bcf_unpack(line, BCF_UN_INFO);
-
-    for (i=0; i<line->n_info; i++)
-        if ( inf_id==line->d.info[i].key ) break;
-    bcf_info_t *inf = i==line->n_info ? NULL : &line->d.info[i];
-
-    if ( !n || (type==BCF_HT_STR && !values) )
-    {
-        if ( n==0 && !strcmp("END",key) )
-            line->rlen = line->n_allele ? strlen(line->d.allele[0]) : 0;
-        if ( inf )
-        {
-            // Mark the tag for removal, free existing memory if necessary
-            if ( inf->vptr_free )
-            {
-                free(inf->vptr - inf->vptr_off);
-                inf->vptr_free = 0;
-            }
-            line->d.shared_dirty |= BCF1_DIRTY_INF;
-            inf->vptr = NULL;
-            inf->vptr_off = inf->vptr_len = 0;
-        }
-        return 0;
-    }
-
-    // Encode the values and determine the size required to accommodate the values
-    kstring_t str = {0,0,0};
-    bcf_enc_int1(&str, inf_id);
+    bcf_enc_int1(str, inf_id);
     if ( type==BCF_HT_INT )
-        bcf_enc_vint(&str, n, (int32_t*)values, -1);
+        bcf_enc_vint(str, n, (int32_t*)values, -1);
     else if ( type==BCF_HT_REAL )
-        bcf_enc_vfloat(&str, n, (float*)values);
+        bcf_enc_vfloat(str, n, (float*)values);
     else if ( type==BCF_HT_FLAG || type==BCF_HT_STR )
     {
         if ( values==NULL )
-            bcf_enc_size(&str, 0, BCF_BT_NULL);
+            bcf_enc_size(str, 0, BCF_BT_NULL);
         else
-            bcf_enc_vchar(&str, strlen((char*)values), (char*)values);
+            bcf_enc_vchar(str, strlen((char*)values), (char*)values);
     }
     else
     {
         error("The type %d not implemented yet", type);
     }
+}
+
+// Mark line->d.info[i] for removal.
+static void bcf_info_remove(bcf1_t *line, int i)
+{
+    if ( i == -1 ) return;
+    bcf_info_t *inf = &line->d.info[i];
+    // Mark the tag for removal, free existing memory if necessary
+    if ( inf->vptr_free )
+    {
+        free(inf->vptr - inf->vptr_off);
+        inf->vptr_free = 0;
+    }
+    line->d.shared_dirty |= BCF1_DIRTY_INF;
+    inf->vptr = NULL;
+    inf->vptr_off = inf->vptr_len = 0;
+}
+
+// Set line->d.info[i] to encoded str, append a new tag if i == -1. str.s is owned by line after calling.
+// Return index of the tag.
+static int bcf_info_install(bcf1_t *line, int i, kstring_t str)
+{
+    bcf_info_t *inf = i == -1 ? NULL : &line->d.info[i];
 
     // Is the INFO tag already present
     if ( inf )
@@ -115,14 +112,383 @@ int bcf_update_info_fixed(const bcf_hdr_t *hdr, bcf1_t *line, const char *key, c
         // The tag is not present, create new one
         line->n_info++;
         hts_expand0(bcf_info_t, line->n_info, line->d.m_info , line->d.info);
-        inf = &line->d.info[line->n_info-1];
+        i = line->n_info-1;
+        inf = &line->d.info[i];
         bcf_unpack_info_core1((uint8_t*)str.s, inf);
         inf->vptr_free = 1;
         line->d.shared_dirty |= BCF1_DIRTY_INF;
     }
     line->unpacked |= BCF_UN_INFO;
+    return i;
+}
+
+// Update or remove the INFO tag of line->d.info[i], append a new tag if i == -1. Return index of the tag.
+static int bcf_update_info_core(bcf1_t *line, int inf_id, int i, const void *values, int n, int type)
+{
+    if ( !n || (type==BCF_HT_STR && !values) )
+    {
+        bcf_info_remove(line, i);
+        return i;
+    }
+
+    // Encode the values and determine the size required to accommodate the values
+    kstring_t str = {0,0,0};
+    bcf_info_encode(&str, inf_id, values, n, type);
+    return bcf_info_install(line, i, str);
+}
+
+// INFO accumulator, see info_batch_begin(). Updates of each line are kept as encoded tags in one
+// arena and merged into the INFO block of the line at info_batch_end().
+struct info_pending {
+    int key;
+    int removed;
+    int off, len; // encoded tag in arena
+};
+struct info_line {
+    bcf1_t *line;
+    int n, m;
+    struct info_pending *a;
+};
+
+KHASH_MAP_INIT_INT64(info_line, int)
+
+struct info_batch {
+    int n_line, m_line;
+    struct info_line *lines;
+    khash_t(info_line) *hash;
+    kstring_t arena;
+    kstring_t tmp;
+};
+
+// batch of current thread, NULL if updates are applied to the line directly
+static __thread struct info_batch *info_batch_curr = NULL;
+
+struct info_batch *info_batch_init()
+{
+    struct info_batch *b = malloc(sizeof(*b));
+    memset(b, 0, sizeof(*b));
+    b->hash = kh_init(info_line);
+    return b;
+}
+
+void info_batch_destroy(struct info_batch *b)
+{
+    int i;
+    for ( i = 0; i < b->m_line; ++i ) free(b->lines[i].a);
+    free(b->lines);
+    kh_destroy(info_line, b->hash);
+    free(b->arena.s);
+    free(b->tmp.s);
+    free(b);
+}
+
+void info_batch_begin(struct info_batch *b)
+{
+    info_batch_curr = b;
+}
+
+static struct info_line *info_batch_line(struct info_batch *b, bcf1_t *line, int create)
+{
+    khint_t k = kh_get(info_line, b->hash, (uint64_t)(size_t)line);
+    if ( k != kh_end(b->hash) ) return &b->lines[kh_val(b->hash, k)];
+    if ( create == 0 ) return NULL;
+    if ( b->n_line == b->m_line ) {
+        b->m_line = b->m_line == 0 ? 64 : b->m_line<<1;
+        b->lines = realloc(b->lines, b->m_line*sizeof(struct info_line));
+        memset(b->lines + b->n_line, 0, (b->m_line - b->n_line)*sizeof(struct info_line));
+    }
+    int ret;
+    k = kh_put(info_line, b->hash, (uint64_t)(size_t)line, &ret);
+    kh_val(b->hash, k) = b->n_line;
+    struct info_line *l = &b->lines[b->n_line++];
+    l->line = line;
+    l->n = 0;
+    return l;
+}
+
+static struct info_pending *info_line_get(struct info_line *l, int key)
+{
+    int i;
+    for ( i = 0; i < l->n; ++i )
+        if ( l->a[i].key == key ) return &l->a[i];
+    return NULL;
+}
+
+// Pending tag as an unpacked INFO, valid until the arena is changed.
+static void info_pending_unpack(struct info_batch *b, struct info_pending *p, bcf_info_t *inf)
+{
+    bcf_unpack_info_core1((uint8_t*)b->arena.s + p->off, inf);
+}
+
+// Pending tag of the line, appended if not updated yet, so new tags keep the order of first update.
+static struct info_pending *info_line_put(struct info_line *l, int key)
+{
+    struct info_pending *p = info_line_get(l, key);
+    if ( p == NULL ) {
+        if ( l->n == l->m ) {
+            l->m = l->m == 0 ? 8 : l->m<<1;
+            l->a = realloc(l->a, l->m*sizeof(struct info_pending));
+        }
+        p = &l->a[l->n++];
+        p->key = key;
+    }
+    return p;
+}
+
+static void info_batch_put(struct info_batch *b, bcf1_t *line, int key, const void *values, int n, int type)
+{
+    struct info_line *l = info_batch_line(b, line, 1);
+    struct info_pending *p = info_line_put(l, key);
+    p->removed = !n || (type==BCF_HT_STR && !values);
+    p->off = b->arena.l;
+    if ( p->removed == 0 ) bcf_info_encode(&b->arena, key, values, n, type);
+    p->len = b->arena.l - p->off;
+}
+
+// Merge pending tags into the line. The INFO block is encoded again in one pass and replace the old
+// one, so htslib does not need to re-serialize the record at output.
+static void info_batch_merge(struct info_batch *b, struct info_line *l)
+{
+    bcf1_t *line = l->line;
+    int i, j;
+    if ( l->n == 0 ) return;
+    if ( !(line->unpacked & BCF_UN_INFO) ) bcf_unpack(line, BCF_UN_INFO);
+
+    if ( line->shared.l == 0 || (line->d.shared_dirty & ~BCF1_DIRTY_INF) ) {
+        // other fields are changed, update the tags one by one and leave the record to htslib
+        for ( j = 0; j < l->n; ++j ) {
+            struct info_pending *p = &l->a[j];
+            for ( i = 0; i < line->n_info; ++i )
+                if ( line->d.info[i].key == p->key ) break;
+            if ( i == line->n_info ) i = -1;
+            if ( p->removed ) {
+                bcf_info_remove(line, i);
+                continue;
+            }
+            kstring_t str = {0,0,0};
+            kputsn(b->arena.s + p->off, p->len, &str);
+            bcf_info_install(line, i, str);
+        }
+        return;
+    }
+
+    // ID, alleles and FILTER are kept as they are
+    kstring_t *tmp = &b->tmp;
+    tmp->l = 0;
+    kputsn(line->shared.s, line->unpack_size[0] + line->unpack_size[1] + line->unpack_size[2], tmp);
+    int n_info = 0;
+    for ( j = 0; j < l->n; ++j ) l->a[j].len = -l->a[j].len - 1; // mark unused
+    for ( i = 0; i < line->n_info; ++i ) {
+        bcf_info_t *inf = &line->d.info[i];
+        struct info_pending *p = info_line_get(l, inf->key);
+        if ( p ) {
+            p->len = -p->len - 1;
+            if ( p->removed ) continue;
+            kputsn(b->arena.s + p->off, p->len, tmp);
+        }
+        else if ( inf->vptr ) {
+            kputsn((char*)inf->vptr - inf->vptr_off, inf->vptr_off + inf->vptr_len, tmp);
+        }
+        else continue;
+        n_info++;
+    }
+    for ( j = 0; j < l->n; ++j ) {
+        struct info_pending *p = &l->a[j];
+        if ( p->len >= 0 ) continue;
+        p->len = -p->len - 1;
+        if ( p->removed ) continue;
+        kputsn(b->arena.s + p->off, p->len, tmp);
+        n_info++;
+    }
+    for ( i = 0; i < line->d.m_info; ++i ) {
+        bcf_info_t *inf = &line->d.info[i];
+        if ( inf->vptr_free ) {
+            free(inf->vptr - inf->vptr_off);
+            inf->vptr_free = 0;
+        }
+    }
+    // swap the blocks, the old one is reused as buffer of next line
+    kstring_t shared = line->shared;
+    line->shared = *tmp;
+    *tmp = shared;
+    line->n_info = n_info;
+    line->d.shared_dirty &= ~BCF1_DIRTY_INF;
+    line->unpacked &= ~BCF_UN_INFO;
+}
+
+void info_batch_end(struct info_batch *b)
+{
+    int i;
+    for ( i = 0; i < b->n_line; ++i ) info_batch_merge(b, &b->lines[i]);
+    b->n_line = 0;
+    b->arena.l = 0;
+    kh_clear(info_line, b->hash);
+    info_batch_curr = NULL;
+}
+
+void info_batch_append(struct info_batch *b, struct info_batch *src)
+{
+    int i, j;
+    for ( i = 0; i < src->n_line; ++i ) {
+        struct info_line *s = &src->lines[i];
+        struct info_line *l = info_batch_line(b, s->line, 1);
+        for ( j = 0; j < s->n; ++j ) {
+            struct info_pending *q = &s->a[j];
+            struct info_pending *p = info_line_put(l, q->key);
+            p->removed = q->removed;
+            p->off = b->arena.l;
+            p->len = q->len;
+            kputsn(src->arena.s + q->off, q->len, &b->arena);
+        }
+    }
+    src->n_line = 0;
+    src->arena.l = 0;
+    kh_clear(info_line, src->hash);
+}
+
+int bcf_update_info_fixed(const bcf_hdr_t *hdr, bcf1_t *line, const char *key, const void *values, int n, int type)
+{
+    int inf_id = bcf_hdr_id2int(hdr,BCF_DT_ID,key);
+    if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_INFO,inf_id) ) return -1;    // No such INFO field in the header
+    return bcf_update_info_fixed_id(hdr, line, inf_id, values, n, type);
+}
+
+int bcf_update_info_fixed_id(const bcf_hdr_t *hdr, bcf1_t *line, int inf_id, const void *values, int n, int type)
+{
+    // Is the field already present?
+    int i;
+    const char *key = bcf_hdr_int2id(hdr, BCF_DT_ID, inf_id);
+    if ( !(line->unpacked & BCF_UN_INFO) ) bcf_unpack(line, BCF_UN_INFO);
+
+    for (i=0; i<line->n_info; i++)
+        if ( inf_id==line->d.info[i].key ) break;
+
+    if ( n==0 && !strcmp("END",key) )
+        line->rlen = line->n_allele ? strlen(line->d.allele[0]) : 0;
+
+    if ( info_batch_curr )
+        info_batch_put(info_batch_curr, line, inf_id, values, n, type);
+    else
+        bcf_update_info_core(line, inf_id, i==line->n_info ? -1 : i, values, n, type);
 
     if ( n==1 && !strcmp("END",key) ) line->rlen = ((int32_t*)values)[0] - line->pos;
     return 0;
 }
 
+int bcf_info_get_values(const bcf_info_t *info, void **dst, int *ndst, int type)
+{
+    int j;
+    if ( type==BCF_HT_FLAG ) return 1;
+    if ( type==BCF_HT_STR ) {
+        if ( *ndst < info->len+1 ) {
+            *ndst = info->len + 1;
+            *dst  = realloc(*dst, *ndst);
+        }
+        memcpy(*dst,info->vptr,info->len);
+        ((uint8_t*)*dst)[info->len] = 0;
+        return info->len;
+    }
+
+    // Make sure the buffer is big enough
+    int size1 = type==BCF_HT_INT ? sizeof(int32_t) : sizeof(float);
+    if ( *ndst < info->len ) {
+        *ndst = info->len;
+        *dst  = realloc(*dst, *ndst * size1);
+    }
+
+#define BRANCH(type_t, convert, is_missing, is_vector_end, set_missing, set_regular, out_type_t) { \
+        out_type_t *tmp = (out_type_t *) *dst;                          \
+        for (j=0; j<info->len; j++) {                                   \
+            type_t p = convert(info->vptr + j * sizeof(type_t));        \
+            if ( is_vector_end ) return j;                              \
+            if ( is_missing ) set_missing;                              \
+            else set_regular;                                           \
+            tmp++;                                                      \
+        }                                                               \
+        return j;                                                       \
+    }
+    switch (info->type) {
+        case BCF_BT_INT8:  BRANCH(int8_t,  le_to_i8,  p==bcf_int8_missing,  p==bcf_int8_vector_end,  *tmp=bcf_int32_missing, *tmp=p, int32_t); break;
+        case BCF_BT_INT16: BRANCH(int16_t, le_to_i16, p==bcf_int16_missing, p==bcf_int16_vector_end, *tmp=bcf_int32_missing, *tmp=p, int32_t); break;
+        case BCF_BT_INT32: BRANCH(int32_t, le_to_i32, p==bcf_int32_missing, p==bcf_int32_vector_end, *tmp=bcf_int32_missing, *tmp=p, int32_t); break;
+        case BCF_BT_FLOAT: BRANCH(uint32_t, le_to_u32, p==bcf_float_missing, p==bcf_float_vector_end, bcf_float_set_missing(*tmp), bcf_float_set(tmp, p), float); break;
+        default: error("Unexpected type %d", info->type);
+    }
+#undef BRANCH
+    return -4;
+}
+
+int bcf_get_info_values_id(bcf1_t *line, int key, void **dst, int *ndst, int type)
+{
+    int i;
+    struct info_line *l;
+    if ( info_batch_curr && (l = info_batch_line(info_batch_curr, line, 0)) ) {
+        // updated but not merged yet
+        struct info_pending *p = info_line_get(l, key);
+        if ( p ) {
+            if ( p->removed ) return type==BCF_HT_FLAG ? 0 : -3;
+            if ( type==BCF_HT_FLAG ) return 1;
+            bcf_info_t inf;
+            info_pending_unpack(info_batch_curr, p, &inf);
+            return bcf_info_get_values(&inf, dst, ndst, type);
+        }
+    }
+    if ( !(line->unpacked & BCF_UN_INFO) ) bcf_unpack(line, BCF_UN_INFO);
+    for ( i = 0; i < line->n_info; i++ )
+        if ( line->d.info[i].key == key ) break;
+    if ( i == line->n_info ) return type==BCF_HT_FLAG ? 0 : -3;  // the tag is not present in this record
+    if ( type==BCF_HT_FLAG ) return 1;
+    if ( !line->d.info[i].vptr ) return -3;  // the tag was marked for removal
+    return bcf_info_get_values(&line->d.info[i], dst, ndst, type);
+}
+
+// String tag is missing if not present or only '.'
+static int bcf_info_string_is_missing(bcf_info_t *inf)
+{
+    if ( inf->vptr == NULL || inf->len <= 0 ) return 1;
+    char *p = (char*)inf->vptr;
+    return p[0] == '.' && (inf->len == 1 || p[1] == 0);
+}
+
+int bcf_update_info_fixed_n(bcf1_t *line, struct info_update *u, int n)
+{
+    int i, j;
+    if ( !(line->unpacked & BCF_UN_INFO) ) bcf_unpack(line, BCF_UN_INFO);
+
+    // locate existing tags in one scan, tags may be appended later, so keep the index only
+    for ( j = 0; j < n; ++j ) u[j].idx = -1;
+    for ( i = 0; i < line->n_info; ++i ) {
+        for ( j = 0; j < n; ++j )
+            if ( u[j].key == line->d.info[i].key && u[j].idx == -1 ) u[j].idx = i;
+    }
+
+    if ( info_batch_curr ) {
+        struct info_batch *b = info_batch_curr;
+        for ( j = 0; j < n; ++j ) {
+            if ( u[j].skip ) continue;
+            if ( u[j].replace == REPLACE_MISSING && u[j].type == BCF_HT_STR ) {
+                struct info_line *l = info_batch_line(b, line, 0);
+                struct info_pending *p = l ? info_line_get(l, u[j].key) : NULL;
+                bcf_info_t inf;
+                if ( p && p->removed == 0 ) info_pending_unpack(b, p, &inf);
+                if ( p ? p->removed == 0 && !bcf_info_string_is_missing(&inf)
+                     : u[j].idx != -1 && !bcf_info_string_is_missing(&line->d.info[u[j].idx]) ) continue;
+            }
+            info_batch_put(b, line, u[j].key, u[j].values, u[j].n, u[j].type);
+        }
+        return 0;
+    }
+
+    for ( j = 0; j < n; ++j ) {
+        if ( u[j].skip ) continue;
+        if ( u[j].replace == REPLACE_MISSING && u[j].type == BCF_HT_STR && u[j].idx != -1
+             && !bcf_info_string_is_missing(&line->d.info[u[j].idx]) ) continue;
+        int idx = bcf_update_info_core(line, u[j].key, u[j].idx, u[j].values, u[j].n, u[j].type);
+        // same tag may be updated again by a later entry, point it to the appended one
+        if ( u[j].idx == -1 ) {
+            for ( i = j + 1; i < n; ++i )
+                if ( u[i].key == u[j].key ) u[i].idx = idx;
+        }
+    }
+    return 0;
+}
@@ -37,6 +37,8 @@ struct anno_col {
     int number;
     // tag name
     char *hdr_key;
+    // id of tag in output header, resolved at init so setters need no hash lookup
+    int hdr_id;
     // setter function
     setter_func func;
     // point to hdr names, do not free it
@@ -46,6 +48,44 @@ struct anno_col {
 
 extern void anno_col_copy(struct anno_col *src, struct anno_col *dest);
 extern int bcf_update_info_fixed(const bcf_hdr_t *hdr, bcf1_t *line, const char *key, const void *values, int n, int type);
+// Same as bcf_update_info_fixed(), but the tag is specified by header id.
+extern int bcf_update_info_fixed_id(const bcf_hdr_t *hdr, bcf1_t *line, int key, const void *values, int n, int type);
+// Same as bcf_get_info_values(), but the tag is specified by header id, caller should make sure type of tag is matched.
+extern int bcf_get_info_values_id(bcf1_t *line, int key, void **dst, int *ndst, int type);
+// Convert values of a located INFO tag, return number of values.
+extern int bcf_info_get_values(const bcf_info_t *info, void **dst, int *ndst, int type);
+
+// One INFO tag to update in bcf_update_info_fixed_n(), key is the header id of tag.
+struct info_update {
+    int key;
+    int type;
+    int replace;
+    // set to skip this tag for current line
+    int skip;
+    // 0 or NULL string to remove the tag
+    int n;
+    const void *values;
+    // used internally, index in line->d.info
+    int idx;
+};
+
+// Update a set of INFO tags with one scan of line->d.info. For string tags in REPLACE_MISSING
+// mode, existing non-missing values are kept.
+extern int bcf_update_info_fixed_n(bcf1_t *line, struct info_update *u, int n);
+
+// Per thread INFO accumulator. Between info_batch_begin() and info_batch_end(), INFO updates of this
+// thread through the functions above are encoded into the batch instead of the lines, and reading
+// the tags returns the pending values. info_batch_end() merges all updated lines in one pass each,
+// so it must be called before the lines are written. info_batch_begin(NULL) detaches the batch of
+// this thread without merging it.
+struct info_batch;
+extern struct info_batch *info_batch_init();
+extern void info_batch_destroy(struct info_batch *b);
+extern void info_batch_begin(struct info_batch *b);
+extern void info_batch_end(struct info_batch *b);
+// Move the updates of src into b as if they were made after the updates of b, src is emptied. For
+// batches filled by annotators running on the same lines in different threads.
+extern void info_batch_append(struct info_batch *b, struct info_batch *src);
 
 #define bcf_update_info_int32_fixed(hdr,line,key,values,n)   bcf_update_info_fixed((hdr),(line),(key),(values),(n),BCF_HT_INT)
 #define bcf_update_info_float_fixed(hdr,line,key,values,n)   bcf_update_info_fixed((hdr),(line),(key),(values),(n),BCF_HT_REAL)
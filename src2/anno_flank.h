@@ -3,10 +3,13 @@
 
 #include "utils.h"
 #include "htslib/faidx.h"
+#include "seq_cache.h"
 
 struct seqidx {
     const char *file;
     faidx_t *idx;
+    // per thread window of reference
+    struct seq_window *win;
 };
 
 #endif 
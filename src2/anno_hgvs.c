@@ -517,7 +517,8 @@ static int anno_hgvs_setter_hgvsnom(struct anno_hgvs_file *file, bcf_hdr_t *hdr,
     for ( i = 0; i < file->n_col; ++i ) {
         struct anno_col *col = &file->cols[i];
         if ( col->replace == REPLACE_MISSING ) {
-            int ret = bcf_get_info_string(hdr, line, col->hdr_key, &file->tmps, &file->mtmps);
+            // pending values of the batch are visible through bcf_get_info_values_id()
+            int ret = bcf_get_info_values_id(line, bcf_hdr_id2int(hdr, BCF_DT_ID, col->hdr_key), (void**)&file->tmps, &file->mtmps, BCF_HT_STR);
             if ( ret > 0 && (file->tmps[0]!= '.' || file->tmps[1] != 0 ) ) continue;
         }
         bcf_update_info_string_fixed(hdr, line, col->hdr_key, str[i].s);
@@ -832,25 +833,21 @@ int bcfanno_hgvs()
     
     for ( ;; ) {
         struct anno_pool *arg = anno_reader(args.fp_input, args.hdr_out, args.n_record);
-        if ( arg->n_reader == 0 )
+        if ( arg->n_reader == 0 ) {
+            anno_pool_release(arg);
             break;
+        }
         arg->arg = &args;
-        int block;
-        do {
-            block = thread_pool_dispatch2(p, q, anno_hgvs, arg, 1);
-            if ( ( r = thread_pool_next_result(q) ) ) {
-                // generate output
-                struct anno_pool *data = (struct anno_pool*)r->data;
-                int i;
-                for ( i = 0; i < data->n_reader; ++i ) {
-                    bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
-                    bcf_destroy(data->readers[i]);
-                }
-                free(data->readers);
-                thread_pool_delete_result(r, 1);
-            }
-            // flush output
-        } while ( block == -1);
+        // sleep until the input queue has room, and write the ordered results meanwhile
+        while ( thread_pool_dispatch3(p, q, anno_hgvs, arg, &r) == 1 ) {
+            // generate output
+            struct anno_pool *data = (struct anno_pool*)r->data;
+            int i;
+            for ( i = 0; i < data->n_reader; ++i )
+                bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
+            anno_pool_release(data);
+            thread_pool_delete_result(r, 0);
+        }
     }
 
     thread_pool_process_flush(q);
@@ -858,15 +855,14 @@ int bcfanno_hgvs()
         // generate output
         struct anno_pool *data = (struct anno_pool*)r->data;
         int i;
-        for ( i = 0; i < data->n_reader; ++i ) {
+        for ( i = 0; i < data->n_reader; ++i )
             bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
-            bcf_destroy(data->readers[i]);
-        }
-        free(data->readers);
-        thread_pool_delete_result(r, 1);
+        anno_pool_release(data);
+        thread_pool_delete_result(r, 0);
     }
     thread_pool_process_destroy(q);
     thread_pool_destroy(p);
+    anno_pool_freelist_destroy();
     return 0;
 }
 
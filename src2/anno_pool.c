@@ -1,20 +1,113 @@
 // anno_pool.c - A pool of bcf structure
 #include "anno_pool.h"
 #include "utils.h"
+#include <pthread.h>
+#include "htslib/kseq.h"
 
-static struct anno_pool *anno_pool_init(int m)
-{    
-    struct anno_pool *p = malloc(sizeof(*p));
+// Released pools are kept in a free list, and reused by next chunks with their bcf
+// records, so steady-state annotation does not allocate per record.
+static struct {
+    pthread_mutex_t lock;
+    struct anno_pool *head;
+    uint64_t n_get;
+    uint64_t n_reuse;
+} freelist = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .head = NULL,
+    .n_get = 0,
+    .n_reuse = 0,
+};
+
+struct anno_pool *anno_pool_init(int m)
+{
+    struct anno_pool *p, **pp, *small = NULL;
+    pthread_mutex_lock(&freelist.lock);
+    freelist.n_get++;
+    // pools share the same size, except records per pool are adapted by anno_tune.c, so a
+    // larger pool is also reused and readers stop at the requested number. Smaller pools
+    // met on the way are freed, the tuner has grown past them.
+    for ( pp = &freelist.head; *pp; ) {
+        p = *pp;
+        if ( p->m >= m ) break;
+        *pp = p->next;
+        p->next = small;
+        small = p;
+    }
+    p = *pp;
+    if ( p ) {
+        *pp = p->next;
+        freelist.n_reuse++;
+    }
+    pthread_mutex_unlock(&freelist.lock);
+    while ( small ) {
+        struct anno_pool *next = small->next;
+        anno_pool_destroy(small);
+        small = next;
+    }
+    if ( p ) {
+        p->next = NULL;
+        return p;
+    }
+    
+    p = malloc(sizeof(*p));
     memset(p, 0, sizeof(*p));
     p->m = m;
     p->readers = malloc(m * sizeof(bcf1_t*));
+    int i;
+    for ( i = 0; i < m; ++i )
+        p->readers[i] = bcf_init();
     return p;
 }
 
+// Return the pool to the free list. The bcf records are kept and will be cleared by
+// bcf_read() or vcf_parse() when reused.
+void anno_pool_release(struct anno_pool *pool)
+{
+    pool->n_reader = 0;
+    pool->i_chunk = 0;
+    pool->n_chunk = 0;
+    pool->curr_start = 0;
+    pool->curr_end = 0;
+    pool->curr_line = NULL;
+    pool->n_bound = 0;
+    pool->max_gap = 0;
+    pool->n_lines = 0;
+    pool->formatted.l = 0;
+    pool->arg = NULL;
+    
+    pthread_mutex_lock(&freelist.lock);
+    pool->next = freelist.head;
+    freelist.head = pool;
+    pthread_mutex_unlock(&freelist.lock);
+}
+
+// Free all pools in the free list.
+void anno_pool_freelist_destroy(void)
+{
+    pthread_mutex_lock(&freelist.lock);
+    while ( freelist.head ) {
+        struct anno_pool *p = freelist.head;
+        freelist.head = p->next;
+        anno_pool_destroy(p);
+    }
+    pthread_mutex_unlock(&freelist.lock);
+}
+
+// Percentage of pools taken from the free list instead of allocated.
+double anno_pool_reuse_rate(void)
+{
+    double rate;
+    pthread_mutex_lock(&freelist.lock);
+    rate = freelist.n_get == 0 ? 0 : (double)freelist.n_reuse/freelist.n_get*100;
+    pthread_mutex_unlock(&freelist.lock);
+    return rate;
+}
+
 void update_chunk_region(struct anno_pool *pool)
 {
     int i_chunk;
     int start = -1, end = -1, last_rid = -1, last_pos = -1;
+    int max_gap = pool->max_gap > 0 ? pool->max_gap : CHUNK_MAX_GAP;
     pool->curr_line = pool->readers[pool->n_chunk];
     start = pool->curr_line->pos;
     last_rid = pool->curr_line->rid;
@@ -25,7 +118,7 @@ void update_chunk_region(struct anno_pool *pool)
         if ( last_rid == -1 ) last_rid = rid;
         if ( last_rid != rid ) break;
         if ( start == -1 ) start = pos;        
-        if ( last_pos != -1 && pos - last_pos > CHUNK_MAX_GAP ) break;
+        if ( last_pos != -1 && pos - last_pos > max_gap ) break;
         last_pos = pos;
         end = pos;
     }
@@ -37,19 +130,195 @@ void update_chunk_region(struct anno_pool *pool)
     pool->n_chunk = i_chunk;
 }
 
+// Split the records into annotation chunks in the same way as update_chunk_region(), so the
+// chunks can be annotated apart and give the same result. Return the number of chunks.
+int anno_pool_chunks(struct anno_pool *pool)
+{
+    if ( pool->bounds == NULL ) pool->bounds = malloc((pool->m+1)*sizeof(int));
+    pool->n_bound = 0;
+    pool->n_chunk = 0;
+    while ( pool->n_chunk < pool->n_reader ) {
+        pool->bounds[pool->n_bound++] = pool->n_chunk;
+        update_chunk_region(pool);
+    }
+    pool->bounds[pool->n_bound] = pool->n_reader;
+    pool->i_chunk = 0;
+    pool->n_chunk = 0;
+    pool->curr_line = NULL;
+    return pool->n_bound;
+}
+
 
 struct anno_pool *anno_reader(htsFile *fp, bcf_hdr_t *hdr, int n_record) {
     
     struct anno_pool *p = anno_pool_init(n_record);
     
     for ( ;; ) {
-        p->readers[p->n_reader] = bcf_init();
         if ( bcf_read(fp, hdr, p->readers[p->n_reader]) )
             break;
         p->n_reader++;
-        if ( p->n_reader == p->m )
+        if ( p->n_reader == n_record )
             break;        
     }
     return p;
 }
 
+
+// Read raw VCF lines without parsing. BGZF blocks are inflated by the htslib thread pool
+// attached to fp, and the lines will be parsed by anno_pool_parse() in the worker threads.
+struct anno_pool *anno_reader_lines(htsFile *fp, int n_record)
+{
+    struct anno_pool *p = anno_pool_init(n_record);
+    if ( p->lines == NULL )
+        p->lines = calloc(p->m, sizeof(kstring_t));
+    
+    for ( ;; ) {
+        if ( hts_getline(fp, KS_SEP_LINE, &p->lines[p->n_lines]) < 0 )
+            break;
+        p->n_lines++;
+        if ( p->n_lines == n_record )
+            break;
+    }
+    return p;
+}
+
+// Read records of a region by index iterator, records start before beg are skipped because they
+// are read by the previous region. For bgzipped VCF, raw lines are kept and parsed later by
+// anno_pool_parse() like anno_reader_lines().
+struct anno_pool *anno_reader_region(htsFile *fp, tbx_t *tbx, hts_itr_t *itr, int beg, int n_record)
+{
+    struct anno_pool *p = anno_pool_init(n_record);
+    int ret = 0;
+    if ( tbx ) {
+        if ( p->lines == NULL )
+            p->lines = calloc(p->m, sizeof(kstring_t));
+        while ( p->n_lines < n_record ) {
+            kstring_t *str = &p->lines[p->n_lines];
+            if ( (ret = tbx_itr_next(fp, tbx, itr, str)) < 0 ) break;
+            char *pos = strchr(str->s, '\t');
+            if ( pos && atoi(pos+1) - 1 < beg ) continue;
+            p->n_lines++;
+        }
+    }
+    else {
+        while ( p->n_reader < n_record ) {
+            if ( (ret = bcf_itr_next(fp, itr, p->readers[p->n_reader])) < 0 ) break;
+            if ( p->readers[p->n_reader]->pos < beg ) continue;
+            p->n_reader++;
+        }
+    }
+    if ( ret < -1 ) error("Failed to read input records by index.");
+    return p;
+}
+
+// Check the CHROM, FILTER, INFO and FORMAT keys of a raw VCF line are all defined in the
+// header. vcf_parse() appends dummy header records for undefined keys, which is not safe
+// while other threads are reading the header. Called with the read lock of header.
+static int vcf_line_keys_defined(bcf_hdr_t *hdr, char *s)
+{
+    kstring_t key = {0,0,0};
+    int i, ret = 1;
+    char *p = s, *q;
+    for ( i = 0; i < 9 && ret == 1; ++i ) {
+        q = p;
+        while ( *q && *q != '\t' ) ++q;
+        if ( i == 0 ) {
+            key.l = 0;
+            kputsn(p, q-p, &key);
+            if ( bcf_hdr_name2id(hdr, key.s) < 0 ) ret = 0;
+        }
+        else if ( (i == 6 || i == 7 || (i == 8 && bcf_hdr_nsamples(hdr))) && !(q - p == 1 && *p == '.') ) {
+            int type = i == 6 ? BCF_HL_FLT : i == 7 ? BCF_HL_INFO : BCF_HL_FMT;
+            char sep = i == 6 || i == 7 ? ';' : ':';
+            char *r = p, *t;
+            while ( r < q ) {
+                for ( t = r; t < q && *t != sep && *t != '='; ++t );
+                key.l = 0;
+                kputsn(r, t-r, &key);
+                if ( key.l && !bcf_hdr_idinfo_exists(hdr, type, bcf_hdr_id2int(hdr, BCF_DT_ID, key.s)) ) {
+                    ret = 0;
+                    break;
+                }
+                while ( t < q && *t != sep ) ++t;
+                r = t + 1;
+            }
+        }
+        if ( *q == 0 ) break;
+        p = q + 1;
+    }
+    if ( key.m ) free(key.s);
+    return ret;
+}
+
+static pthread_rwlock_t hdr_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void anno_hdr_rdlock(void)
+{
+    pthread_rwlock_rdlock(&hdr_lock);
+}
+
+void anno_hdr_unlock(void)
+{
+    pthread_rwlock_unlock(&hdr_lock);
+}
+
+// Parse the raw lines into bcf records. Return 0 on success, -1 on failure.
+int anno_pool_parse(struct anno_pool *pool, bcf_hdr_t *hdr)
+{
+    int i, ret = 0;
+    // vcf_parse() keeps FORMAT fields in the scratch string of header, so threads parse with a
+    // copy of the header struct holding the scratch of pool, taken again after each write lock
+    bcf_hdr_t local;
+    pthread_rwlock_rdlock(&hdr_lock);
+    local = *hdr;
+    for ( i = 0; i < pool->n_lines && ret == 0; ++i ) {
+        pool->n_reader++;
+        if ( vcf_line_keys_defined(hdr, pool->lines[i].s) ) {
+            local.mem = pool->mem;
+            ret = vcf_parse(&pool->lines[i], &local, pool->readers[i]);
+            pool->mem = local.mem;
+            continue;
+        }
+        // wait until no thread reads the header, the key is defined only once
+        pthread_rwlock_unlock(&hdr_lock);
+        pthread_rwlock_wrlock(&hdr_lock);
+        ret = vcf_parse(&pool->lines[i], hdr, pool->readers[i]);
+        pthread_rwlock_unlock(&hdr_lock);
+        pthread_rwlock_rdlock(&hdr_lock);
+        local = *hdr;
+    }
+    pthread_rwlock_unlock(&hdr_lock);
+    if ( ret ) return -1;
+    pool->n_lines = 0;
+    return 0;
+}
+
+// Format annotated records into VCF text.
+int anno_pool_format(struct anno_pool *pool, bcf_hdr_t *hdr)
+{
+    int i;
+    pool->formatted.l = 0;
+    for ( i = 0; i < pool->n_reader; ++i ) {
+        if ( vcf_format(hdr, pool->readers[i], &pool->formatted) )
+            return -1;
+    }
+    return 0;
+}
+
+void anno_pool_destroy(struct anno_pool *pool)
+{
+    int i;
+    for ( i = 0; i < pool->m; ++i )
+        bcf_destroy(pool->readers[i]);
+    free(pool->readers);
+    if ( pool->lines ) {
+        for ( i = 0; i < pool->m; ++i )
+            if ( pool->lines[i].m ) free(pool->lines[i].s);
+        free(pool->lines);
+    }
+    if ( pool->ords ) free(pool->ords);
+    if ( pool->bounds ) free(pool->bounds);
+    if ( pool->formatted.m ) free(pool->formatted.s);
+    if ( pool->mem.m ) free(pool->mem.s);
+    free(pool);
+}
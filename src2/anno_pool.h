@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include "htslib/vcf.h"
 #include "htslib/hts.h"
+#include "htslib/tbx.h"
 
 #define RECORDS_PER_CHUNK 1000
 #define CHUNK_MAX_GAP 10000
@@ -20,11 +21,59 @@ struct anno_pool {
     int curr_start;
     int curr_end;
     bcf1_t *curr_line; // point to top of each chunk in the readers
+    // max gap between records in a chunk, CHUNK_MAX_GAP if 0, see anno_tune.h
+    int max_gap;
+
+    // boundaries of the annotation chunks, filled by anno_pool_chunks(), chunk i covers the
+    // readers [bounds[i], bounds[i+1])
+    int n_bound;
+    int *bounds;
+
+    // raw VCF lines read by anno_reader_lines(), parsed later by anno_pool_parse() in
+    // the worker thread, so the main thread only splits lines
+    int n_lines;
+    kstring_t *lines;
+    // scratch of vcf_parse() for FORMAT fields, used instead of the one in shared header
+    kstring_t mem;
+
+    // input ordinals of the records, only for unsorted input, see anno_sort.c
+    uint64_t *ords;
+
+    // annotated records in VCF text, filled by anno_pool_format() in the worker thread
+    // and written by the writer thread in one go
+    kstring_t formatted;
     
     void *arg;
+
+    // next released pool in the free list
+    struct anno_pool *next;
 };
 
+extern struct anno_pool *anno_pool_init(int m);
+
 extern struct anno_pool *anno_reader(htsFile *fp, bcf_hdr_t *hdr, int n_record);
 
+extern struct anno_pool *anno_reader_lines(htsFile *fp, int n_record);
+
+extern struct anno_pool *anno_reader_region(htsFile *fp, tbx_t *tbx, hts_itr_t *itr, int beg, int n_record);
+
+extern int anno_pool_parse(struct anno_pool *pool, bcf_hdr_t *hdr);
+// Input header may get dummy records of undefined keys in anno_pool_parse(), so threads
+// annotating or writing records hold the read lock of header meanwhile.
+extern void anno_hdr_rdlock(void);
+extern void anno_hdr_unlock(void);
+
+extern int anno_pool_format(struct anno_pool *pool, bcf_hdr_t *hdr);
+
+extern void anno_pool_destroy(struct anno_pool *pool);
+
+extern void anno_pool_release(struct anno_pool *pool);
+
+extern void anno_pool_freelist_destroy(void);
+
+extern double anno_pool_reuse_rate(void);
+
 extern void update_chunk_region(struct anno_pool *pool);
+
+extern int anno_pool_chunks(struct anno_pool *pool);
 #endif
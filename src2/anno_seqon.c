@@ -4,6 +4,8 @@
 #include "gea.h"
 #include "sort_list.h"
 #include "stack_lite.h"
+#include "faidx_def.h"
+#include "htslib/kseq.h"
 
 static char *safe_duplicate_string(char *str)
 {
@@ -89,8 +91,44 @@ struct {
     .donor_region = 3,
 };
 
+struct {
+    size_t rna_cache_size; // bytes of transcript sequences cached per thread
+    int preload; // load whole GEA database into memory
+} mc_handler_options = {
+    .rna_cache_size = 64<<20,
+    .preload = 0,
+};
+
+void mc_handler_set_rna_cache_size(size_t bytes)
+{
+    mc_handler_options.rna_cache_size = bytes;
+}
+void mc_handler_set_preload(int preload)
+{
+    mc_handler_options.preload = preload;
+}
+
+// Whole GEA database loaded in memory, shared read-only by all handlers. Records of each contig are kept in
+// file order, which is sorted by chromStart, and max_end[i] is the largest chromEnd of records[0..i], so the
+// records overlapped with a region are located by two binary searches.
+struct gea_preload_ctg {
+    int n, m;
+    struct gea_record **records;
+    int *max_end;
+};
+struct gea_preload {
+    int n_ctg; // indexed by tabix id
+    struct gea_preload_ctg *ctg;
+    int n_record;
+};
+
+static int mc_handler_record_skip(struct mc_handler *h, struct gea_record *r);
+static struct gea_preload *gea_preload_init(struct mc_handler *h);
+static void gea_preload_destroy(struct gea_preload *p);
+
 int file_is_GEA(const char *fn)
 {
+    if ( bgea_check_format(fn) == 0 ) return 0;
     return gea_check_format(fn);
 }
 
@@ -114,18 +152,46 @@ struct mc_handler *mc_handler_init(const char *rna_fname, const char *data_fname
     h->rna_fai = fai_load(rna_fname);
     
     if ( h->rna_fai == NULL ) error("Failed to load index of %s : %s.", rna_fname, strerror(errno));
-    if ( gea_check_format(data_fname) ) error("Unsupported data format. Please try GenomeElementAnnotation format. %s.", data_fname);
+    h->rna_cache = seq_cache_init(h->rna_fai, mc_handler_options.rna_cache_size);
+    if ( reference_fname ) {
+        h->ref_fai = fai_load(reference_fname);
+        if ( h->ref_fai == NULL ) warnings("Failed to load index of %s : %s.", reference_fname, strerror(errno));
+        else h->ref_win = seq_window_init(h->ref_fai, SEQ_WINDOW_SIZE);
+    }
+    if ( bgea_check_format(data_fname) == 0 ) {
+        h->fp_bgea = bgzf_open(data_fname, "r");
+        if ( h->fp_bgea == NULL ) error("%s : %s.", data_fname, strerror(errno));
+
+        h->idx = tbx_index_load(data_fname);
+        if ( h->idx == NULL ) error("Failed to load index of %s : %s.", data_fname, strerror(errno));
+
+        h->hdr = bgea_hdr_read(h->fp_bgea);
+        if ( h->hdr == NULL ) error("Failed to read header of %s.", data_fname);
+        h->tid_map = bgea_tid_map(h->hdr, h->idx);
+    }
+    else {
+        if ( gea_check_format(data_fname) ) error("Unsupported data format. Please try GenomeElementAnnotation format. %s.", data_fname);
     
-    h->fp_idx = hts_open(data_fname, "r");
-    if ( h->fp_idx == NULL ) error("%s : %s.", data_fname, strerror(errno));
+        h->fp_idx = hts_open(data_fname, "r");
+        if ( h->fp_idx == NULL ) error("%s : %s.", data_fname, strerror(errno));
     
-    h->idx = tbx_index_load(data_fname);
-    if ( h->idx == NULL ) error("Failed to load index of %s : %s.", data_fname, strerror(errno));
+        h->idx = tbx_index_load(data_fname);
+        if ( h->idx == NULL ) error("Failed to load index of %s : %s.", data_fname, strerror(errno));
 
-    h->hdr = gea_hdr_read(h->fp_idx);
-    if ( h->hdr == NULL ) error("Failed to read header of %s.", data_fname);
+        h->hdr = gea_hdr_read(h->fp_idx);
+        if ( h->hdr == NULL ) error("Failed to read header of %s.", data_fname);
+    }
     
     if ( name_list ) h->name_hash = name_hash_init(name_list);
+
+    if ( mc_handler_options.preload ) {
+        h->preload = gea_preload_init(h);
+        // all the records are in memory now, close the database
+        if ( h->fp_bgea ) bgzf_close(h->fp_bgea);
+        else hts_close(h->fp_idx);
+        h->fp_bgea = NULL;
+        h->fp_idx = NULL;
+    }
     
     return h;
 }
@@ -138,9 +204,27 @@ struct mc_handler *mc_handler_duplicate(struct mc_handler *h)
     d->data_fname = h->data_fname;
     d->reference_fname = h->reference_fname;
     
-    d->rna_fai = fai_load(d->rna_fname);
-    d->idx = tbx_index_load(d->data_fname);
-    d->fp_idx = hts_open(d->data_fname, "r");
+    // indexes are read-only, share them and only reopen the files
+    d->rna_fai = faidx_share(h->rna_fai, d->rna_fname);
+    d->rna_cache = seq_cache_init(d->rna_fai, mc_handler_options.rna_cache_size);
+    if ( h->ref_fai ) {
+        d->ref_fai = faidx_share(h->ref_fai, d->reference_fname);
+        d->ref_win = seq_window_init(d->ref_fai, SEQ_WINDOW_SIZE);
+    }
+    d->idx = h->idx;
+    d->preload = h->preload;
+    d->tid_map = h->tid_map;
+    if ( h->preload ) {
+        // preloaded records are shared, no need to open the database
+    }
+    else if ( h->fp_bgea ) {
+        d->fp_bgea = bgzf_open(d->data_fname, "r");
+        if ( d->fp_bgea == NULL ) error("%s : %s.", d->data_fname, strerror(errno));
+    }
+    else {
+        d->fp_idx = hts_open(d->data_fname, "r");
+        if ( d->fp_idx == NULL ) error("%s : %s.", d->data_fname, strerror(errno));
+    }
 
     d->hdr = h->hdr;
     d->name_hash = h->name_hash;    
@@ -148,13 +232,30 @@ struct mc_handler *mc_handler_duplicate(struct mc_handler *h)
 }
 void mc_handler_destroy(struct mc_handler *h, int l)
 {
-    fai_destroy(h->rna_fai);
-    tbx_destroy(h->idx);
-    hts_close(h->fp_idx);
-    if (l==0) gea_hdr_destroy(h->hdr);
+    if ( h->fp_bgea ) bgzf_close(h->fp_bgea);
+    if ( h->fp_idx ) hts_close(h->fp_idx);
+    seq_cache_destroy(h->rna_cache);
+    if ( h->ref_win ) seq_window_destroy(h->ref_win);
+    if (l==0) {
+        fai_destroy(h->rna_fai);
+        if ( h->ref_fai ) fai_destroy(h->ref_fai);
+        tbx_destroy(h->idx);
+        if ( h->tid_map ) bgea_tid_map_destroy(h->tid_map);
+        if ( h->preload ) gea_preload_destroy(h->preload);
+        gea_hdr_destroy(h->hdr);
+    }
+    else {
+        faidx_share_destroy(h->rna_fai);
+        if ( h->ref_fai ) faidx_share_destroy(h->ref_fai);
+    }
     int i;
-    for ( i = 0; i < h->n_record; ++i ) gea_destroy((struct gea_record*)h->records[i]);
-    if ( h->n_record) free(h->records);
+    // preloaded records are owned by gea_preload
+    if ( h->preload == NULL )
+        for ( i = 0; i < h->n_record; ++i ) gea_destroy((struct gea_record*)h->records[i]);
+    for ( i = 0; i < h->n_free; ++i ) gea_destroy((struct gea_record*)h->free_records[i]);
+    if ( h->m_record ) free(h->records);
+    if ( h->m_free ) free(h->free_records);
+    if ( h->str.m ) free(h->str.s);
     free(h);
 }
 
@@ -267,10 +368,34 @@ int mc_destroy(struct mc *h)
     return 0;
 }
 
+// Records are recycled between chunks, parse buffers of gea_record keep their capacity.
+static struct gea_record *mc_handler_record_get(struct mc_handler *h)
+{
+    if ( h->n_free > 0 ) return (struct gea_record*)h->free_records[--h->n_free];
+    return gea_init();
+}
+static void mc_handler_record_put(struct mc_handler *h, struct gea_record *r)
+{
+    if ( h->preload ) return;
+    if ( h->n_free == h->m_free ) {
+        h->m_free = h->m_free == 0 ? 32 : h->m_free<<1;
+        h->free_records = realloc(h->free_records, h->m_free*sizeof(void*));
+    }
+    h->free_records[h->n_free++] = r;
+}
+static void mc_handler_record_push(struct mc_handler *h, struct gea_record *r)
+{
+    if ( h->n_record == h->m_record ) {
+        h->m_record = h->m_record == 0 ? 32 : h->m_record<<1;
+        h->records = realloc(h->records, h->m_record*sizeof(void*));
+    }
+    h->records[h->n_record++] = r;
+}
+
 static void clean_buffer_chunk(struct mc_handler *h)
 {
     int i;
-    for ( i = 0; i < h->n_record; ++i ) gea_destroy((struct gea_record*)h->records[i]);
+    for ( i = 0; i < h->n_record; ++i ) mc_handler_record_put(h, (struct gea_record*)h->records[i]);
     h->n_record = 0;
     h->i_record = 0;
     h->end_pos_for_skip = 0;
@@ -278,61 +403,149 @@ static void clean_buffer_chunk(struct mc_handler *h)
     h->next_gene = NULL;
 }
 
-struct list_buffer {
-    struct list_buffer *next;
-    struct gea_record  *data;
-};
-struct list_buffer *list_buffer_create()
+// Return 1 if record is filtered by the name list.
+static int mc_handler_record_skip(struct mc_handler *h, struct gea_record *r)
 {
-    struct list_buffer *l = calloc(1, sizeof(*l));
+    if ( h->name_hash == NULL ) return 0;
+    if ( gea_is_transcript(h->hdr, r) ) {
+        if (!name_hash_key_exists(h->name_hash, r->name)) return 1;
+    }
+    else if ( strcmp(h->hdr->id[GEA_DT_BIOTYPE][r->biotype].key, "gene") == 0 ) {
+        if (!name_hash_key_exists(h->name_hash, r->geneName)) return 1;
+    }
+    return 0;
+}
+
+static struct gea_preload *gea_preload_init(struct mc_handler *h)
+{
+    struct gea_preload *p = malloc(sizeof(*p));
+    const char **names = tbx_seqnames(h->idx, &p->n_ctg);
+    if ( names ) free(names);
+    p->ctg = calloc(p->n_ctg > 0 ? p->n_ctg : 1, sizeof(struct gea_preload_ctg));
+    p->n_record = 0;
+    
+    struct gea_record *r = NULL;
+    int tid;
+    for ( ;; ) {
+        if ( r == NULL ) r = gea_init();
+        if ( h->fp_bgea ) {
+            int ret = bgea_read(h->fp_bgea, h->hdr, r);
+            if ( ret == -1 ) break;
+            if ( ret < 0 ) error("Failed to read %s.", h->data_fname);
+            tid = h->tid_map->tids[r->rid];
+        }
+        else {
+            if ( hts_getline(h->fp_idx, KS_SEP_LINE, &h->str) < 0 ) break;
+            if ( gea_parse(&h->str, h->hdr, r) ) continue;
+            tid = tbx_name2id(h->idx, h->hdr->id[GEA_DT_CTG][r->rid].key);
+        }
+        if ( tid < 0 ) continue;
+        if ( mc_handler_record_skip(h, r) ) continue;
+
+        // unpack INFO as well, so records are never modified after loaded
+        gea_unpack(h->hdr, r, GEA_UN_TRANS|GEA_UN_CIGAR|GEA_UN_INFO);
+
+        struct gea_preload_ctg *c = &p->ctg[tid];
+        if ( c->n && c->records[c->n-1]->chromStart > r->chromStart )
+            error("%s is not sorted, %s:%d.", h->data_fname, h->hdr->id[GEA_DT_CTG][r->rid].key, r->chromStart);
+        if ( c->n == c->m ) {
+            c->m = c->m == 0 ? 32 : c->m<<1;
+            c->records = realloc(c->records, c->m*sizeof(void*));
+            c->max_end = realloc(c->max_end, c->m*sizeof(int));
+        }
+        c->max_end[c->n] = c->n && c->max_end[c->n-1] > r->chromEnd ? c->max_end[c->n-1] : r->chromEnd;
+        c->records[c->n++] = r;
+        p->n_record++;
+        r = NULL;
+    }
+    if ( r ) gea_destroy(r);
+    return p;
+}
+
+static void gea_preload_destroy(struct gea_preload *p)
+{
+    int i, j;
+    for ( i = 0; i < p->n_ctg; ++i ) {
+        struct gea_preload_ctg *c = &p->ctg[i];
+        for ( j = 0; j < c->n; ++j ) gea_destroy(c->records[j]);
+        if ( c->m ) {
+            free(c->records);
+            free(c->max_end);
+        }
+    }
+    free(p->ctg);
+    free(p);
+}
+
+// Same as retrieve_gea_records_from_region(), but from preloaded records.
+static int preload_gea_records_from_region(struct mc_handler *h, int id, int start, int end, int *tail_edge)
+{
+    *tail_edge = 0;
+    if ( id >= h->preload->n_ctg ) return 0;
+    struct gea_preload_ctg *c = &h->preload->ctg[id];
+    int lo, hi, i, j, l = 0;
+    // first record with max_end > start
+    for ( i = 0, j = c->n; i < j; ) {
+        int k = (i+j)>>1;
+        if ( c->max_end[k] > start ) j = k; else i = k+1;
+    }
+    lo = i;
+    // first record with chromStart > end
+    for ( j = c->n; i < j; ) {
+        int k = (i+j)>>1;
+        if ( c->records[k]->chromStart > end ) j = k; else i = k+1;
+    }
+    hi = i;
+    for ( i = lo; i < hi; ++i ) {
+        struct gea_record *r = c->records[i];
+        if ( r->chromEnd <= start ) continue;
+        if ( r->chromEnd > *tail_edge ) *tail_edge = r->chromEnd;
+        mc_handler_record_push(h, r);
+        l++;
+    }
     return l;
 }
 
-// return length of list
-static int retrieve_gea_records_from_region(struct mc_handler *h, int id, int start, int end, struct list_buffer **header, struct list_buffer **tail, int *tail_edge)
+// Append records in region to the tail of h->records, return the count of appended records.
+static int retrieve_gea_records_from_region(struct mc_handler *h, int id, int start, int end, int *tail_edge)
 {
+    if ( h->preload ) return preload_gea_records_from_region(h, id, start, end, tail_edge);
+
     // retrieve annotation records from database
-    hts_itr_t *itr = tbx_itr_queryi(h->idx, id, start, end+1);
-    kstring_t string = {0,0,0};
+    hts_itr_t *itr = h->fp_bgea ? hts_itr_query(h->idx->idx, id, start, end+1, bgea_readrec) : tbx_itr_queryi(h->idx, id, start, end+1);
+    h->n_query++;
     int l = 0;
     *tail_edge = 0;
+    struct gea_record *r = NULL;
     
-    while ( tbx_itr_next(h->fp_idx, h->idx, itr, &string) >= 0 ) {
-        struct gea_record *r = gea_init();
-        if ( gea_parse(&string, h->hdr, r) ) continue;
-        const char *type = h->hdr->id[GEA_DT_BIOTYPE][r->biotype].key;
-        if ( h->name_hash) {
-            if (strcmp(type, "mRNA") == 0 || strcmp(type, "ncRNA") == 0 ) {
-                if (!name_hash_key_exists(h->name_hash, r->name)) continue;
-            }
-            else if ( strcmp(type, "gene") == 0 ) {
-                if (!name_hash_key_exists(h->name_hash, r->geneName)) continue;
-            }
+    for ( ;; ) {
+        if ( r == NULL ) r = mc_handler_record_get(h);
+        if ( h->fp_bgea ) {
+            // BGEA records are already unpacked
+            int ret = hts_itr_next(h->fp_bgea, itr, r, h->tid_map);
+            if ( ret == -1 ) break;
+            if ( ret < 0 ) error("Failed to read %s.", h->data_fname);
         }
-              
-        gea_unpack(h->hdr, r, GEA_UN_TRANS|GEA_UN_CIGAR);
-        if ( r->chromEnd > *tail_edge ) *tail_edge = r->chromEnd;
-        
-        struct list_buffer *b = list_buffer_create();
-        b->data = r;
-        
-        if ( *header == NULL ) *header = b;
-        if ( *tail == NULL ) *tail = *header;
         else {
-            (*tail)->next = b;  *tail = b;
+            if ( tbx_itr_next(h->fp_idx, h->idx, itr, &h->str) < 0 ) break;
+            if ( gea_parse(&h->str, h->hdr, r) ) continue;
         }
+        if ( mc_handler_record_skip(h, r) ) continue;
+              
+        if ( h->fp_idx ) gea_unpack(h->hdr, r, GEA_UN_TRANS|GEA_UN_CIGAR);
+        if ( r->chromEnd > *tail_edge ) *tail_edge = r->chromEnd;
+        mc_handler_record_push(h, r);
+        r = NULL;
         l++;
     }
-    free(string.s);
+    if ( r ) mc_handler_record_put(h, r);
     tbx_itr_destroy(itr);
     
     return l;
 }
 static int is_gene(const struct gea_hdr *h, struct gea_record *v)
 {
-    char *bt = (char*)h->id[GEA_DT_BIOTYPE][v->biotype].key;
-    if ( strcmp(bt, "Gene") == 0 || strcmp(bt, "mRNA") == 0 || strcmp(bt, "ncRNA") == 0 ) return 1;
-    return 0;
+    return gea_biotype_flag(h, v) & (GEA_BIOTYPE_GENE|GEA_BIOTYPE_TRANS) ? 1 : 0;
 }
 // Update buffer for each chunk.
 int mc_handler_fill_buffer_chunk(struct mc_handler *h, char* name, int start, int end)
@@ -348,93 +561,64 @@ int mc_handler_fill_buffer_chunk(struct mc_handler *h, char* name, int start, in
     id = tbx_name2id(h->idx, name);
     if ( id == -1 ) return 0;
     
-    int l;
-    struct list_buffer *header = NULL, *tail = NULL;
+    int i, n;
     int tail_edge;
-    l = retrieve_gea_records_from_region(h, id, start, end, &header, &tail, &tail_edge);
+    n = retrieve_gea_records_from_region(h, id, start, end, &tail_edge);
 
     // 2018-08-10, update filter name list    
     
     // if retrieved buffer did NOT cover the chunk, trying to find more upstream records, used to
     // annotate intergenic variants
-    if ( header == NULL || header->data->chromStart > start) {
-        int l1;
-        struct list_buffer *s = NULL, *t = NULL;
-        int edge;
-        l1 = retrieve_gea_records_from_region(h, id, start - MAX_GAP_GENE_DISTANCE, start, &s, &t, &edge);
+    if ( n == 0 || ((struct gea_record*)h->records[0])->chromStart > start) {
+        int l1, edge;
+        l1 = retrieve_gea_records_from_region(h, id, start - MAX_GAP_GENE_DISTANCE, start, &edge);
         if ( l1 > 0 ) {
-            struct list_buffer *p = s, *g = NULL;
-            for ( ;; ) {
-                if ( p == NULL ) break;
-                // temp point 
-                struct list_buffer *q = NULL;                
-                if ( is_gene(h->hdr, (struct gea_record*)p->data) ) { q = g; g = p; }
-                else q = p;
-                p = p->next;
-                if (q) {
-                    gea_destroy((struct gea_record*)q->data);
-                    free(q);
+            // keep the nearest upstream gene only
+            struct gea_record *g = NULL;
+            for ( i = n; i < n + l1; ++i ) {
+                struct gea_record *p = (struct gea_record*)h->records[i];
+                if ( is_gene(h->hdr, p) ) {
+                    if ( g ) mc_handler_record_put(h, g);
+                    g = p;
                 }
+                else mc_handler_record_put(h, p);
             }
+            h->n_record = n;
             // update header
-            if ( g) {
-                g->next = header;
-                header = g;
+            if ( g ) {
+                mc_handler_record_push(h, g);
+                memmove(h->records+1, h->records, n*sizeof(void*));
+                h->records[0] = g;
             }
         }
     }
 
-   /* // if the chunk was NOT fully covered, find more downstream records */
-    if ( tail == NULL || tail_edge < end ) {
-        int l2;
-        struct list_buffer *s = NULL, *t = NULL;
-        int edge;
+    // if the chunk was NOT fully covered, find more downstream records
+    if ( n == 0 || tail_edge < end ) {
+        int l2, edge;
+        int n0 = h->n_record;
 
         // here we retrieve all records downstream, better idea could be read downstream record one by one and check the
         // biotype at the same time. Because we only need to the most nearest gene downstream.
-        l2 = retrieve_gea_records_from_region(h, id, end, end + MAX_GAP_GENE_DISTANCE, &s, &t, &edge);
+        l2 = retrieve_gea_records_from_region(h, id, end, end + MAX_GAP_GENE_DISTANCE, &edge);
         
         if ( l2 > 0 ) {
-            struct list_buffer *p = s, *g = NULL;
-            for ( ;; ) {
-                if ( p == NULL ) break;
-                // temp point
-                if ( g == NULL && is_gene(h->hdr, (struct gea_record*)p->data) ) { g = p; p = p->next; g->next = NULL;}
-                else {
-                    struct list_buffer *q = NULL;
-                    q = p;
-                    p = p->next;                    
-                    gea_destroy((struct gea_record*)q->data);
-                    free(q);
-                }
+            struct gea_record *g = NULL;
+            for ( i = n0; i < n0 + l2; ++i ) {
+                struct gea_record *p = (struct gea_record*)h->records[i];
+                if ( g == NULL && is_gene(h->hdr, p) ) g = p;
+                else mc_handler_record_put(h, p);
             }
+            h->n_record = n0;
             // g could be NULL
-            if ( g) {                
-                if (tail == NULL ) { tail = g; header = tail;}
-                else { tail->next = g; tail = g;}
-
+            if ( g ) {
+                // no record in the chunk, only the nearest downstream gene kept
+                if ( n == 0 ) clean_buffer_chunk(h);
+                mc_handler_record_push(h, g);
             }
         }
     }
 
-    if ( header == NULL ) return 0;
-    
-    // convert list into buffer
-    int i, n;
-    n = count_list((const void*)header);
-    if ( n > h->m_record ) {
-        h->m_record = n;
-        h->records = realloc(h->records, h->m_record*sizeof(struct gea_record));
-    }
-    h->n_record = n;
-
-    for ( i = 0; i < n; ++i ) {
-        h->records[i] = header->data;
-        struct list_buffer *l = header;
-        header = header->next;
-        free(l);
-    }
-    
     return h->n_record;
 }
 
@@ -797,14 +981,13 @@ static int trim_capped_sequences_and_check_mutated_end(struct mc_handler *h, str
     // alternative sequence.    
     if ( *lmut < 3 ) {
         // expand 10 base in the downstream in the reference sequence
-        faidx_t *fai = fai_load(h->reference_fname);
-        if (fai) {
+        if ( h->ref_win ) {
             char *seq;
             int   l;
-            if ( v->strand == strand_is_plus ) seq = faidx_fetch_seq(fai, mc->chr, v->cEnd, v->cEnd+10, &l);
+            if ( v->strand == strand_is_plus ) seq = seq_window_fetch(h->ref_win, mc->chr, v->cEnd, v->cEnd+10, &l);
             else {
-                seq = faidx_fetch_seq(fai, mc->chr, v->cStart - 10, v->cStart, &l);
-                compl_seq(seq, l);
+                seq = seq_window_fetch(h->ref_win, mc->chr, v->cStart - 10, v->cStart, &l);
+                if ( seq ) compl_seq(seq, l);
             }
             if ( l && seq ) {
                 kstring_t str = {0,0,0};
@@ -813,16 +996,16 @@ static int trim_capped_sequences_and_check_mutated_end(struct mc_handler *h, str
                 type->mut_amino = codon2aminoid(str.s,mc->is_mito);
                 free(str.s);
             }
+            if ( seq ) free(seq);
             
             if ( type->mut_amino == C4_Stop) type->con1 = mc_stop_retained;
             else type->con1 = mc_stop_loss;
             
-            fai_destroy(fai);
             return 0;
         }
         else {
             // even no reference sequence specified, we could interpret it as a stop-loss
-            warnings("%s : %s.", h->reference_fname, strerror(errno));
+            warnings("No reference genome loaded, %s:%d is interpreted as stop loss.", mc->chr, mc->start);
             type->con1 = mc_stop_loss;
             return 0;
         }
@@ -1204,7 +1387,7 @@ static int compare_reference_and_alternative_allele (struct mc_handler *h,struct
     // start aa location may be changed becase realignment, but ori_seq will be "stable" (reset if duplicate) in this function;
     // ori_seq is a temp sequence, will be free before level this function.
 
-    *ori = faidx_fetch_seq(h->rna_fai, name, start, start + 10000, lori);
+    *ori = seq_cache_fetch(h->rna_cache, name, start, start + 10000, lori);
     
     if ( *ori == NULL || *lori == 0 ) return -1;
     
@@ -1416,9 +1599,9 @@ static int transcript_molecular_consequence_update(struct mc_handler *h, struct
     // update hgvs locations
     struct mc_inf  *inf = &trans->inf;
     struct mc_type *type = &trans->type;
-    const char     *bt = h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;
+    int is_coding = gea_is_mrna(h->hdr, v) ? 1 : 0;
     
-    assert ( strcmp(bt, "mRNA") == 0 || strcmp(bt, "ncRNA") == 0);
+    assert ( gea_is_transcript(h->hdr, v) );
 
     
     inf->strand = v->strand == strand_is_plus ? '+' : '-';
@@ -1438,9 +1621,6 @@ static int transcript_molecular_consequence_update(struct mc_handler *h, struct
     if ( whole_gene_deletion_state_update(n, v) )  type->con1 = mc_exon_loss;
     //{ type->con1 = mc_exon_loss; return 0; }    
     
-    int is_coding = 0;
-    if ( strcmp(bt, "mRNA") == 0 ) is_coding = 1;
-    
     transcript_function_update(h, is_coding, v, &ex1, &inf->pos, &inf->offset, n->start, &type->func1, &type->con1, &type->con2, &inf->loc);
     
     type->count = ex1; // For now, count may NOT be the real exome number, considering the backward strand.
@@ -1510,7 +1690,7 @@ static int transcript_molecular_consequence_update(struct mc_handler *h, struct
         if ( alt_seq ) compl_seq(alt_seq, alt_length);
     }
     
-    if ( strcmp(bt, "mRNA") == 0 )
+    if ( is_coding )
         coding_transcript_update_molecular_consequence_state (h, n, inf, type, v, ref_seq, ref_length, alt_seq, alt_length);
     else 
         noncoding_transcript_update_molecular_conseqeunce_state (h, n, inf, type, v, ref_seq, ref_length, alt_seq, alt_length);
@@ -1613,20 +1793,20 @@ static int count_all_overlapped_records(struct mc_handler *h, struct mc *n, int
             }
         }
 
-        const char *bt = h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;
+        int flag = gea_biotype_flag(h->hdr, v);
         // only consider coding transcript
         // Since upstream gene records had be filled, and all records in the chunk keep in coordinate,
         // last_gene will alway point to the last gene record or be NULL.
-        if ( (strcmp(bt, "mRNA") == 0 || strcmp(bt, "Gene") == 0 ) && v->chromEnd < n->start) h->last_gene = v;
+        if ( (flag & (GEA_BIOTYPE_MRNA|GEA_BIOTYPE_GENE)) && v->chromEnd < n->start) h->last_gene = v;
 
         // check if variant located in this record
         if ( n->start > v->chromEnd ) continue; 
         if ( n->end < v->chromStart ) break;
         
-        if ( strcmp(bt, "mRNA") == 0 || strcmp(bt, "ncRNA") == 0 ) (*a)++;
+        if ( flag & GEA_BIOTYPE_TRANS ) (*a)++;
 
         // if no Gene record in database, skip to check intragenic variant
-        if ( strcmp(bt, "Gene") == 0 ) *intragenic_flag = 1;
+        if ( flag & GEA_BIOTYPE_GENE ) *intragenic_flag = 1;
         // count all records
         (*c)++;
 
@@ -1641,8 +1821,7 @@ static int next_gene_record_update(struct mc_handler *h, int i)
     if ( i < h->n_record ) {
         for (j = i; j < h->n_record; ++j) {
             struct gea_record *v = (struct gea_record*)h->records[j];
-            char *bt = (char*)h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;
-            if ( strcmp(bt, "mRNA") && strcmp(bt, "ncRNA") && strcmp(bt, "Gene") ) continue;
+            if ( !is_gene(h->hdr, v) ) continue;
             h->next_gene = v;
             return 0;
         }
@@ -1664,9 +1843,8 @@ static int intragenic_variant_state_update(struct mc *n, int intragenic_flag)
 static int tfbs_variant_state_update(struct mc *n, struct mc_handler *h, struct gea_record *v)
 {
     struct intergenic_core *inter = &n->inter;
-    char *bt = (char*)h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;
     //inter->con1 =  inter->con2 = mc_unknown;
-    if ( strcmp(bt, "TFBS") == 0 ) { 
+    if ( gea_is_tfbs(h->hdr, v) ) { 
         if (n->start <= v->chromStart && n->end >= v->chromEnd ) inter->con1 = mc_tfbs_ablation;
         else inter->con1 = mc_tfbs_variant;
         return 0; 
@@ -1705,17 +1883,16 @@ static int transcripts_variant_state_update(struct mc *n, struct mc_handler *h,
     
     for ( i = h->i_record, j = 0; i < h->n_record && j < c; ++i,++j ) {
         struct gea_record *v = (struct gea_record*)h->records[i];
-        const char *bt = h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;        
         if ( n->end < v->chromStart || n->start > v->chromEnd) continue;
         // for this part we only consider transcripts
         // intron region also could be overlapped with motifs
-        if ( strcmp(bt, "TFBS") == 0 ) {
+        if ( gea_is_tfbs(h->hdr, v) ) {
             if ( tfbs_region_skip == 0 ) {
                 if ( tfbs_variant_state_update(n, h, v) == 0 ) tfbs_region_skip = 1;
             }
             continue;
         }
-        if ( strcmp(bt, "mRNA") && strcmp(bt, "ncRNA") ) continue;
+        if ( !gea_is_transcript(h->hdr, v) ) continue;
         
         // clean core structure for updating transcript record
         struct mc_core *trans = &n->trans[n->n_tran];
@@ -1823,10 +2000,11 @@ static int anno_mc_update_buffer(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1
         file->files[i] = mc_init(bcf_seqname(hdr, line), line->pos+1, line->pos+line->rlen, line->d.allele[0], line->d.allele[i+1]);
     return 0;
 }
-static int empty_tag_string(kstring_t *str)
+// check the tail of string since l
+static int empty_tag_string(kstring_t *str, int l)
 {
     int i;
-    for (i=0; i<str->l; ++i ) 
+    for (i=l; i<str->l; ++i ) 
         if (str->s[i] != '|' && str->s[i] != ',' && str->s[i] != '.') return 0;
     return 1;
 }
@@ -2199,16 +2377,16 @@ static void generate_hgvsnom_string_exonLoss(struct mc *mc, struct mc_type *type
     }
     kputs("del", str);
 }
-static char *generate_hgvsnom_string(struct mc *h)
+static void generate_hgvsnom_string(struct mc *h, kstring_t *str)
 {
-    if ( h->n_tran == 0 ) return NULL;
+    if ( h->n_tran == 0 ) return;
     
-    kstring_t str = {0,0,0};    
+    int l = str->l;
 
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
 
-        if ( i ) kputc('|', &str);
+        if ( i ) kputc('|', str);
         
         struct mc_type *type = &h->trans[i].type;
         struct mc_inf *inf = &h->trans[i].inf;
@@ -2227,13 +2405,13 @@ static char *generate_hgvsnom_string(struct mc *h)
             case mc_tfbs_variant:
             case mc_intragenic:
             case mc_whole_gene:
-                generate_hgvsnom_string_empty(&str);
+                generate_hgvsnom_string_empty(str);
                 break;
 
             
             case mc_noncoding_splice_region:
             case mc_noncoding_exon:
-                generate_hgvsnom_string_NoncodingExon(h, type, inf, &str);
+                generate_hgvsnom_string_NoncodingExon(h, type, inf, str);
                 break;
 
             case mc_noncoding_intron:
@@ -2243,16 +2421,16 @@ static char *generate_hgvsnom_string(struct mc *h)
             case mc_donor_region:
             case mc_splice_donor:
             case mc_splice_acceptor:
-                generate_hgvsnom_string_intron(h, type, inf, &str);
+                generate_hgvsnom_string_intron(h, type, inf, str);
                 break;
 
             case mc_utr5_exon:
             case mc_utr3_exon:
-                generate_hgvsnom_string_UtrExon(h, type, inf, &str);
+                generate_hgvsnom_string_UtrExon(h, type, inf, str);
                 break;
 
             case mc_exon_loss:
-                generate_hgvsnom_string_exonLoss(h, type, inf, &str);
+                generate_hgvsnom_string_exonLoss(h, type, inf, str);
                 break;
                 
             case mc_stop_gained:
@@ -2264,7 +2442,7 @@ static char *generate_hgvsnom_string(struct mc *h)
             case mc_disruption_inframe_deletion:
             case mc_disruption_inframe_insertion:
             case mc_coding_variant:
-                generate_hgvsnom_string_CodingDelins(h, type, inf, &str);
+                generate_hgvsnom_string_CodingDelins(h, type, inf, str);
                 break;
                 
             case mc_start_loss:
@@ -2273,11 +2451,11 @@ static char *generate_hgvsnom_string(struct mc *h)
             case mc_stop_retained:
             case mc_missense:
             case mc_synonymous:
-                generate_hgvsnom_string_CodingSNV(h, type, inf, &str);
+                generate_hgvsnom_string_CodingSNV(h, type, inf, str);
                 break;
 
             case mc_nocall:
-                generate_hgvsnom_string_NoCall(h, type, inf, &str);
+                generate_hgvsnom_string_NoCall(h, type, inf, str);
                 break;
                 
             default:
@@ -2286,20 +2464,15 @@ static char *generate_hgvsnom_string(struct mc *h)
 
     }
     
-    if ( empty_tag_string(&str) ) {
-        free(str.s);
-        return NULL;
-    }
-    
-    return str.s;
+    if ( empty_tag_string(str, l) ) str->l = l;
 }
-static int generate_annovar_string(struct mc *h, struct mc_type *type, struct mc_inf *inf, kstring_t *str)
+static int generate_annovar_string(struct mc *h, struct mc_type *type, struct mc_inf *inf, kstring_t *str, int l0)
 {
     char *ref = inf->ref != NULL ? inf->ref : h->ref;
     char *alt = inf->alt != NULL ? inf->alt : h->alt;
 
     if ( inf->offset != 0 ) return 0;
-    if ( str->l ) kputc(',', str);
+    if ( str->l > l0 ) kputc(',', str);
 
     char *name = strdup(inf->transcript);
     int l, i;
@@ -2392,11 +2565,11 @@ static int generate_annovar_string(struct mc *h, struct mc_type *type, struct mc
 }
 // generate variant string in annovar format
 // OR4F5:NM_001005484:exon1:c.T809A:p.V270E
-static char *generate_annovar_name(struct mc *h)
+static void generate_annovar_name(struct mc *h, kstring_t *str)
 {
-    if ( h->n_tran == 0 ) return NULL;
+    if ( h->n_tran == 0 ) return;
     
-    kstring_t str = {0,0,0};    
+    int l = str->l;
 
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {        
@@ -2446,7 +2619,7 @@ static char *generate_annovar_name(struct mc *h)
             case mc_missense:
             case mc_synonymous:
             case mc_nocall:
-                generate_annovar_string(h, type, inf, &str);
+                generate_annovar_string(h, type, inf, str, l);
                 break;
                 
             default:
@@ -2454,98 +2627,75 @@ static char *generate_annovar_name(struct mc *h)
         }
     }
     
-    if ( empty_tag_string(&str) ) {
-        free(str.s);
-        return NULL;
-    }
-    
-    return str.s;
+    if ( empty_tag_string(str, l) ) str->l = l;
 }
 
-static char *generate_gene_string(struct mc *h)
+static void generate_gene_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     if ( h->n_tran == 0 ) {
-        if ( h->inter.gene ) {
-            kputs(h->inter.gene, &str);
-            return str.s;
-        }
-        else return NULL;
+        if ( h->inter.gene ) kputs(h->inter.gene, str);
+        return;
     }
     
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
+        if ( i ) kputc('|', str);
         struct mc_inf *inf = &h->trans[i].inf;
-        if ( inf->gene ) kputs(inf->gene, &str);
-        else kputc('.', &str);
+        if ( inf->gene ) kputs(inf->gene, str);
+        else kputc('.', str);
     }
-
-    
-    return str.s;
 }
-static char *generate_transcript_string(struct mc *h)
+static void generate_transcript_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
-    int i, k, l;
+    int i;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
-        struct mc_inf *inf = &h->trans[i].inf;
-        kputs(inf->transcript, &str);
-        l = strlen(inf->transcript);
-        for ( k = 0; k < l; ++k )
-            if ( inf->transcript[k] == '.') break;
+        if ( i ) kputc('|', str);
+        kputs(h->trans[i].inf.transcript, str);
     }
-    return str.s;
 }
-static char *generate_vartype_string(struct mc *h)
+static void generate_vartype_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     if ( h->n_tran == 0 ) {
-        kputs(MCT[h->inter.con1].sname, &str);
-        return str.s;
+        kputs(MCT[h->inter.con1].sname, str);
+        return;
     }
 
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
+        if ( i ) kputc('|', str);
         struct mc_type *type = &h->trans[i].type;
-        kputs(MCT[type->con1].sname, &str);
+        kputs(MCT[type->con1].sname, str);
         if ( type->con2 != mc_unknown ) {
-            kputc('+', &str);
-            kputs(MCT[type->con2].sname, &str);
+            kputc('+', str);
+            kputs(MCT[type->con2].sname, str);
         }
     }
-    return str.s;    
 }
-static char *generate_molecular_consequence_string(struct mc *h)
+static void generate_molecular_consequence_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     int i;
     struct intergenic_core *inter = &h->inter;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if (i) kputc('|', &str);
+        if (i) kputc('|', str);
         struct mc_type *type = &h->trans[i].type;
         if ( type->con1 == mc_unknown ) {
-            if ( type->con2 != mc_unknown ) ksprintf(&str, "+%s", MCT[type->con2].lname);
-            else kputs("unknown", &str);
+            if ( type->con2 != mc_unknown ) ksprintf(str, "+%s", MCT[type->con2].lname);
+            else kputs("unknown", str);
         }
         else {
-            kputs(MCT[type->con1].lname, &str);
-            if ( type->con2 != mc_unknown ) ksprintf(&str, "+%s", MCT[type->con2].lname);
-            if ( (type->con1 == mc_noncoding_intron || type->con1 == mc_coding_intron) && inter->con1 != mc_unknown ) ksprintf(&str, "+%s", MCT[inter->con1].lname);
+            kputs(MCT[type->con1].lname, str);
+            if ( type->con2 != mc_unknown ) ksprintf(str, "+%s", MCT[type->con2].lname);
+            if ( (type->con1 == mc_noncoding_intron || type->con1 == mc_coding_intron) && inter->con1 != mc_unknown ) ksprintf(str, "+%s", MCT[inter->con1].lname);
         }
     }
 
     if ( i == 0 ) {
         assert(inter->con1 != mc_unknown);
-        kputs(MCT[inter->con1].lname, &str);
+        kputs(MCT[inter->con1].lname, str);
     }
-    return str.s;
 }
-static char *generate_molecular_consequence_string_uniq(struct mc *h)
+static void generate_molecular_consequence_string_uniq(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     int i;
     struct intergenic_core *inter = &h->inter;
     struct anno_stack *s = anno_stack_init();
@@ -2561,29 +2711,26 @@ static char *generate_molecular_consequence_string_uniq(struct mc *h)
         anno_stack_push(s, (char*)MCT[inter->con1].lname);
     }
     for ( i = 0; i < s->l; ++i) {
-        if ( i ) kputc('+', &str);
-        kputs(s->a[i], &str);
+        if ( i ) kputc('+', str);
+        kputs(s->a[i], str);
     }
     anno_stack_destroy(s);
-    return str.s;
 }
-static char *generate_exonintron_string(struct mc *h)
+static void generate_exonintron_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
+        if ( i ) kputc('|', str);
         struct mc_type *type = &h->trans[i].type;
         struct mc_inf *inf = &h->trans[i].inf;
         if ( inf->offset != 0 )
-            ksprintf(&str, "I%d", type->count);
+            ksprintf(str, "I%d", type->count);
         else {
-            ksprintf(&str, "E%d", type->count);
+            ksprintf(str, "E%d", type->count);
             if ( type->count2 != 0 )
-                ksprintf(&str, "/C%d", type->count2);
+                ksprintf(str, "/C%d", type->count2);
         }
     }
-    return str.s;
 }
 static int generate_upstream_downstream_gap_value(struct mc *h ) {
     return h->inter.TSS_dist;
@@ -2693,113 +2840,147 @@ static char *generate_oldnom_string(struct hgvs *h)
     return str.s;
 }
 */
-static char *generate_aalength_string(struct mc *h)
+static void generate_aalength_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
-        kputw(h->trans[i].inf.aa_length, &str);
-    }
-    return str.s;
-}
-
-
-#define BRANCH(_f, _h, _l, _c, _func) do {      \
-        int i;                                  \
-        kstring_t str = {0,0,0};                \
-        int empty = 1;                          \
-        for ( i = 0; i < _f->n_allele; ++i ) {  \
-            struct mc *f = _f->files[i];        \
-            if ( i > 0 ) kputc(',', &str);      \
-            if ( f == NULL ) {                  \
-                kputc('.', &str);               \
-                continue;                       \
-            }                                                           \
-            if ( f->type == var_type_unknow || f->type == var_type_nonref ) { \
-                kputc('.', &str);                                       \
-                continue;                                               \
-            }                                                           \
-            char *name = _func(f);                                      \
-            if (name) {                                                 \
-                kputs(name, &str);                                      \
-                free(name);                                             \
-            }                                                           \
-            empty = 0;                                                  \
-        }                                                               \
-        if ( empty ) {                                                  \
-            free(str.s);                                                \
-            return 1;                                                   \
-        }                                                               \
-        int ret;                                                        \
-        if ( _c->replace == REPLACE_MISSING ) {                          \
-            ret = bcf_get_info_string(_h, _l, _c->hdr_key, &_f->tmps, &_f->mtmps); \
-            if ( ret > 0 && (_f->tmps[0]!= '.' || _f->tmps[1] != 0 ) ) return 1; \
-        }                                                               \
-        ret = bcf_update_info_string_fixed(_h, _l, _c->hdr_key, str.s); \
-        free(str.s);                                                    \
-        return ret;                                                     \
-    } while(0)
-
+        if ( i ) kputc('|', str);
+        kputw(h->trans[i].inf.aa_length, str);
+    }
+}
+
+
+// Generators of string tags append values of one allele, nothing appended for empty value
+typedef void (*mc_generator_str)(struct mc *, kstring_t *);
+// Generators of integer tags return value of one allele, 0 for empty value
+typedef int (*mc_generator_int)(struct mc *);
+
+static const struct mc_tag_def {
+    const char *key;
+    const char *hdr_line;
+    int type;
+    void *func;
+} mc_tag_defs[] = {
+    // HGVS nomenclature, please refer to http://www.hgvs.org/ and http://varnomen.hgvs.org/
+    { "HGVSnom", "##INFO=<ID=HGVSnom,Number=A,Type=String,Description=\"HGVS nomenclature for the description of DNA sequence variants\">",
+      BCF_HT_STR, generate_hgvsnom_string, },
+    { "ANNOVARname", "##INFO=<ID=ANNOVARname,Number=A,Type=String,Description=\"Variant description in ANNOVAR format.\">",
+      BCF_HT_STR, generate_annovar_name, },
+    // Gene names, respond to transcripts, seperated by '|'
+    { "Gene", "##INFO=<ID=Gene,Number=A,Type=String,Description=\"Gene names\">",
+      BCF_HT_STR, generate_gene_string, },
+    // transcript names, seperated by '|'
+    { "Transcript", "##INFO=<ID=Transcript,Number=A,Type=String,Description=\"Transcript names\">",
+      BCF_HT_STR, generate_transcript_string, },
+    // variant type, not standard
+    { "VarType", "##INFO=<ID=VarType,Number=A,Type=String,Description=\"Variant type.\">",
+      BCF_HT_STR, generate_vartype_string, },
+    // molecular consequence, refer to http://www.sequenceontology.org/
+    // report name for each transcript, seperated by '|'
+    { "MolecularConsequence", "##INFO=<ID=MolecularConsequence,Number=A,Type=String,Description=\"Predicted molecular consequence of variant.\">",
+      BCF_HT_STR, generate_molecular_consequence_string, },
+    // molecular consequence, but report one value only
+    { "MC1", "##INFO=<ID=MC1,Number=A,Type=String,Description=\"Predicted molecular consequence of variant.\">",
+      BCF_HT_STR, generate_molecular_consequence_string_uniq, },
+    // exon or intron number for each transcript
+    { "ExonIntron", "##INFO=<ID=ExonIntron,Number=A,Type=String,Description=\"Exon/CDS or intron id on transcripts.\">",
+      BCF_HT_STR, generate_exonintron_string, },
+    { "IVSnom", "##INFO=<ID=IVSnom,Number=A,Type=String,Description=\"Old style nomenclature for the description of intron variants. Not recommand to use it.\">",
+      BCF_HT_STR, NULL, },
+    { "Oldnom", "##INFO=<ID=Oldnom,Number=A,Type=String,Description=\"Old style nomenclature, compared with HGVSnom use gene position instead of UTR/coding position.\">",
+      BCF_HT_STR, NULL, },
+    // amino acid length
+    { "AAlength", "##INFO=<ID=AAlength,Number=A,Type=String,Description=\"Amino acid length for each transcript. 0 for noncoding transcript.\">",
+      BCF_HT_STR, generate_aalength_string, },
+    // distance between intergenic/intragenic variant and nearby TSS
+    { "TSSdistance", "##INFO=<ID=TSSdistance,Number=A,Type=Integer,Description=\"The distance between noncoding variant to nearby transcription start site. + for downstream, - for upstream.\">",
+      BCF_HT_INT, generate_upstream_downstream_gap_value, },
+};
 
-static int anno_hgvs_nom(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
+static const struct mc_tag_def *mc_tag_def_find(const char *key)
 {
-    BRANCH(file, hdr, line, col, generate_hgvsnom_string);
-}
-static int anno_hgvs_gene(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
-{
-    BRANCH(file, hdr, line, col, generate_gene_string);
-}
-static int anno_hgvs_trans(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
-{
-    BRANCH(file, hdr, line, col, generate_transcript_string);
-}
-static int anno_hgvs_vartype(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
-{
-    BRANCH(file, hdr, line, col, generate_vartype_string);
-}
-static int anno_hgvs_mc(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
-{
-    BRANCH(file, hdr, line, col, generate_molecular_consequence_string);
-}
-static int anno_hgvs_mc1(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
-{
-    BRANCH(file, hdr, line, col, generate_molecular_consequence_string_uniq);
-}
-static int anno_hgvs_exon(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
-{
-    BRANCH(file, hdr, line, col, generate_exonintron_string);
+    int i;
+    for ( i = 0; i < sizeof(mc_tag_defs)/sizeof(mc_tag_defs[0]); ++i )
+        if ( strcmp(mc_tag_defs[i].key, key) == 0 ) return &mc_tag_defs[i];
+    return NULL;
 }
-static int anno_hgvs_aalength(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
+
+// Compiled column, values of all alleles are filled in str or vals for each record.
+struct mc_tag {
+    const struct mc_tag_def *def;
+    kstring_t str;
+    int m_vals;
+    int *vals;
+};
+
+// Compile columns into tags, columns without generator and duplicated columns are skipped.
+static void anno_mc_file_compile(struct anno_mc_file *f, bcf_hdr_t *hdr)
 {
-    BRANCH(file, hdr, line, col, generate_aalength_string);
-}
+    int i, j;
+    f->tags = malloc(f->n_col*sizeof(struct mc_tag));
+    f->updates = malloc(f->n_col*sizeof(struct info_update));
+    f->n_tag = 0;
+    for ( i = 0; i < f->n_col; ++i ) {
+        struct anno_col *col = &f->cols[i];
+        const struct mc_tag_def *def = mc_tag_def_find(col->hdr_key);
+        if ( def == NULL || def->func == NULL ) continue;
+        int id = bcf_hdr_id2int(hdr, BCF_DT_ID, col->hdr_key);
+        if ( !bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id) ) continue;
+        for ( j = 0; j < f->n_tag; ++j ) if ( f->updates[j].key == id ) break;
+        if ( j < f->n_tag ) {
+            // the duplicated column overwrites the value anyway if it is not in REPLACE_MISSING mode
+            if ( col->replace != REPLACE_MISSING ) f->updates[j].replace = col->replace;
+            continue;
+        }
 
-#undef BRANCH
+        struct mc_tag *tag = &f->tags[f->n_tag];
+        memset(tag, 0, sizeof(*tag));
+        tag->def = def;
+        struct info_update *u = &f->updates[f->n_tag];
+        memset(u, 0, sizeof(*u));
+        u->key = id;
+        u->type = def->type;
+        // integer tags are always replaced
+        u->replace = def->type == BCF_HT_STR ? col->replace : REPLACE_ALL;
+        f->n_tag++;
+    }
+}
 
-static int anno_hgvs_TSSdist(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
+static void anno_mc_tag_fill(struct anno_mc_file *file, struct mc_tag *tag, struct info_update *u)
 {
     int i;
-    int *d = calloc(file->n_allele, sizeof(int));
     int empty = 1;
+    if ( tag->def->type == BCF_HT_INT ) {
+        if ( file->n_allele > tag->m_vals ) {
+            tag->m_vals = file->n_allele;
+            tag->vals = realloc(tag->vals, tag->m_vals*sizeof(int));
+        }
+        for ( i = 0; i < file->n_allele; ++i ) {
+            struct mc *f = file->files[i];
+            tag->vals[i] = f == NULL ? 0 : ((mc_generator_int)tag->def->func)(f);
+            if ( tag->vals[i] != 0 ) empty = 0;
+        }
+        u->skip = empty;
+        u->n = file->n_allele;
+        u->values = tag->vals;
+        return;
+    }
+
+    tag->str.l = 0;
     for ( i = 0; i < file->n_allele; ++i ) {
         struct mc *f = file->files[i];
-        struct intergenic_core *inter = &f->inter;
-        d[i] = 0;
-        if (inter->TSS_dist != 0) {
-            d[i] = inter->TSS_dist;
-            empty = 0;
+        if ( i > 0 ) kputc(',', &tag->str);
+        if ( f == NULL || f->type == var_type_unknow || f->type == var_type_nonref ) {
+            kputc('.', &tag->str);
+            continue;
         }
+        ((mc_generator_str)tag->def->func)(f, &tag->str);
+        empty = 0;
     }
-    if ( empty == 1 ) {
-        free(d);
-        return 1;
-    }
-
-    int ret;
-    ret = bcf_update_info_int32_fixed(hdr, line, col->hdr_key, d, file->n_allele);
-    free(d);
-    return ret;
+    u->skip = empty;
+    u->n = 1;
+    // no value generated, the tag will be removed if it is missing
+    u->values = tag->str.l ? tag->str.s : NULL;
 }
 
 static int anno_mc_setter2(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line)
@@ -2817,171 +2998,32 @@ static int anno_mc_setter2(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *li
         mc_anno_trans_chunk(f, file->h);
     }
 
-    // annotate attributes
-    for ( i = 0; i < file->n_col; ++i ) {
-        struct anno_col *col = &file->cols[i];
-
-        // HGVS nomenclature, please refer to http://www.hgvs.org/ and http://varnomen.hgvs.org/
-        if ( strcmp(col->hdr_key, "HGVSnom") == 0 )
-            anno_hgvs_nom(file, hdr, line, col);
-
-        // transcript names, seperated by '|'
-        else if ( strcmp(col->hdr_key, "Transcript") == 0 )
-            anno_hgvs_trans(file, hdr, line, col);
-
-        // variant type, not standard
-        else if ( strcmp(col->hdr_key, "VarType") == 0 )
-            anno_hgvs_vartype(file, hdr, line, col);
-
-        // Gene names, respond to transcripts, seperated by '|'
-        else if ( strcmp(col->hdr_key, "Gene") == 0 )
-            anno_hgvs_gene(file, hdr, line, col);
-
-        // molecular consequence, refer to http://www.sequenceontology.org/
-        // report name for each transcript, seperated by '|'
-        else if ( strcmp(col->hdr_key, "MolecularConsequence") == 0 )
-            anno_hgvs_mc(file, hdr, line, col);
-
-        // molecular consequence, but report one value only
-        else if ( strcmp(col->hdr_key, "MC1") == 0 )
-            anno_hgvs_mc1(file, hdr, line, col);
-
-        // exon or intron number for each transcript
-        else if ( strcmp(col->hdr_key, "ExonIntron") == 0 )
-            anno_hgvs_exon(file, hdr, line, col);
-
-        // amino acid length
-        else if ( strcmp(col->hdr_key, "AAlength") == 0 )
-            anno_hgvs_aalength(file, hdr, line, col);
-
-        // distance between intergenic/intragenic variant and nearby TSS
-        else if ( strcmp(col->hdr_key, "TSSdistance") == 0 )
-            anno_hgvs_TSSdist(file, hdr, line, col);
-        
+    // generate values of all tags, then update INFO at once
+    int matched = 0;
+    for ( i = 0; i < file->n_tag; ++i ) {
+        anno_mc_tag_fill(file, &file->tags[i], &file->updates[i]);
+        if ( file->updates[i].skip == 0 ) matched = 1;
     }
+    file->stat.n_match += matched;
+
+    if ( file->n_tag ) bcf_update_info_fixed_n(line, file->updates, file->n_tag);
 
     return 0;
 }
-//static int anno_hgvs_setter_info(struct anno_hgvs_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
-static int anno_mc_setter(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line)
-{
-    int i, j;
-    struct mc_handler *h = file->h;
-    int empty = 1;
-    kstring_t *str = malloc(file->n_col*sizeof(kstring_t));
-    for ( i = 0; i < file->n_col; ++i ) memset(&str[i], 0, sizeof(kstring_t));
 
-    for ( i = 0; i < file->n_allele; ++i ) {
-        struct mc *f = file->files[i];
-        if ( i > 0 ) 
-            for ( j = 0; j < file->n_col; ++j ) kputc(',', &str[j]);
-        if ( f == NULL ) { // for N
-            for ( j = 0; j < file->n_col; ++j ) kputc('.', &str[j]);
-            continue;
-        }
-        if ( f->type == var_type_unknow || f->type == var_type_nonref ) {
-            for ( j = 0; j < file->n_col; ++j ) kputc('.', &str[j]);
-            continue;
-        }
-        //int ret;
-        int ret = mc_anno_trans_chunk(f, h);
-
-        //continue;
-        
-        if ( ret == 0 ) {
-            for ( j = 0; j < file->n_col; ++j ) kputc('.', &str[j]);                
-            continue;
-        }
-        
-        for ( j = 0; j < file->n_col; ++j ) {
-            struct anno_col *col = &file->cols[j];
-            if ( strcmp(col->hdr_key, "HGVSnom") == 0 ) {
-                char *name = generate_hgvsnom_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "Gene") == 0 ) {
-                char *name = generate_gene_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "Transcript") == 0 ) {
-                char *name = generate_transcript_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);                    
-                }
-            }
-            else if ( strcmp(col->hdr_key, "VarType") == 0 ) {
-                //char *name = generate_vartype_string(f);
-                char *name = generate_vartype_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "MolecularConsequence") == 0 ) {
-                char *name = generate_molecular_consequence_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "ANNOVARname") == 0 ) {
-                char *name = generate_annovar_name(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "MC1") == 0 ) {
-                char *name = generate_molecular_consequence_string_uniq(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            
-            else if ( strcmp(col->hdr_key, "ExonIntron") == 0 ) {
-                char *name = generate_exonintron_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "AAlength") == 0 ) {
-                char *name = generate_aalength_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }            
-        }
-        empty = 0;
-    }
-    if ( empty == 1 ) {
-        for ( j = 0; j < file->n_col; ++j ) free(str[j].s);
-        free(str);
-        return 1;
-    }
-    // update INFO
-    for ( i = 0; i < file->n_col; ++i ) {
-        if ( empty_tag_string(&str[i]) ) continue;
-        struct anno_col *col = &file->cols[i];
-        if ( col->replace == REPLACE_MISSING ) {
-            int ret = bcf_get_info_string(hdr, line, col->hdr_key, &file->tmps, &file->mtmps);
-            if ( ret > 0 && (file->tmps[0]!= '.' || file->tmps[1] != 0 ) ) continue;
-        }
-        bcf_update_info_string_fixed(hdr, line, col->hdr_key, str[i].s);
+void anno_mc_file_stat(struct anno_mc_file *f, struct anno_stat *s)
+{
+    struct mc_handler *h = f->h;
+    BGZF *b = h->fp_bgea ? h->fp_bgea : h->fp_idx ? hts_get_bgzfp(h->fp_idx) : NULL;
+    anno_stat_add(s, &f->stat);
+    s->n_query += h->n_query;
+    if ( b ) s->n_byte += b->uncompressed_address;
+    if ( h->rna_cache ) {
+        uint64_t hit, miss;
+        seq_cache_stat(h->rna_cache, &hit, &miss);
+        s->n_hit += hit;
+        s->n_miss += miss;
     }
-    
-    for ( i = 0; i < file->n_col; ++i ) free(str[i].s);
-    free(str);
-    return 0;
 }
 
 struct anno_mc_file *anno_mc_file_duplicate(struct anno_mc_file *f)
@@ -2995,6 +3037,15 @@ struct anno_mc_file *anno_mc_file_duplicate(struct anno_mc_file *f)
     d->cols = malloc(d->n_col*sizeof(struct anno_col));
     int i;
     for ( i = 0; i < d->n_col; ++i) anno_col_copy(&f->cols[i], &d->cols[i]);
+    // tags are compiled already, only allocate own buffers
+    d->n_tag = f->n_tag;
+    d->tags = malloc(d->n_col*sizeof(struct mc_tag));
+    d->updates = malloc(d->n_col*sizeof(struct info_update));
+    for ( i = 0; i < d->n_tag; ++i ) {
+        memset(&d->tags[i], 0, sizeof(struct mc_tag));
+        d->tags[i].def = f->tags[i].def;
+        d->updates[i] = f->updates[i];
+    }
     return d;
 }
 
@@ -3008,6 +3059,12 @@ void anno_mc_file_destroy(struct anno_mc_file *f, int l)
     //if ( f->tmps) free(f->tmps);
     for ( i = 0; i < f->n_col; ++i ) free(f->cols[i].hdr_key);
     free(f->cols);
+    for ( i = 0; i < f->n_tag; ++i ) {
+        if ( f->tags[i].str.m ) free(f->tags[i].str.s);
+        if ( f->tags[i].m_vals ) free(f->tags[i].vals);
+    }
+    free(f->tags);
+    free(f->updates);
     free(f);
 }
 
@@ -3054,19 +3111,7 @@ struct anno_mc_file *anno_mc_file_init(bcf_hdr_t *hdr, const char *column, const
             else if (*ss == '-') { col->replace = REPLACE_EXISTING; ss++; }
             if ( ss[0] == '\0') continue;
             if ( strncmp(ss, "INFO/", 5) == 0 ) ss += 5;
-            if ( strcmp(ss, "HGVSnom")
-                 && strcmp(ss, "Gene")
-                 && strcmp(ss, "Transcript")
-                 && strcmp(ss, "VarType")
-                 && strcmp(ss, "ExonIntron")
-                 && strcmp(ss, "IVSnom")
-                 && strcmp(ss, "Oldnom")
-                 && strcmp(ss, "AAlength")
-                 && strcmp(ss, "ANNOVARname")
-                 && strcmp(ss, "MolecularConsequence")
-                 && strcmp(ss, "MC1")
-                 && strcmp(ss, "TSSdistance")
-                ){
+            if ( mc_tag_def_find(ss) == NULL ) {
                 warnings("Do NOT support tag %s.", ss);
                 continue;
             }
@@ -3078,45 +3123,18 @@ struct anno_mc_file *anno_mc_file_init(bcf_hdr_t *hdr, const char *column, const
     }    
 
     // update header
-#define BRANCH(_key, _description) do {                                 \
-        int id;                                                         \
-        id = bcf_hdr_id2int(hdr, BCF_DT_ID, _key);                      \
-        if (id == -1) {                                                 \
-            bcf_hdr_append(hdr, _description);                          \
-            bcf_hdr_sync(hdr);                                          \
-            id = bcf_hdr_id2int(hdr, BCF_DT_ID, _key);                  \
-            assert(bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id));        \
-        }                                                               \
-    } while(0)
     int i;
     for ( i = 0; i < f->n_col; ++i ) {
-        struct anno_col *col = &f->cols[i];
-        if ( strcmp(col->hdr_key, "HGVSnom") == 0 ) 
-            BRANCH("HGVSnom", "##INFO=<ID=HGVSnom,Number=A,Type=String,Description=\"HGVS nomenclature for the description of DNA sequence variants\">");
-        else if ( strcmp(col->hdr_key, "ANNOVARname") == 0 )
-            BRANCH("ANNOVARname", "##INFO=<ID=ANNOVARname,Number=A,Type=String,Description=\"Variant description in ANNOVAR format.\">");
-        else if ( strcmp(col->hdr_key, "Gene") == 0 ) 
-            BRANCH("Gene","##INFO=<ID=Gene,Number=A,Type=String,Description=\"Gene names\">");
-        else if ( strcmp(col->hdr_key, "Transcript") == 0 ) 
-            BRANCH("Transcript","##INFO=<ID=Transcript,Number=A,Type=String,Description=\"Transcript names\">");
-        else if ( strcmp(col->hdr_key, "VarType") == 0 ) 
-            BRANCH("VarType", "##INFO=<ID=VarType,Number=A,Type=String,Description=\"Variant type.\">");
-        else if ( strcmp(col->hdr_key, "MolecularConsequence") == 0 ) 
-            BRANCH("MolecularConsequence", "##INFO=<ID=MolecularConsequence,Number=A,Type=String,Description=\"Predicted molecular consequence of variant.\">");
-        else if ( strcmp(col->hdr_key, "MC1") == 0 ) 
-            BRANCH("MC1", "##INFO=<ID=MC1,Number=A,Type=String,Description=\"Predicted molecular consequence of variant.\">");
-        else if ( strcmp(col->hdr_key, "ExonIntron") == 0 ) 
-            BRANCH("ExonIntron","##INFO=<ID=ExonIntron,Number=A,Type=String,Description=\"Exon/CDS or intron id on transcripts.\">");
-        else if ( strcmp(col->hdr_key, "IVSnom") == 0 ) 
-            BRANCH("IVSnom", "##INFO=<ID=IVSnom,Number=A,Type=String,Description=\"Old style nomenclature for the description of intron variants. Not recommand to use it.\">");
-        else if ( strcmp(col->hdr_key, "Oldnom") == 0 ) 
-            BRANCH("Oldnom", "##INFO=<ID=Oldnom,Number=A,Type=String,Description=\"Old style nomenclature, compared with HGVSnom use gene position instead of UTR/coding position.\">");
-        else if ( strcmp(col->hdr_key, "AAlength") == 0 ) 
-            BRANCH("AAlength", "##INFO=<ID=AAlength,Number=A,Type=String,Description=\"Amino acid length for each transcript. 0 for noncoding transcript.\">");
-        else if ( strcmp(col->hdr_key, "TSSdistance") == 0 )
-            BRANCH("TSSdistance", "##INFO=<ID=TSSdistance,Number=A,Type=Integer,Description=\"The distance between noncoding variant to nearby transcription start site. + for downstream, - for upstream.\">");
-    }
-#undef BRANCH
+        const struct mc_tag_def *def = mc_tag_def_find(f->cols[i].hdr_key);
+        int id = bcf_hdr_id2int(hdr, BCF_DT_ID, def->key);
+        if (id == -1) {
+            bcf_hdr_append(hdr, def->hdr_line);
+            bcf_hdr_sync(hdr);
+            id = bcf_hdr_id2int(hdr, BCF_DT_ID, def->key);
+            assert(bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id));
+        }
+    }
+    anno_mc_file_compile(f, hdr);
 
     f->h = mc_handler_init(rna, data, reference, name_list);
     return f;
@@ -3322,25 +3340,21 @@ int bcfanno_mc()
     
     for (;;) {
         struct anno_pool *arg = anno_reader(args.fp_input, args.hdr_out, args.n_record);
-        if ( arg->n_reader == 0 )
+        if ( arg->n_reader == 0 ) {
+            anno_pool_release(arg);
             break;
+        }
         arg->arg = &args;
-        int block;
-        do {
-            block = thread_pool_dispatch2(p, q, anno_mc, arg, 1);
-            if ( ( r = thread_pool_next_result(q) ) ) {
-                // generate output
-                struct anno_pool *data = (struct anno_pool*)r->data;
-                int i;
-                for ( i = 0; i < data->n_reader; ++i ) {
-                    bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
-                    bcf_destroy(data->readers[i]);
-                }
-                free(data->readers);
-                thread_pool_delete_result(r, 1);
-            }
-            // flush output
-        } while ( block == -1);
+        // sleep until the input queue has room, and write the ordered results meanwhile
+        while ( thread_pool_dispatch3(p, q, anno_mc, arg, &r) == 1 ) {
+            // generate output
+            struct anno_pool *data = (struct anno_pool*)r->data;
+            int i;
+            for ( i = 0; i < data->n_reader; ++i )
+                bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
+            anno_pool_release(data);
+            thread_pool_delete_result(r, 0);
+        }
     }
 
     thread_pool_process_flush(q);
@@ -3348,15 +3362,14 @@ int bcfanno_mc()
         // generate output
         struct anno_pool *data = (struct anno_pool*)r->data;
         int i;
-        for ( i = 0; i < data->n_reader; ++i ) {
+        for ( i = 0; i < data->n_reader; ++i )
             bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
-            bcf_destroy(data->readers[i]);
-        }
-        free(data->readers);
-        thread_pool_delete_result(r, 1);
+        anno_pool_release(data);
+        thread_pool_delete_result(r, 0);
     }
     thread_pool_process_destroy(q);
     thread_pool_destroy(p);
+    anno_pool_freelist_destroy();
     return 0;
 }
 
@@ -5,10 +5,13 @@
 #include "htslib/hts.h"
 #include "htslib/vcf.h"
 #include "htslib/tbx.h"
+#include "htslib/bgzf.h"
 #include "htslib/faidx.h"
 #include "anno_pool.h"
 #include "anno_col.h"
 #include "variant_type.h"
+#include "seq_cache.h"
+#include "anno_stats.h"
 
 extern int file_is_GEA(const char *fn);
 
@@ -17,8 +20,18 @@ struct mc_handler {
     const char *data_fname;
     const char *reference_fname;
     faidx_t *rna_fai;
+    // transcript sequences retrieved from rna_fai, per thread
+    struct seq_cache *rna_cache;
+    // genome reference, NULL if not specified
+    faidx_t *ref_fai;
+    struct seq_window *ref_win;
     tbx_t *idx;
     htsFile *fp_idx;
+    // set if data is BGEA, records are read in unpacked state and fp_idx is not opened
+    BGZF *fp_bgea;
+    struct bgea_tid_map *tid_map;
+    // whole database in memory if --preload-gea set, shared by all handlers
+    struct gea_preload *preload;
     struct gea_hdr *hdr;
     
     void *name_hash;
@@ -33,9 +46,18 @@ struct mc_handler {
     // gene and regulatory records
     void **records;
 
+    // scratch line for tabix reading, and recycled records released by previous chunks
+    kstring_t str;
+    int n_free;
+    int m_free;
+    void **free_records;
+
     // point to nearest gene record, used to interupt the up/downstream gene of intergenic variants
     void *last_gene;
     void *next_gene;
+
+    // index queries issued to the database
+    uint64_t n_query;
 };
 enum func_region_type {
     _func_region_promote_to_int = -1,
@@ -216,15 +238,27 @@ struct anno_mc_file {
     struct mc **files;
     int n_col;
     struct anno_col *cols;
+    // columns compiled at init, see anno_mc_file_compile()
+    int n_tag;
+    struct mc_tag *tags;
+    struct info_update *updates;
     char *tmps;
     int mtmps;
+    // counters of this handler, see anno_stats.h
+    struct anno_stat stat;
 };
 
 extern struct anno_mc_file *anno_mc_file_init(bcf_hdr_t *hdr, const char *column, const char *data, const char *rna, const char *reference, const char *name_list);
 extern struct anno_mc_file *anno_mc_file_duplicate(struct anno_mc_file *f);
 extern void anno_mc_file_destroy(struct anno_mc_file *f, int l);
+// size of transcript sequence cache per thread, set before init the files
+extern void mc_handler_set_rna_cache_size(size_t bytes);
+// load whole GEA database into memory and share it between threads, set before init the files
+extern void mc_handler_set_preload(int preload);
 //extern void anno_mc_core(struct anno_mc_file *f, bcf_hdr_t *hdr, bcf1_t *line);
 extern int anno_mc_chunk(struct anno_mc_file *f, bcf_hdr_t *hdr, struct anno_pool *pool);
+// Add counters of this handler, bytes inflated from the database and transcript cache use to s.
+extern void anno_mc_file_stat(struct anno_mc_file *f, struct anno_stat *s);
 
 
 #endif
@@ -0,0 +1,294 @@
+// anno_shard.c - Split indexed input into region tasks, and append annotated segments
+#include "anno_shard.h"
+#include "utils.h"
+#include "htslib/bgzf.h"
+#include "htslib/hfile.h"
+#include "htslib/kstring.h"
+#include <unistd.h>
+#include <limits.h>
+
+// Regions are estimated in windows of this size first, heavy windows are bisected down to
+// SHARD_MIN_WINDOW, the interval of tabix linear index and default min_shift of CSI, smaller
+// windows are not told apart by the index.
+#define SHARD_WINDOW (1<<20)
+#define SHARD_MIN_WINDOW (1<<14)
+// Before cutting parts, windows are bisected until smaller than 1/SHARD_PART_SPLIT of a part.
+#define SHARD_PART_SPLIT 8
+// Offsets inside BGZF blocks are counted at this compression ratio, high enough to keep the
+// order of offsets for any block compressed into more than 1 kb.
+#define SHARD_RATIO 64
+// Bins of tabix index cover 2^29 bp at most, contigs without length are probed up to here.
+#define SHARD_MAX_LENGTH (1<<29)
+
+struct shard_contig {
+    int tid;
+    int length;
+    // offsets of the first record and the end of records, contigs are ordered by the first
+    int64_t first, last;
+};
+
+// Virtual offset to an estimated position in compressed bytes.
+static inline int64_t shard_voffset(uint64_t voff)
+{
+    return (voff>>16) + (voff&0xffff) / SHARD_RATIO;
+}
+
+// Offset of the first record at or after pos, -1 if there is none. The end of records is set to
+// *last if not NULL.
+static int64_t shard_offset(const hts_idx_t *idx, int tid, int pos, int64_t *last)
+{
+    hts_itr_t *itr = hts_itr_query(idx, tid, pos, INT_MAX, NULL);
+    if ( itr == NULL ) return -1;
+    int64_t off = -1;
+    int i;
+    if ( itr->n_off ) off = shard_voffset(itr->off[0].u);
+    if ( last ) {
+        *last = off;
+        for ( i = 0; i < itr->n_off; ++i )
+            if ( *last < shard_voffset(itr->off[i].v) ) *last = shard_voffset(itr->off[i].v);
+    }
+    hts_itr_destroy(itr);
+    return off;
+}
+
+struct shard_window {
+    struct shard_region reg;
+    // nominal length, the last window of a contig ends at INT_MAX
+    int span;
+    // estimated size of records, by the offsets of the window and the next one
+    int64_t off, off_end;
+};
+
+struct shard_windows {
+    int n, m;
+    struct shard_window *a;
+    uint64_t total;
+};
+
+// Which of n even cuts the window at cumulative size cum falls in, empty windows at the end go
+// to the last one.
+static inline int shard_cut(uint64_t cum, uint64_t total, int n)
+{
+    int i = total ? cum * n / total : 0;
+    return i < n ? i : n - 1;
+}
+
+// Push the window, or its halves recursively if it is larger than max_size.
+static void shard_window_add(const hts_idx_t *idx, struct shard_windows *w, int tid, int beg, int end, int span, int64_t off, int64_t off_end, uint64_t max_size)
+{
+    uint64_t size = off_end - off;
+    if ( size > max_size && span > SHARD_MIN_WINDOW ) {
+        int mid = beg + span/2;
+        int64_t off_mid = shard_offset(idx, tid, mid, NULL);
+        // no record starts from mid
+        if ( off_mid < 0 ) off_mid = off_end;
+        if ( off_mid < off ) off_mid = off;
+        if ( off_mid > off_end ) off_mid = off_end;
+        shard_window_add(idx, w, tid, beg, mid, span/2, off, off_mid, max_size);
+        shard_window_add(idx, w, tid, mid, end, span - span/2, off_mid, off_end, max_size);
+        return;
+    }
+    if ( w->n == w->m ) {
+        w->m = w->m == 0 ? 1024 : w->m<<1;
+        w->a = realloc(w->a, w->m*sizeof(struct shard_window));
+    }
+    struct shard_window *win = &w->a[w->n++];
+    win->reg.tid = tid;
+    win->reg.beg = beg;
+    win->reg.end = end;
+    win->span = span;
+    win->off = off;
+    win->off_end = off_end;
+    w->total += size;
+}
+
+static int shard_contig_cmp(const void *a, const void *b)
+{
+    const struct shard_contig *c1 = (const struct shard_contig*)a;
+    const struct shard_contig *c2 = (const struct shard_contig*)b;
+    return c1->first < c2->first ? -1 : c1->first > c2->first;
+}
+
+static void shard_task_add(struct shard_task *task, int tid, int beg, int end)
+{
+    if ( task->n_reg ) {
+        // extend the last region if adjacent
+        struct shard_region *r = &task->regs[task->n_reg-1];
+        if ( r->tid == tid && r->end == beg ) {
+            r->end = end;
+            return;
+        }
+    }
+    if ( task->n_reg == task->m_reg ) {
+        task->m_reg = task->m_reg == 0 ? 4 : task->m_reg<<1;
+        task->regs = realloc(task->regs, task->m_reg*sizeof(struct shard_region));
+    }
+    struct shard_region *r = &task->regs[task->n_reg++];
+    r->tid = tid;
+    r->beg = beg;
+    r->end = end;
+}
+
+struct shard_task *anno_shard_plan(const hts_idx_t *idx, tbx_t *tbx, bcf_hdr_t *hdr, int i_part, int n_part, int n_task_hint, int *n_task)
+{
+    int i, j, n_contig = 0, n_name = 0;
+    const char **names = NULL;
+    if ( tbx ) names = tbx_seqnames(tbx, &n_name);
+    else n_name = hdr->n[BCF_DT_CTG];
+
+    // contigs with records, in the order of input
+    struct shard_contig *contigs = malloc((n_name+1)*sizeof(struct shard_contig));
+    for ( i = 0; i < n_name; ++i ) {
+        struct shard_contig *c = &contigs[n_contig];
+        int rid = tbx ? bcf_hdr_name2id(hdr, names[i]) : i;
+        c->tid = i;
+        c->first = shard_offset(idx, i, 0, &c->last);
+        if ( c->first < 0 ) continue;
+        c->length = rid >= 0 ? hdr->id[BCF_DT_CTG][rid].val->info[0] : 0;
+        if ( c->length <= 0 ) {
+            c->length = SHARD_WINDOW;
+            while ( c->length < SHARD_MAX_LENGTH && shard_offset(idx, i, c->length, NULL) >= 0 )
+                c->length <<= 1;
+        }
+        n_contig++;
+    }
+    free(names);
+    qsort(contigs, n_contig, sizeof(struct shard_contig), shard_contig_cmp);
+
+    // estimate the size of windows, and bisect the heavy ones so all parts get windows
+    struct shard_windows wins = {0,0,0,0}, split = {0,0,0,0};
+    for ( i = 0; i < n_contig; ++i ) {
+        struct shard_contig *c = &contigs[i];
+        int beg;
+        int64_t off = c->first;
+        for ( beg = 0; beg < c->length; beg += SHARD_WINDOW ) {
+            // the last window also covers the records out of contig length
+            int end = c->length - beg <= SHARD_WINDOW ? INT_MAX : beg + SHARD_WINDOW;
+            int span = c->length - beg < SHARD_WINDOW ? c->length - beg : SHARD_WINDOW;
+            int64_t next = end == INT_MAX ? -1 : shard_offset(idx, c->tid, end, NULL);
+            int64_t off_end = next < 0 || next > c->last ? c->last : next;
+            if ( off_end < off ) off_end = off;
+            shard_window_add(idx, &wins, c->tid, beg, end, span, off, off_end, UINT64_MAX);
+            // no more records of this contig
+            if ( next < 0 ) break;
+            off = off_end;
+        }
+    }
+    free(contigs);
+    uint64_t max_size = wins.total / ((uint64_t)n_part*SHARD_PART_SPLIT);
+    for ( j = 0; j < wins.n; ++j ) {
+        struct shard_window *w = &wins.a[j];
+        shard_window_add(idx, &split, w->reg.tid, w->reg.beg, w->reg.end, w->span, w->off, w->off_end, max_size);
+    }
+    free(wins.a);
+    wins = split;
+
+    // keep windows of the part, parts are cut at the cumulative size, so they only depend on
+    // the index and n_part; then bisect the kept windows again for tasks of this part
+    if ( n_task_hint < 1 ) n_task_hint = 1;
+    struct shard_windows keep = {0,0,0,0};
+    uint64_t cum = 0, part_total = 0;
+    for ( j = 0; j < wins.n; ++j ) {
+        uint64_t size = wins.a[j].off_end - wins.a[j].off;
+        int part = shard_cut(cum, wins.total, n_part);
+        cum += size;
+        if ( part == i_part ) part_total += size;
+    }
+    max_size = part_total / n_task_hint;
+    for ( j = 0, cum = 0; j < wins.n; ++j ) {
+        struct shard_window *w = &wins.a[j];
+        int part = shard_cut(cum, wins.total, n_part);
+        cum += w->off_end - w->off;
+        if ( part != i_part ) continue;
+        shard_window_add(idx, &keep, w->reg.tid, w->reg.beg, w->reg.end, w->span, w->off, w->off_end, max_size);
+    }
+    free(wins.a);
+
+    // group adjacent windows into tasks of similar size in the same way
+    struct shard_task *tasks = calloc(n_task_hint, sizeof(struct shard_task));
+    int last = -1;
+    *n_task = 0;
+    for ( j = 0, cum = 0; j < keep.n; ++j ) {
+        int t = shard_cut(cum, keep.total, n_task_hint);
+        cum += keep.a[j].off_end - keep.a[j].off;
+        if ( t != last ) {
+            (*n_task)++;
+            last = t;
+        }
+        shard_task_add(&tasks[*n_task-1], keep.a[j].reg.tid, keep.a[j].reg.beg, keep.a[j].reg.end);
+    }
+    free(keep.a);
+    return tasks;
+}
+
+void anno_shard_tasks_destroy(struct shard_task *tasks, int n_task)
+{
+    int i;
+    for ( i = 0; i < n_task; ++i ) {
+        free(tasks[i].regs);
+        if ( tasks[i].fname ) {
+            unlink(tasks[i].fname);
+            free(tasks[i].fname);
+        }
+    }
+    free(tasks);
+}
+
+htsFile *anno_shard_open(struct shard_task *task, const char *mode)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/bcfanno.XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+    int fd = mkstemp(str.s);
+    if ( fd == -1 ) error("Failed to create temporary file %s : %s", str.s, strerror(errno));
+    close(fd);
+    task->fname = str.s;
+    htsFile *fp = hts_open(task->fname, mode);
+    if ( fp == NULL ) error("Failed to open temporary file %s.", task->fname);
+    return fp;
+}
+
+// Empty BGZF block written at the end of each compressed segment.
+static const char bgzf_eof[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+
+int anno_shard_copy_blocks(hFILE *in, hFILE *out, int skip_eof)
+{
+    char buf[65536 + sizeof(bgzf_eof)];
+    size_t kept = 0;
+    ssize_t n;
+    // hold the last bytes back until the end of input, they may be the EOF block
+    while ( (n = hread(in, buf + kept, 65536)) > 0 ) {
+        kept += n;
+        if ( kept <= sizeof(bgzf_eof) ) continue;
+        size_t l = skip_eof ? kept - sizeof(bgzf_eof) : kept;
+        if ( hwrite(out, buf, l) != l ) return -1;
+        memmove(buf, buf + l, kept - l);
+        kept -= l;
+    }
+    if ( n < 0 ) return -1;
+    if ( skip_eof && kept == sizeof(bgzf_eof) && memcmp(buf, bgzf_eof, kept) == 0 ) return 0;
+    if ( kept && hwrite(out, buf, kept) != kept ) return -1;
+    return 0;
+}
+
+int anno_shard_append(htsFile *out, struct shard_task *task)
+{
+    hFILE *hout;
+    int is_compressed = 0;
+    if ( out->is_bgzf ) {
+        // finish the block in buffer, so the segment starts at a new block
+        if ( bgzf_flush(out->fp.bgzf) ) return -1;
+        hout = out->fp.bgzf->fp;
+        is_compressed = out->fp.bgzf->is_compressed;
+    }
+    else hout = out->fp.hfile;
+
+    hFILE *fp = hopen(task->fname, "r");
+    if ( fp == NULL ) return -1;
+    int ret = anno_shard_copy_blocks(fp, hout, is_compressed);
+    if ( hclose(fp) ) ret = -1;
+    unlink(task->fname);
+    free(task->fname);
+    task->fname = NULL;
+    return ret;
+}
@@ -0,0 +1,45 @@
+#ifndef ANNO_SHARD_H
+#define ANNO_SHARD_H
+
+#include <stdint.h>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "htslib/tbx.h"
+#include "htslib/hfile.h"
+
+// Region shards of indexed input. The genome is split into tasks of balanced size estimated
+// from the index bins, each task is read by its own iterator, annotated and written into a
+// temporary segment, and the segments are appended to output in order.
+struct shard_region {
+    // id in the index, same as rid of the header for BCF
+    int tid;
+    int beg;
+    int end;
+};
+
+struct shard_task {
+    int n_reg, m_reg;
+    struct shard_region *regs;
+    // temporary segment, written in the output format without header
+    char *fname;
+    // records annotated in this task
+    uint64_t n_record;
+};
+
+// Split the records indexed by idx into n_part deterministic parts of similar size, and split the
+// part i_part (0-based) into at most n_task_hint tasks. Tasks and regions are in the order of input.
+extern struct shard_task *anno_shard_plan(const hts_idx_t *idx, tbx_t *tbx, bcf_hdr_t *hdr, int i_part, int n_part, int n_task_hint, int *n_task);
+
+extern void anno_shard_tasks_destroy(struct shard_task *tasks, int n_task);
+
+// Create the temporary segment of a task in $TMPDIR, mode is the same as output.
+extern htsFile *anno_shard_open(struct shard_task *task, const char *mode);
+
+// Copy BGZF blocks, or raw bytes, from in to out. The EOF block at the end is skipped if skip_eof
+// is set. Return 0 on success.
+extern int anno_shard_copy_blocks(hFILE *in, hFILE *out, int skip_eof);
+
+// Append the segment of a task to output, remove the segment after that. Return 0 on success.
+extern int anno_shard_append(htsFile *out, struct shard_task *task);
+
+#endif
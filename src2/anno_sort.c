@@ -0,0 +1,306 @@
+// anno_sort.c - External sort of unsorted input and restore of the input order
+#include "anno_sort.h"
+#include "utils.h"
+#include "htslib/bgzf.h"
+#include <unistd.h>
+
+struct sort_rec {
+    uint64_t ord;
+    bcf1_t *b;
+};
+
+// A sorted run, spilled to a temporary file or the last buffer kept in memory.
+struct sort_run {
+    BGZF *fp;
+    // removed when the run is closed
+    char *fname;
+    // current record, for the in-memory run it is recs[i] of the buffer
+    struct sort_rec cur;
+    int i;
+};
+
+struct sort_buffer {
+    bcf_hdr_t *hdr;
+    // sort by input ordinal instead of coordinate
+    int by_ord;
+    size_t max_mem;
+    size_t mem;
+    int n, m;
+    struct sort_rec *recs;
+    // records of spilled buffer, reused by next push
+    int n_spare, m_spare;
+    bcf1_t **spare;
+    int n_run, m_run;
+    struct sort_run *runs;
+    // number of spilled buffers
+    int n_spill;
+    // runs ordered by the current records, runs[heap[0]] is the next one
+    int n_heap;
+    int *heap;
+};
+
+static int sort_rec_cmp_pos(const void *a, const void *b)
+{
+    const struct sort_rec *r1 = (const struct sort_rec*)a;
+    const struct sort_rec *r2 = (const struct sort_rec*)b;
+    if ( r1->b->rid != r2->b->rid ) return r1->b->rid < r2->b->rid ? -1 : 1;
+    if ( r1->b->pos != r2->b->pos ) return r1->b->pos < r2->b->pos ? -1 : 1;
+    if ( r1->ord != r2->ord ) return r1->ord < r2->ord ? -1 : 1;
+    return 0;
+}
+
+static int sort_rec_cmp_ord(const void *a, const void *b)
+{
+    const struct sort_rec *r1 = (const struct sort_rec*)a;
+    const struct sort_rec *r2 = (const struct sort_rec*)b;
+    if ( r1->ord != r2->ord ) return r1->ord < r2->ord ? -1 : 1;
+    return 0;
+}
+
+static struct sort_buffer *sort_buffer_init(bcf_hdr_t *hdr, int by_ord, size_t max_mem)
+{
+    struct sort_buffer *buf = malloc(sizeof(*buf));
+    memset(buf, 0, sizeof(*buf));
+    buf->hdr = hdr;
+    buf->by_ord = by_ord;
+    buf->max_mem = max_mem;
+    return buf;
+}
+
+static void sort_run_close(struct sort_run *r)
+{
+    if ( r->fp ) {
+        bgzf_close(r->fp);
+        r->fp = NULL;
+        bcf_destroy(r->cur.b);
+    }
+    if ( r->fname ) {
+        unlink(r->fname);
+        free(r->fname);
+        r->fname = NULL;
+    }
+}
+
+static void sort_buffer_destroy(struct sort_buffer *buf)
+{
+    int i;
+    for ( i = 0; i < buf->n; ++i ) bcf_destroy(buf->recs[i].b);
+    for ( i = 0; i < buf->n_spare; ++i ) bcf_destroy(buf->spare[i]);
+    for ( i = 0; i < buf->n_run; ++i ) sort_run_close(&buf->runs[i]);
+    free(buf->recs);
+    free(buf->spare);
+    free(buf->runs);
+    free(buf->heap);
+    free(buf);
+}
+
+static struct sort_run *sort_buffer_add_run(struct sort_buffer *buf)
+{
+    if ( buf->n_run == buf->m_run ) {
+        buf->m_run = buf->m_run == 0 ? 8 : buf->m_run<<1;
+        buf->runs = realloc(buf->runs, buf->m_run*sizeof(struct sort_run));
+    }
+    struct sort_run *r = &buf->runs[buf->n_run++];
+    memset(r, 0, sizeof(*r));
+    return r;
+}
+
+// Sort the buffer and write it to a temporary file. Each record is written as the 8 bytes
+// ordinal and the error code of parsing, followed by the BCF record without header. Records
+// are read back by bcf_readrec(), annotated records are not checked against the header.
+static void sort_buffer_spill(struct sort_buffer *buf)
+{
+    int i;
+    qsort(buf->recs, buf->n, sizeof(struct sort_rec), buf->by_ord ? sort_rec_cmp_ord : sort_rec_cmp_pos);
+
+    const char *tmpdir = getenv("TMPDIR");
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/bcfanno.XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+    int fd = mkstemp(str.s);
+    if ( fd == -1 ) error("Failed to create temporary file %s : %s", str.s, strerror(errno));
+    close(fd);
+
+    struct sort_run *r = sort_buffer_add_run(buf);
+    r->fname = str.s;
+    htsFile *fp = hts_open(r->fname, "wbu");
+    if ( fp == NULL ) error("Failed to open temporary file %s.", r->fname);
+    for ( i = 0; i < buf->n; ++i ) {
+        struct sort_rec *rec = &buf->recs[i];
+        // undefined keys of input are kept by dummy header records, checked when written to output
+        int errcode = rec->b->errcode;
+        rec->b->errcode = 0;
+        if ( bgzf_write(fp->fp.bgzf, &rec->ord, sizeof(uint64_t)) != sizeof(uint64_t)
+             || bgzf_write(fp->fp.bgzf, &errcode, sizeof(int)) != sizeof(int) || bcf_write1(fp, buf->hdr, rec->b) )
+            error("Failed to write temporary file %s.", r->fname);
+        if ( buf->n_spare == buf->m_spare ) {
+            buf->m_spare = buf->m_spare == 0 ? 1024 : buf->m_spare<<1;
+            buf->spare = realloc(buf->spare, buf->m_spare*sizeof(bcf1_t*));
+        }
+        buf->spare[buf->n_spare++] = rec->b;
+    }
+    if ( hts_close(fp) ) error("Failed to close temporary file %s.", r->fname);
+    buf->n = 0;
+    buf->mem = 0;
+    buf->n_spill++;
+}
+
+// Take the record *b, and replace it by an empty one.
+static void sort_buffer_push(struct sort_buffer *buf, bcf1_t **b, uint64_t ord)
+{
+    if ( buf->n == buf->m ) {
+        buf->m = buf->m == 0 ? 1024 : buf->m<<1;
+        buf->recs = realloc(buf->recs, buf->m*sizeof(struct sort_rec));
+    }
+    buf->recs[buf->n].ord = ord;
+    buf->recs[buf->n].b = *b;
+    buf->n++;
+    buf->mem += sizeof(bcf1_t) + sizeof(struct sort_rec) + (*b)->shared.m + (*b)->indiv.m;
+    *b = buf->n_spare ? buf->spare[--buf->n_spare] : bcf_init();
+    if ( buf->mem >= buf->max_mem ) sort_buffer_spill(buf);
+}
+
+static int sort_run_read(struct sort_buffer *buf, struct sort_run *r)
+{
+    if ( r->fp == NULL ) {
+        if ( r->i == buf->n ) return -1;
+        r->cur = buf->recs[r->i];
+        return 0;
+    }
+    int errcode, tid, beg, end;
+    ssize_t ret = bgzf_read(r->fp, &r->cur.ord, sizeof(uint64_t));
+    if ( ret == 0 ) return -1;
+    if ( ret != sizeof(uint64_t) || bgzf_read(r->fp, &errcode, sizeof(int)) != sizeof(int)
+         || bcf_readrec(r->fp, NULL, r->cur.b, &tid, &beg, &end) < 0 )
+        error("Failed to read temporary file %s.", r->fname);
+    r->cur.b->errcode = errcode;
+    return 0;
+}
+
+static int sort_buffer_run_cmp(struct sort_buffer *buf, int i, int j)
+{
+    return buf->by_ord ? sort_rec_cmp_ord(&buf->runs[i].cur, &buf->runs[j].cur) : sort_rec_cmp_pos(&buf->runs[i].cur, &buf->runs[j].cur);
+}
+
+static void sort_buffer_heap_down(struct sort_buffer *buf, int i)
+{
+    int *h = buf->heap;
+    for ( ;; ) {
+        int k = i, l = 2*i+1, r = 2*i+2;
+        if ( l < buf->n_heap && sort_buffer_run_cmp(buf, h[l], h[k]) < 0 ) k = l;
+        if ( r < buf->n_heap && sort_buffer_run_cmp(buf, h[r], h[k]) < 0 ) k = r;
+        if ( k == i ) break;
+        int tmp = h[i]; h[i] = h[k]; h[k] = tmp;
+        i = k;
+    }
+}
+
+// No more push, sort the records kept in memory and start to merge the runs.
+static void sort_buffer_finish(struct sort_buffer *buf)
+{
+    int i;
+    qsort(buf->recs, buf->n, sizeof(struct sort_rec), buf->by_ord ? sort_rec_cmp_ord : sort_rec_cmp_pos);
+    for ( i = 0; i < buf->n_run; ++i ) {
+        struct sort_run *r = &buf->runs[i];
+        r->fp = bgzf_open(r->fname, "r");
+        if ( r->fp == NULL ) error("Failed to open temporary file %s.", r->fname);
+        r->cur.b = buf->n_spare ? buf->spare[--buf->n_spare] : bcf_init();
+    }
+    if ( buf->n ) sort_buffer_add_run(buf);
+
+    buf->heap = malloc((buf->n_run+1)*sizeof(int));
+    buf->n_heap = 0;
+    for ( i = 0; i < buf->n_run; ++i )
+        if ( sort_run_read(buf, &buf->runs[i]) == 0 ) buf->heap[buf->n_heap++] = i;
+    for ( i = buf->n_heap/2 - 1; i >= 0; --i ) sort_buffer_heap_down(buf, i);
+
+    // spilled records are not needed any more
+    for ( i = 0; i < buf->n_spare; ++i ) bcf_destroy(buf->spare[i]);
+    buf->n_spare = 0;
+}
+
+// Swap *b with the next record in order. Return -1 if no more records.
+static int sort_buffer_next(struct sort_buffer *buf, bcf1_t **b, uint64_t *ord)
+{
+    if ( buf->n_heap == 0 ) return -1;
+    struct sort_run *r = &buf->runs[buf->heap[0]];
+    bcf1_t *tmp = *b;
+    *b = r->cur.b;
+    *ord = r->cur.ord;
+    if ( r->fp == NULL ) buf->recs[r->i++].b = tmp;
+    else r->cur.b = tmp;
+
+    if ( sort_run_read(buf, r) ) {
+        sort_run_close(r);
+        buf->heap[0] = buf->heap[--buf->n_heap];
+    }
+    sort_buffer_heap_down(buf, 0);
+    return 0;
+}
+
+struct anno_sort *anno_sort_init(bcf_hdr_t *hdr, size_t max_mem)
+{
+    struct anno_sort *s = malloc(sizeof(*s));
+    s->hdr = hdr;
+    s->input = sort_buffer_init(hdr, 0, max_mem);
+    s->output = sort_buffer_init(hdr, 1, max_mem);
+    return s;
+}
+
+void anno_sort_destroy(struct anno_sort *s)
+{
+    sort_buffer_destroy(s->input);
+    sort_buffer_destroy(s->output);
+    free(s);
+}
+
+uint64_t anno_sort_input(struct anno_sort *s, htsFile *fp)
+{
+    uint64_t n = 0;
+    bcf1_t *b = bcf_init();
+    while ( bcf_read(fp, s->hdr, b) == 0 )
+        sort_buffer_push(s->input, &b, n++);
+    bcf_destroy(b);
+    sort_buffer_finish(s->input);
+    return n;
+}
+
+struct anno_pool *anno_sort_reader(struct anno_sort *s, int n_record)
+{
+    struct anno_pool *p = anno_pool_init(n_record);
+    if ( p->ords == NULL )
+        p->ords = malloc(p->m*sizeof(uint64_t));
+    for ( ;; ) {
+        if ( p->n_reader == n_record ) break;
+        if ( sort_buffer_next(s->input, &p->readers[p->n_reader], &p->ords[p->n_reader]) ) break;
+        p->n_reader++;
+    }
+    return p;
+}
+
+void anno_sort_restore(struct anno_sort *s, struct anno_pool *pool)
+{
+    int i;
+    for ( i = 0; i < pool->n_reader; ++i )
+        sort_buffer_push(s->output, &pool->readers[i], pool->ords[i]);
+}
+
+int anno_sort_write(struct anno_sort *s, htsFile *fp)
+{
+    uint64_t ord;
+    bcf1_t *b = bcf_init();
+    int ret = 0;
+    sort_buffer_finish(s->output);
+    while ( sort_buffer_next(s->output, &b, &ord) == 0 ) {
+        if ( bcf_write1(fp, s->hdr, b) ) {
+            ret = -1;
+            break;
+        }
+    }
+    bcf_destroy(b);
+    return ret;
+}
+
+int anno_sort_spilled(struct anno_sort *s)
+{
+    return s->input->n_spill + s->output->n_spill;
+}
@@ -0,0 +1,44 @@
+#ifndef ANNO_SORT_H
+#define ANNO_SORT_H
+
+#include <stdint.h>
+#include "htslib/vcf.h"
+#include "htslib/hts.h"
+#include "anno_pool.h"
+
+#define SORT_BUFFER_MB 512
+
+// External sort for unsorted input. Records are tagged with the input ordinal and sorted by
+// coordinate in buffers of bounded memory; full buffers are spilled to temporary BCF files in
+// $TMPDIR and merged back when pools are read, so unsorted input is annotated by the chunk
+// path. Annotated pools are collected and sorted by the ordinal in the same way to restore the
+// input order at output.
+struct sort_buffer;
+
+struct anno_sort {
+    bcf_hdr_t *hdr;
+    // sorted by coordinate
+    struct sort_buffer *input;
+    // sorted by input ordinal
+    struct sort_buffer *output;
+};
+
+extern struct anno_sort *anno_sort_init(bcf_hdr_t *hdr, size_t max_mem);
+extern void anno_sort_destroy(struct anno_sort *s);
+
+// Read and sort all records of fp, return the number of records.
+extern uint64_t anno_sort_input(struct anno_sort *s, htsFile *fp);
+
+// Next pool of records in coordinate order, the input ordinals are kept in pool->ords.
+extern struct anno_pool *anno_sort_reader(struct anno_sort *s, int n_record);
+
+// Take the annotated records of pool, the records in pool are replaced by empty ones.
+extern void anno_sort_restore(struct anno_sort *s, struct anno_pool *pool);
+
+// Write all restored records in input order. Return 0 on success.
+extern int anno_sort_write(struct anno_sort *s, htsFile *fp);
+
+// Number of temporary files written.
+extern int anno_sort_spilled(struct anno_sort *s);
+
+#endif
@@ -0,0 +1,186 @@
+// anno_stats.c - Wall and CPU time, peak memory, annotator and stage counters of a run
+#include "anno_stats.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define STATS_MAX_STAGE 8
+
+struct stats_stage {
+    const char *name;
+    int n_thread;
+    double busy;
+    double idle;
+    double blocked;
+};
+
+struct stats_annotator {
+    const char *type;
+    const char *fname;
+    struct anno_stat s;
+};
+
+static struct {
+    const char *fname;
+    double start;
+    int n_stage;
+    struct stats_stage stages[STATS_MAX_STAGE];
+    int n_anno, m_anno;
+    struct stats_annotator *annos;
+} stats = {
+    .fname = NULL,
+    .start = 0,
+    .n_stage = 0,
+    .n_anno = 0,
+    .m_anno = 0,
+    .annos = NULL,
+};
+
+void anno_stat_add(struct anno_stat *dst, const struct anno_stat *src)
+{
+    dst->time     += src->time;
+    dst->n_record += src->n_record;
+    dst->n_match  += src->n_match;
+    dst->n_query  += src->n_query;
+    dst->n_byte   += src->n_byte;
+    dst->n_hit    += src->n_hit;
+    dst->n_miss   += src->n_miss;
+}
+
+static double stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void anno_stats_start(void)
+{
+    stats.start = stats_now();
+}
+
+double anno_stats_wall(void)
+{
+    return stats_now() - stats.start;
+}
+
+double anno_stats_cpu(void)
+{
+    struct rusage ru;
+    if ( getrusage(RUSAGE_SELF, &ru) ) return 0;
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6;
+}
+
+void anno_stats_set_output(const char *fname)
+{
+    stats.fname = fname;
+}
+
+int anno_stats_enabled(void)
+{
+    return stats.fname != NULL;
+}
+
+void anno_stats_stage(const char *name, int n_thread, double busy, double idle, double blocked)
+{
+    if ( stats.n_stage == STATS_MAX_STAGE ) return;
+    struct stats_stage *s = &stats.stages[stats.n_stage++];
+    s->name = name;
+    s->n_thread = n_thread;
+    s->busy = busy;
+    s->idle = idle;
+    s->blocked = blocked;
+}
+
+void anno_stats_annotator(const char *type, const char *fname, struct anno_stat *s)
+{
+    if ( stats.n_anno == stats.m_anno ) {
+        stats.m_anno = stats.m_anno == 0 ? 8 : stats.m_anno<<1;
+        stats.annos = realloc(stats.annos, stats.m_anno*sizeof(struct stats_annotator));
+    }
+    struct stats_annotator *a = &stats.annos[stats.n_anno++];
+    a->type = type;
+    a->fname = fname;
+    a->s = *s;
+}
+
+// JSON string with quotes, control characters are escaped.
+static void stats_put_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for ( ; s && *s; ++s ) {
+        unsigned char c = *s;
+        if ( c == '"' || c == '\\' ) fprintf(fp, "\\%c", c);
+        else if ( c < 0x20 ) fprintf(fp, "\\u%04x", c);
+        else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+int anno_stats_write(const char *version, const char *command, int n_thread, uint64_t n_record)
+{
+    struct rusage ru;
+    int i;
+    if ( stats.fname == NULL ) return 0;
+    FILE *fp = fopen(stats.fname, "w");
+    if ( fp == NULL ) {
+        warnings("Failed to write %s.", stats.fname);
+        return 1;
+    }
+    memset(&ru, 0, sizeof(ru));
+    getrusage(RUSAGE_SELF, &ru);
+
+    fprintf(fp, "{\n  \"version\": ");
+    stats_put_string(fp, version);
+    fprintf(fp, ",\n  \"command\": ");
+    stats_put_string(fp, command);
+    fprintf(fp, ",\n  \"threads\": %d,\n", n_thread);
+    fprintf(fp, "  \"records\": %llu,\n", (unsigned long long)n_record);
+    fprintf(fp, "  \"wall_seconds\": %.3f,\n", anno_stats_wall());
+    fprintf(fp, "  \"cpu_seconds\": %.3f,\n", anno_stats_cpu());
+    fprintf(fp, "  \"user_seconds\": %.3f,\n", ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6);
+    fprintf(fp, "  \"system_seconds\": %.3f,\n", ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6);
+    // kilobytes on Linux
+    fprintf(fp, "  \"peak_rss_kb\": %ld,\n", ru.ru_maxrss);
+
+    fprintf(fp, "  \"stages\": [");
+    for ( i = 0; i < stats.n_stage; ++i ) {
+        struct stats_stage *s = &stats.stages[i];
+        fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+        stats_put_string(fp, s->name);
+        fprintf(fp, ", \"threads\": %d, \"busy_seconds\": %.3f, \"idle_seconds\": %.3f, \"blocked_seconds\": %.3f}",
+                s->n_thread, s->busy, s->idle, s->blocked);
+    }
+    fprintf(fp, "%s],\n", stats.n_stage ? "\n  " : "");
+
+    fprintf(fp, "  \"annotators\": [");
+    for ( i = 0; i < stats.n_anno; ++i ) {
+        struct stats_annotator *a = &stats.annos[i];
+        struct anno_stat *s = &a->s;
+        fprintf(fp, "%s\n    {\"type\": ", i ? "," : "");
+        stats_put_string(fp, a->type);
+        fprintf(fp, ", \"file\": ");
+        if ( a->fname ) stats_put_string(fp, a->fname);
+        else fprintf(fp, "null");
+        fprintf(fp, ", \"seconds\": %.3f, \"records\": %llu, \"matched\": %llu, \"queries\": %llu, \"bgzf_bytes\": %llu",
+                s->time, (unsigned long long)s->n_record, (unsigned long long)s->n_match,
+                (unsigned long long)s->n_query, (unsigned long long)s->n_byte);
+        fprintf(fp, ", \"cache_hits\": %llu, \"cache_misses\": %llu, \"cache_hit_rate\": ",
+                (unsigned long long)s->n_hit, (unsigned long long)s->n_miss);
+        if ( s->n_hit + s->n_miss > 0 ) fprintf(fp, "%.4f}", (double)s->n_hit/(s->n_hit + s->n_miss));
+        else fprintf(fp, "null}");
+    }
+    fprintf(fp, "%s]\n}\n", stats.n_anno ? "\n  " : "");
+
+    free(stats.annos);
+    stats.annos = NULL;
+    stats.n_anno = stats.m_anno = 0;
+    if ( fclose(fp) ) {
+        warnings("Failed to write %s.", stats.fname);
+        return 1;
+    }
+    return 0;
+}
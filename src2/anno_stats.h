@@ -0,0 +1,48 @@
+#ifndef ANNO_STATS_H
+#define ANNO_STATS_H
+
+#include <stdint.h>
+
+// Run report of --stats. Annotators count their work in struct anno_stat, one per thread, and
+// the counters are summed by annotator at the end of run. Pipeline stages and process wide
+// times are recorded here and written in JSON by anno_stats_write().
+
+// Counters of one annotator in one thread.
+struct anno_stat {
+    // seconds spent in the annotator, only counted if stats are enabled
+    double time;
+    // records passed to the annotator, and records it found values for
+    uint64_t n_record;
+    uint64_t n_match;
+    // index queries issued to the database
+    uint64_t n_query;
+    // bytes inflated from the BGZF blocks of the database
+    uint64_t n_byte;
+    // hits and misses of the cache of the annotator
+    uint64_t n_hit;
+    uint64_t n_miss;
+};
+
+extern void anno_stat_add(struct anno_stat *dst, const struct anno_stat *src);
+
+// Record the start of run, called first in main().
+extern void anno_stats_start(void);
+
+// Seconds since anno_stats_start() on the wall clock, and CPU seconds of all threads.
+extern double anno_stats_wall(void);
+extern double anno_stats_cpu(void);
+
+// Write the report to fname at the end of run.
+extern void anno_stats_set_output(const char *fname);
+extern int anno_stats_enabled(void);
+
+// Busy, idle and blocked seconds of a pipeline stage.
+extern void anno_stats_stage(const char *name, int n_thread, double busy, double idle, double blocked);
+
+// Counters of an annotator summed over threads, added in config order.
+extern void anno_stats_annotator(const char *type, const char *fname, struct anno_stat *s);
+
+// Write the report, return 0 on success.
+extern int anno_stats_write(const char *version, const char *command, int n_thread, uint64_t n_record);
+
+#endif
@@ -0,0 +1,395 @@
+// anno_steal.c - Work-stealing pool with per-worker deques and ordered results
+#include "anno_steal.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+struct steal_job {
+    // submitted job of a sub-task, or itself
+    struct steal_job *root;
+    // function of submitted job
+    void *(*func)(void *arg, int idx);
+    // function of sub-task
+    void (*sub)(void *arg, int idx);
+    void *arg;
+    // only for submitted job
+    uint64_t serial;
+    // unfinished parts, the job itself and its sub-tasks
+    atomic_int pending;
+    void *result;
+};
+
+// Jobs are pushed at the back, sub-tasks at the front; owner and thieves both take the front,
+// so the oldest work is done first and the ordered output is not held back.
+struct steal_deque {
+    pthread_mutex_t lock;
+    // checked without lock before stealing
+    atomic_int n;
+    int head, m;
+    struct steal_job **jobs;
+};
+
+// Result slot of serial, written by the worker which completes the job and read by the main
+// thread.
+struct steal_slot {
+    atomic_int ready;
+    void *data;
+};
+
+struct steal_worker {
+    struct steal_pool *p;
+    int idx;
+    pthread_t tid;
+    // job being run, sub-tasks spawned by it belong to its root
+    struct steal_job *curr;
+    struct steal_deque deque;
+    // stage time in microseconds, written by this worker only
+    atomic_uint_fast64_t busy;
+    atomic_uint_fast64_t idle;
+    // start time of current wait, 0 if not waiting
+    atomic_uint_fast64_t wait_start;
+};
+
+struct steal_pool {
+    int n_thread;
+    struct steal_worker *workers;
+    void *(*finish)(void *result, int idx);
+
+    // jobs in all deques, and workers waiting for them
+    atomic_int n_queued;
+    atomic_int n_sleeping;
+    int shutdown;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_c;
+
+    // results, only the main thread submits and consumes
+    int n_slot;
+    struct steal_slot *slots;
+    uint64_t next_serial;
+    uint64_t next_out;
+    // deque to put next submitted job
+    int next_worker;
+    atomic_int main_waiting;
+    pthread_mutex_t main_lock;
+    pthread_cond_t main_c;
+    uint64_t submit_blocked;
+
+    atomic_uint_fast64_t n_spawn;
+    atomic_uint_fast64_t n_steal;
+};
+
+static uint64_t steal_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void steal_deque_init(struct steal_deque *d)
+{
+    pthread_mutex_init(&d->lock, NULL);
+    atomic_init(&d->n, 0);
+    d->head = 0;
+    d->m = 16;
+    d->jobs = malloc(d->m*sizeof(struct steal_job*));
+}
+
+static void steal_deque_push(struct steal_deque *d, struct steal_job *j, int front)
+{
+    pthread_mutex_lock(&d->lock);
+    int n = atomic_load_explicit(&d->n, memory_order_relaxed);
+    if ( n == d->m ) {
+        struct steal_job **jobs = malloc(d->m*2*sizeof(struct steal_job*));
+        int i;
+        for ( i = 0; i < n; ++i ) jobs[i] = d->jobs[(d->head+i)%d->m];
+        free(d->jobs);
+        d->jobs = jobs;
+        d->head = 0;
+        d->m *= 2;
+    }
+    if ( front ) {
+        d->head = (d->head + d->m - 1) % d->m;
+        d->jobs[d->head] = j;
+    }
+    else d->jobs[(d->head+n)%d->m] = j;
+    atomic_store_explicit(&d->n, n+1, memory_order_relaxed);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static struct steal_job *steal_deque_pop(struct steal_deque *d)
+{
+    if ( atomic_load_explicit(&d->n, memory_order_relaxed) == 0 ) return NULL;
+    struct steal_job *j = NULL;
+    pthread_mutex_lock(&d->lock);
+    int n = atomic_load_explicit(&d->n, memory_order_relaxed);
+    if ( n > 0 ) {
+        j = d->jobs[d->head];
+        d->head = (d->head+1) % d->m;
+        atomic_store_explicit(&d->n, n-1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return j;
+}
+
+// Wake a waiting worker after a job is pushed.
+static void steal_pool_notify(struct steal_pool *p)
+{
+    atomic_fetch_add(&p->n_queued, 1);
+    if ( atomic_load(&p->n_sleeping) > 0 ) {
+        pthread_mutex_lock(&p->idle_lock);
+        pthread_cond_signal(&p->idle_c);
+        pthread_mutex_unlock(&p->idle_lock);
+    }
+}
+
+static struct steal_job *steal_pool_take(struct steal_pool *p, int idx)
+{
+    struct steal_job *j = steal_deque_pop(&p->workers[idx].deque);
+    int i;
+    for ( i = 1; j == NULL && i < p->n_thread; ++i ) {
+        j = steal_deque_pop(&p->workers[(idx+i)%p->n_thread].deque);
+        if ( j ) atomic_fetch_add_explicit(&p->n_steal, 1, memory_order_relaxed);
+    }
+    if ( j ) atomic_fetch_sub(&p->n_queued, 1);
+    return j;
+}
+
+// Publish the result of a job whose parts have all finished.
+static void steal_job_complete(struct steal_pool *p, struct steal_job *root, int idx)
+{
+    void *result = root->result;
+    if ( p->finish ) result = p->finish(result, idx);
+    struct steal_slot *s = &p->slots[root->serial % p->n_slot];
+    s->data = result;
+    free(root);
+    atomic_store(&s->ready, 1);
+    if ( atomic_load(&p->main_waiting) ) {
+        pthread_mutex_lock(&p->main_lock);
+        pthread_cond_broadcast(&p->main_c);
+        pthread_mutex_unlock(&p->main_lock);
+    }
+}
+
+static void steal_job_run(struct steal_pool *p, struct steal_worker *w, struct steal_job *j)
+{
+    struct steal_job *root = j->root;
+    w->curr = root;
+    if ( j == root ) root->result = root->func(root->arg, w->idx);
+    else {
+        j->sub(j->arg, w->idx);
+        free(j);
+    }
+    w->curr = NULL;
+    // the last finished part publishes the result
+    if ( atomic_fetch_sub(&root->pending, 1) == 1 )
+        steal_job_complete(p, root, w->idx);
+}
+
+static void *steal_worker(void *arg)
+{
+    struct steal_worker *w = (struct steal_worker*)arg;
+    struct steal_pool *p = w->p;
+    for ( ;; ) {
+        struct steal_job *j = steal_pool_take(p, w->idx);
+        if ( j ) {
+            uint64_t start = steal_now();
+            steal_job_run(p, w, j);
+            atomic_fetch_add_explicit(&w->busy, steal_now() - start, memory_order_relaxed);
+            continue;
+        }
+
+        pthread_mutex_lock(&p->idle_lock);
+        atomic_fetch_add(&p->n_sleeping, 1);
+        uint64_t start = steal_now();
+        atomic_store_explicit(&w->wait_start, start, memory_order_relaxed);
+        while ( atomic_load(&p->n_queued) == 0 && !p->shutdown )
+            pthread_cond_wait(&p->idle_c, &p->idle_lock);
+        atomic_store_explicit(&w->wait_start, 0, memory_order_relaxed);
+        atomic_fetch_add_explicit(&w->idle, steal_now() - start, memory_order_relaxed);
+        atomic_fetch_sub(&p->n_sleeping, 1);
+        int shutdown = p->shutdown && atomic_load(&p->n_queued) == 0;
+        pthread_mutex_unlock(&p->idle_lock);
+        if ( shutdown ) break;
+    }
+    return NULL;
+}
+
+struct steal_pool *steal_pool_init(int n_thread, int n_slot, void *(*finish)(void *result, int idx))
+{
+    struct steal_pool *p = malloc(sizeof(*p));
+    memset(p, 0, sizeof(*p));
+    if ( n_thread < 1 ) n_thread = 1;
+    if ( n_slot < 1 ) n_slot = 1;
+    p->n_thread = n_thread;
+    p->finish = finish;
+    atomic_init(&p->n_queued, 0);
+    atomic_init(&p->n_sleeping, 0);
+    atomic_init(&p->main_waiting, 0);
+    atomic_init(&p->n_spawn, 0);
+    atomic_init(&p->n_steal, 0);
+    pthread_mutex_init(&p->idle_lock, NULL);
+    pthread_cond_init(&p->idle_c, NULL);
+    pthread_mutex_init(&p->main_lock, NULL);
+    pthread_cond_init(&p->main_c, NULL);
+
+    p->n_slot = n_slot;
+    p->slots = malloc(n_slot*sizeof(struct steal_slot));
+    int i;
+    for ( i = 0; i < n_slot; ++i ) {
+        atomic_init(&p->slots[i].ready, 0);
+        p->slots[i].data = NULL;
+    }
+
+    p->workers = malloc(n_thread*sizeof(struct steal_worker));
+    for ( i = 0; i < n_thread; ++i ) {
+        struct steal_worker *w = &p->workers[i];
+        w->p = p;
+        w->idx = i;
+        w->curr = NULL;
+        steal_deque_init(&w->deque);
+        atomic_init(&w->busy, 0);
+        atomic_init(&w->idle, 0);
+        atomic_init(&w->wait_start, 0);
+    }
+    for ( i = 0; i < n_thread; ++i )
+        if ( pthread_create(&p->workers[i].tid, NULL, steal_worker, &p->workers[i]) )
+            error("Failed to create worker thread : %s.", strerror(errno));
+    return p;
+}
+
+// Take the next ordered result if it is ready.
+static int steal_pool_result(struct steal_pool *p, void **result)
+{
+    if ( p->next_out == p->next_serial ) return 0;
+    struct steal_slot *s = &p->slots[p->next_out % p->n_slot];
+    if ( atomic_load(&s->ready) == 0 ) return 0;
+    *result = s->data;
+    s->data = NULL;
+    atomic_store(&s->ready, 0);
+    p->next_out++;
+    return 1;
+}
+
+// Sleep until the next ordered result is ready.
+static void steal_pool_wait(struct steal_pool *p)
+{
+    struct steal_slot *s = &p->slots[p->next_out % p->n_slot];
+    pthread_mutex_lock(&p->main_lock);
+    atomic_store(&p->main_waiting, 1);
+    while ( atomic_load(&s->ready) == 0 )
+        pthread_cond_wait(&p->main_c, &p->main_lock);
+    atomic_store(&p->main_waiting, 0);
+    pthread_mutex_unlock(&p->main_lock);
+}
+
+int steal_pool_submit(struct steal_pool *p, void *(*func)(void *arg, int idx), void *arg, void **result)
+{
+    if ( steal_pool_result(p, result) ) return 1;
+    if ( p->next_serial - p->next_out == p->n_slot ) {
+        // all slots are in flight, wait for the oldest one
+        uint64_t start = steal_now();
+        steal_pool_wait(p);
+        p->submit_blocked += steal_now() - start;
+        steal_pool_result(p, result);
+        return 1;
+    }
+    struct steal_job *j = malloc(sizeof(*j));
+    j->root = j;
+    j->func = func;
+    j->sub = NULL;
+    j->arg = arg;
+    j->serial = p->next_serial++;
+    atomic_init(&j->pending, 1);
+    j->result = NULL;
+    steal_deque_push(&p->workers[p->next_worker].deque, j, 0);
+    p->next_worker = (p->next_worker+1) % p->n_thread;
+    steal_pool_notify(p);
+    return 0;
+}
+
+int steal_pool_next_result_wait(struct steal_pool *p, void **result)
+{
+    if ( p->next_out == p->next_serial ) return -1;
+    if ( steal_pool_result(p, result) ) return 0;
+    steal_pool_wait(p);
+    steal_pool_result(p, result);
+    return 0;
+}
+
+int steal_pool_hungry(struct steal_pool *p)
+{
+    return atomic_load_explicit(&p->n_sleeping, memory_order_relaxed) > 0
+        && atomic_load_explicit(&p->n_queued, memory_order_relaxed) == 0;
+}
+
+void steal_pool_spawn(struct steal_pool *p, int idx, void (*func)(void *arg, int idx), void *arg)
+{
+    struct steal_worker *w = &p->workers[idx];
+    assert(w->curr);
+    struct steal_job *j = malloc(sizeof(*j));
+    j->root = w->curr;
+    j->func = NULL;
+    j->sub = func;
+    j->arg = arg;
+    j->serial = 0;
+    atomic_init(&j->pending, 0);
+    j->result = NULL;
+    atomic_fetch_add(&w->curr->pending, 1);
+    steal_deque_push(&w->deque, j, 1);
+    atomic_fetch_add_explicit(&p->n_spawn, 1, memory_order_relaxed);
+    steal_pool_notify(p);
+}
+
+void steal_pool_stat(struct steal_pool *p, struct thread_pool_stat *s)
+{
+    int i;
+    uint64_t now = steal_now();
+    memset(s, 0, sizeof(*s));
+    for ( i = 0; i < p->n_thread; ++i ) {
+        struct steal_worker *w = &p->workers[i];
+        uint64_t start = atomic_load_explicit(&w->wait_start, memory_order_relaxed);
+        s->busy += atomic_load_explicit(&w->busy, memory_order_relaxed);
+        s->idle += atomic_load_explicit(&w->idle, memory_order_relaxed);
+        if ( start && now > start ) s->idle += now - start;
+    }
+}
+
+uint64_t steal_pool_submit_blocked(struct steal_pool *p)
+{
+    return p->submit_blocked;
+}
+
+void steal_pool_counts(struct steal_pool *p, uint64_t *n_spawn, uint64_t *n_steal)
+{
+    *n_spawn = atomic_load(&p->n_spawn);
+    *n_steal = atomic_load(&p->n_steal);
+}
+
+int steal_pool_size(struct steal_pool *p)
+{
+    return p->n_thread;
+}
+
+void steal_pool_destroy(struct steal_pool *p)
+{
+    int i;
+    pthread_mutex_lock(&p->idle_lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->idle_c);
+    pthread_mutex_unlock(&p->idle_lock);
+    for ( i = 0; i < p->n_thread; ++i ) {
+        struct steal_worker *w = &p->workers[i];
+        pthread_join(w->tid, NULL);
+        pthread_mutex_destroy(&w->deque.lock);
+        free(w->deque.jobs);
+    }
+    pthread_mutex_destroy(&p->idle_lock);
+    pthread_cond_destroy(&p->idle_c);
+    pthread_mutex_destroy(&p->main_lock);
+    pthread_cond_destroy(&p->main_c);
+    free(p->workers);
+    free(p->slots);
+    free(p);
+}
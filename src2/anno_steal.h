@@ -0,0 +1,53 @@
+#ifndef ANNO_STEAL_H
+#define ANNO_STEAL_H
+
+#include <stdint.h>
+#include "anno_thread_pool.h"
+
+// Work-stealing pool for annotation. Each worker owns a deque guarded by its own lock, so
+// workers do not contend on a single pool mutex. Jobs submitted by the main thread are
+// spread over the deques, workers take the oldest job of their own deque first and steal
+// the oldest job of other deques when empty. Results are published into slots indexed by
+// serial without locking, and the main thread consumes them in submit order.
+//
+// A running job may split off part of its work with steal_pool_spawn() when other workers
+// are starving (see steal_pool_hungry()). The result of a job is published only after all
+// of its sub-tasks have finished.
+struct steal_pool;
+
+// Create a pool of n_thread workers, at most n_slot jobs are in flight. The finish function,
+// if set, is called by the worker which completes a job and all of its sub-tasks, and its
+// return value is published as the result.
+extern struct steal_pool *steal_pool_init(int n_thread, int n_slot, void *(*finish)(void *result, int idx));
+
+// Submit a job, or return the next ordered result first. If a result is ready, return 1 and
+// set *result, the job is not submitted yet and should be submitted again. Otherwise block
+// until there is a free slot and submit the job, return 0.
+extern int steal_pool_submit(struct steal_pool *p, void *(*func)(void *arg, int idx), void *arg, void **result);
+
+// Wait for the next ordered result. Return 0 and set *result, or -1 if no job is pending.
+extern int steal_pool_next_result_wait(struct steal_pool *p, void **result);
+
+// True if some workers are waiting for jobs and no job is queued, so the caller had better
+// split its remaining work.
+extern int steal_pool_hungry(struct steal_pool *p);
+
+// Called by the job running on worker idx, push a sub-task of this job to the deque of the
+// worker. Other workers may steal it.
+extern void steal_pool_spawn(struct steal_pool *p, int idx, void (*func)(void *arg, int idx), void *arg);
+
+// Accumulated time of the workers. Blocked is not used as results never wait for room.
+extern void steal_pool_stat(struct steal_pool *p, struct thread_pool_stat *s);
+
+// Time steal_pool_submit() waited for a free slot, in microseconds.
+extern uint64_t steal_pool_submit_blocked(struct steal_pool *p);
+
+// Number of sub-tasks spawned, and stolen by other workers.
+extern void steal_pool_counts(struct steal_pool *p, uint64_t *n_spawn, uint64_t *n_steal);
+
+extern int steal_pool_size(struct steal_pool *p);
+
+// Wait for the workers to exit. All results should be consumed before.
+extern void steal_pool_destroy(struct steal_pool *p);
+
+#endif
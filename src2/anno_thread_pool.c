@@ -32,13 +32,24 @@ DEALINGS IN THE SOFTWARE.  */
 #include <sys/time.h>
 #include <unistd.h>
 #include <limits.h>
+#include <string.h>
+#include <time.h>
 #include "anno_thread_pool.h"
 
 static int thread_pool_add_result(struct thread_pool_job *j, void *data);
 static void wake_next_worker(struct thread_pool_process *q, int locked);
 static struct thread_pool_result *thread_pool_next_result_locked(struct thread_pool_process *q);
 static void *thread_pool_worker(void *arg);
+static void thread_pool_enqueue_locked(struct thread_pool *p, struct thread_pool_process *q,
+                                       struct thread_pool_job *j);
 
+// Monotonic clock in microseconds, for the stage times.
+static uint64_t thread_pool_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
 
 // A process-queue to hold results from the thread pool.
 //
@@ -84,6 +95,10 @@ static int thread_pool_add_result(struct thread_pool_job *j, void *data) {
     }
 
     pthread_cond_broadcast(&q->output_avail_c);
+    // dispatchers of thread_pool_dispatch3() sleep on input_not_full_c, and take the
+    // result while waiting for room
+    if ( q->n_dispatch_wait )
+        pthread_cond_broadcast(&q->input_not_full_c);
 
     pthread_mutex_unlock(&q->p->pool_mutex);
 
@@ -294,6 +309,8 @@ struct thread_pool_process *thread_pool_process_init(struct thread_pool *p, int
     q->in_only = in_only;
     q->shutdown = 0;
     q->wake_dispatch = 0;
+    q->n_dispatch_wait = 0;
+    q->dispatch_blocked = 0;
     q->ref_count = 1;
     q->next = NULL;
     q->prev = NULL;
@@ -360,7 +377,8 @@ void thread_pool_process_detach(struct thread_pool *p, struct thread_pool_proces
         if ( curr == q ) {
             q->next->prev = q->prev;
             q->prev->next = q->next;
-            p->q_head = q->prev = NULL;
+            p->q_head = q->next;
+            q->next = q->prev = NULL;
 
             // Last one
             if ( p->q_head == q )
@@ -395,7 +413,7 @@ static void *thread_pool_worker(void *arg) {
 
         assert(p->q_head == 0 || (p->q_head->prev && p->q_head->next));
 
-        int work_to_do = 0;
+        int work_to_do = 0, has_input = 0;
         struct thread_pool_process *first = p->q_head, *q = first;
 
         do {
@@ -404,10 +422,12 @@ static void *thread_pool_worker(void *arg) {
 
             // Iterate over queues,
             // finding one with jobs and also room to put the result.          
-            if ( q && q->input_head
-                 && q->qsize - q->n_output > p->tsize - p->n_waiting) {
-                work_to_do = 1;
-                break;
+            if ( q && q->input_head ) {
+                if ( q->qsize - q->n_output > p->tsize - p->n_waiting ) {
+                    work_to_do = 1;
+                    break;
+                }
+                has_input = 1;
             }
 
             if ( q ) q = q->next;
@@ -429,9 +449,15 @@ static void *thread_pool_worker(void *arg) {
 
             p->t_stack[w->idx] = 1;
 
+            w->wait_start = thread_pool_now();
+            w->wait_blocked = has_input;
             pthread_cond_wait(&w->pending_c, &p->pool_mutex);
             p->t_stack[w->idx] = 0;
 
+            uint64_t waited = thread_pool_now() - w->wait_start;
+            if ( w->wait_blocked ) p->stat.blocked += waited;
+            else p->stat.idle += waited;
+
             // Find new t_stack_top
             int i;
             p->t_stack_top = -1;
@@ -477,10 +503,12 @@ static void *thread_pool_worker(void *arg) {
             pthread_mutex_unlock(&p->pool_mutex);
 
             //
+            uint64_t start = thread_pool_now();
             thread_pool_add_result(j, j->func(j->arg, w->idx));
             free(j);
 
             pthread_mutex_lock(&p->pool_mutex);            
+            p->stat.busy += thread_pool_now() - start;
         }
 
         if ( --q->ref_count == 0 )
@@ -560,6 +588,7 @@ struct thread_pool *thread_pool_init(int n_threads)
     p->t_stack = NULL;
     p->n_count = 0;
     p->n_running = 0;
+    memset(&p->stat, 0, sizeof(p->stat));
     p->t = malloc(n_threads*sizeof(p->t[0]));
 
     pthread_mutexattr_t attr;
@@ -579,6 +608,8 @@ struct thread_pool *thread_pool_init(int n_threads)
         p->t_stack[i] = 0;
         w->p = p;
         w->idx = i;
+        w->wait_start = 0;
+        w->wait_blocked = 0;
         pthread_cond_init(&w->pending_c, NULL);
         if ( 0 != pthread_create(&w->tid, NULL, thread_pool_worker, w)) {
             pthread_mutex_unlock(&p->pool_mutex);
@@ -631,9 +662,11 @@ int thread_pool_dispatch2(struct thread_pool *p, struct thread_pool_process *q,
     j->q = q;
     j->serial = q->curr_serial++;
 
-    if ( nonblock == 0 ) {
+    if ( nonblock == 0 && q->n_input >= q->qsize ) {
+        uint64_t start = thread_pool_now();
         while ( q->n_input >= q->qsize && !q->shutdown && !q->wake_dispatch )
             pthread_cond_wait(&q->input_not_full_c, &q->p->pool_mutex);
+        q->dispatch_blocked += thread_pool_now() - start;
 
         if ( q->shutdown ) {
             free(j);
@@ -646,6 +679,105 @@ int thread_pool_dispatch2(struct thread_pool *p, struct thread_pool_process *q,
         }
     }
 
+    thread_pool_enqueue_locked(p, q, j);
+
+    pthread_mutex_unlock(&p->pool_mutex);
+
+    return 0;
+}
+
+// Dispatch a job with backpressure. Instead of spinning on thread_pool_dispatch2(..., 1)
+// and thread_pool_next_result(), the caller sleeps until either the next ordered result is
+// ready or the input queue has room. Ready results are always returned first, so the output
+// is consumed while the input queue is full.
+//
+// Typical usage:
+//     while ( (ret = thread_pool_dispatch3(p, q, func, arg, &r)) == 1 ) {
+//         consume(r->data);
+//         thread_pool_delete_result(r, 0);
+//     }
+//
+// Returns 0 if the job is dispatched;
+//         1 if a result is returned in *r, the job is not dispatched yet;
+//        -1 on failure or during shutdown.
+int thread_pool_dispatch3(struct thread_pool *p, struct thread_pool_process *q,
+                          void *(*func)(void *arg, int idx), void *arg,
+                          struct thread_pool_result **r) {
+    struct thread_pool_job *j;
+    uint64_t start = 0;
+    *r = NULL;
+
+    pthread_mutex_lock(&p->pool_mutex);
+    for ( ;; ) {
+        if ( q->shutdown ) {
+            pthread_mutex_unlock(&p->pool_mutex);
+            return -1;
+        }
+        if ( !q->in_only && (*r = thread_pool_next_result_locked(q)) )
+            break;
+        if ( q->n_input < q->qsize )
+            break;
+        if ( start == 0 )
+            start = thread_pool_now();
+
+        q->n_dispatch_wait++;
+        pthread_cond_wait(&q->input_not_full_c, &p->pool_mutex);
+        q->n_dispatch_wait--;
+    }
+    if ( start )
+        q->dispatch_blocked += thread_pool_now() - start;
+
+    if ( *r ) {
+        pthread_mutex_unlock(&p->pool_mutex);
+        return 1;
+    }
+
+    if ( !(j = malloc(sizeof(*j))) ) {
+        pthread_mutex_unlock(&p->pool_mutex);
+        return -1;
+    }
+    j->func = func;
+    j->arg = arg;
+    j->next = NULL;
+    j->p = p;
+    j->q = q;
+    j->serial = q->curr_serial++;
+
+    thread_pool_enqueue_locked(p, q, j);
+
+    pthread_mutex_unlock(&p->pool_mutex);
+
+    return 0;
+}
+
+// Accumulated times of the workers of a pool. Time of current waits is included.
+void thread_pool_stat(struct thread_pool *p, struct thread_pool_stat *s) {
+    int i;
+    pthread_mutex_lock(&p->pool_mutex);
+    *s = p->stat;
+    uint64_t now = thread_pool_now();
+    for ( i = 0; i < p->tsize; i++ ) {
+        struct thread_pool_worker *w = &p->t[i];
+        if ( !p->t_stack[i] )
+            continue;
+        if ( w->wait_blocked ) s->blocked += now - w->wait_start;
+        else s->idle += now - w->wait_start;
+    }
+    pthread_mutex_unlock(&p->pool_mutex);
+}
+
+// Time dispatchers of the process blocked on a full input queue.
+uint64_t thread_pool_process_blocked(struct thread_pool_process *q) {
+    uint64_t t;
+    pthread_mutex_lock(&q->p->pool_mutex);
+    t = q->dispatch_blocked;
+    pthread_mutex_unlock(&q->p->pool_mutex);
+    return t;
+}
+
+// Append a job to the input queue and wake a worker. Pool mutex should be locked.
+static void thread_pool_enqueue_locked(struct thread_pool *p, struct thread_pool_process *q,
+                                       struct thread_pool_job *j) {
     // total across all queues
     p->n_jobs ++;
     // queue specific
@@ -668,10 +800,6 @@ int thread_pool_dispatch2(struct thread_pool *p, struct thread_pool_process *q,
     // scaling.
     if ( !q->shutdown )
         wake_next_worker(q, 1);
-
-    pthread_mutex_unlock(&p->pool_mutex);
-
-    return 0;
 }
 
 // Wakes up a single thread stuck in dispatch and make it return with error EAGAIN
@@ -879,18 +1007,10 @@ int test_func(int n) {
     for ( i = 0; i < 1000; i++ ) {
         int *ip = malloc(sizeof(*ip));
         *ip = i;
-        int blk;
-        do {
-            blk = thread_pool_dispatch2(p, q, doit, ip, 1);
-            if ((r = thread_pool_next_result(q))) {
-                printf("%d\n", *(int*)r->data);
-                thread_pool_delete_result(r, 1);
-            }
-            if ( blk == -1 ) {
-                putchar('.'); fflush(stdout);
-                usleep(10000);
-            }
-        } while (blk == -1);
+        while ( thread_pool_dispatch3(p, q, doit, ip, &r) == 1 ) {
+            printf("%d\n", *(int*)r->data);
+            thread_pool_delete_result(r, 1);
+        }
     }
 
     thread_pool_process_flush(q);
@@ -62,6 +62,19 @@ struct thread_pool_worker {
     pthread_t tid;
     // when waiting for a job
     pthread_cond_t pending_c;
+    // start time of current wait, and if jobs were waiting for room of output at that time
+    uint64_t wait_start;
+    int wait_blocked;
+};
+
+// Time spent by the threads of a pool, or by the dispatcher of a process, in microseconds.
+struct thread_pool_stat {
+    // executing jobs
+    uint64_t busy;
+    // waiting for new jobs
+    uint64_t idle;
+    // jobs are waiting but there is no room for the results, or the input queue is full
+    uint64_t blocked;
 };
 
 // An IO queue consists of a queue of jobs of execute (the "input" side) and a queue
@@ -98,6 +111,10 @@ struct thread_pool_process {
     int in_only;
     // unblocks waiting dispatchers
     int wake_dispatch;
+    // no. dispatchers waiting for either input room or output by thread_pool_dispatch3()
+    int n_dispatch_wait;
+    // time dispatchers blocked on a full input queue
+    uint64_t dispatch_blocked;
 
     // used to track safe destruction
     int ref_count;
@@ -148,6 +165,8 @@ struct thread_pool {
     // This can be used to dampen any hysteresis caused by bursty input availability.
     int n_count, n_running;
 
+    // accumulated time of all workers
+    struct thread_pool_stat stat;
 };
 
 struct thread_pool_result *thread_pool_next_result(struct thread_pool_process *q);
@@ -168,6 +187,9 @@ struct thread_pool *thread_pool_init(int n_threads);
 int thread_pool_size(struct thread_pool *p);
 int thread_pool_dispatch(struct thread_pool *p, struct thread_pool_process *q,void *(*func)(void *arg, int idx),void *arg);
 int thread_pool_dispatch2(struct thread_pool *p, struct thread_pool_process *q,void *(*func)(void *arg, int idx), void *arg, int nonblock);
+int thread_pool_dispatch3(struct thread_pool *p, struct thread_pool_process *q,void *(*func)(void *arg, int idx), void *arg, struct thread_pool_result **r);
+void thread_pool_stat(struct thread_pool *p, struct thread_pool_stat *s);
+uint64_t thread_pool_process_blocked(struct thread_pool_process *q);
 void thread_pool_wake_dispatch(struct thread_pool_process *q);
 int thread_pool_process_flush(struct thread_pool_process *q);
 int thread_pool_process_reset(struct thread_pool_process *q, int free_results);
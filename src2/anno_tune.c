@@ -0,0 +1,185 @@
+// anno_tune.c - Adapt records per pool and chunk gap to the observed annotation cost
+#include "anno_tune.h"
+#include "anno_pool.h"
+#include "utils.h"
+#include <pthread.h>
+#include <string.h>
+
+// Chunks needed before the first fit.
+#define TUNE_MIN_CHUNKS 8
+// Weight of old samples at each update, so the model follows the density of input.
+#define TUNE_DECAY 0.8
+
+static struct {
+    int enabled;
+    // target seconds per pool
+    double target;
+    int min_record;
+    int max_record;
+    int min_gap;
+    int max_gap;
+    // current sizes
+    int n_record;
+    int gap;
+    pthread_mutex_t lock;
+    struct tune_sample model;
+    int n_chunk;
+    // query, per_record, per_kb in seconds, valid if fitted
+    double coef[3];
+    int fitted;
+} tune = {
+    .enabled = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .n_chunk = 0,
+    .fitted = 0,
+};
+
+void anno_tune_init(double target_ms, int n_record, int min_record, int max_record, int min_gap, int max_gap)
+{
+    tune.enabled = 1;
+    tune.target = target_ms/1000;
+    tune.min_record = min_record;
+    tune.max_record = max_record;
+    tune.min_gap = min_gap;
+    tune.max_gap = max_gap;
+    tune.n_record = n_record < min_record ? min_record : n_record > max_record ? max_record : n_record;
+    tune.gap = CHUNK_MAX_GAP < min_gap ? min_gap : CHUNK_MAX_GAP > max_gap ? max_gap : CHUNK_MAX_GAP;
+    memset(&tune.model, 0, sizeof(tune.model));
+}
+
+int anno_tune_enabled(void)
+{
+    return tune.enabled;
+}
+
+void anno_tune_add(struct tune_sample *s, int n, int span, double seconds)
+{
+    double x[3] = { 1, n, span/1000.0 };
+    int i, j;
+    for ( i = 0; i < 3; ++i ) {
+        for ( j = 0; j < 3; ++j ) s->xx[i][j] += x[i]*x[j];
+        s->xy[i] += x[i]*seconds;
+    }
+    s->n_chunk++;
+}
+
+void anno_tune_flush(struct tune_sample *s)
+{
+    if ( s->n_chunk == 0 ) return;
+    int i, j;
+    pthread_mutex_lock(&tune.lock);
+    for ( i = 0; i < 3; ++i ) {
+        for ( j = 0; j < 3; ++j ) tune.model.xx[i][j] += s->xx[i][j];
+        tune.model.xy[i] += s->xy[i];
+    }
+    tune.n_chunk += s->n_chunk;
+    pthread_mutex_unlock(&tune.lock);
+    memset(s, 0, sizeof(*s));
+}
+
+#define tune_abs(x) ((x) < 0 ? -(x) : (x))
+
+// Solve the normal equations on the terms set in use[], unused terms are 0. Return -1 if
+// singular. A small ridge keeps the system solvable when records and span are collinear.
+static int tune_solve(struct tune_sample *m, int use[3], double x[3])
+{
+    double a[3][3], b[3];
+    int idx[3], n = 0, i, j, k;
+    for ( i = 0; i < 3; ++i ) {
+        x[i] = 0;
+        if ( use[i] ) idx[n++] = i;
+    }
+    for ( i = 0; i < n; ++i ) {
+        for ( j = 0; j < n; ++j ) a[i][j] = m->xx[idx[i]][idx[j]];
+        a[i][i] += a[i][i]*1e-6 + 1e-12;
+        b[i] = m->xy[idx[i]];
+    }
+    // Gaussian elimination with partial pivoting
+    for ( i = 0; i < n; ++i ) {
+        int p = i;
+        for ( k = i+1; k < n; ++k )
+            if ( tune_abs(a[k][i]) > tune_abs(a[p][i]) ) p = k;
+        if ( tune_abs(a[p][i]) < 1e-300 ) return -1;
+        if ( p != i ) {
+            for ( j = 0; j < n; ++j ) {
+                double t = a[i][j]; a[i][j] = a[p][j]; a[p][j] = t;
+            }
+            double t = b[i]; b[i] = b[p]; b[p] = t;
+        }
+        for ( k = i+1; k < n; ++k ) {
+            double f = a[k][i]/a[i][i];
+            for ( j = i; j < n; ++j ) a[k][j] -= f*a[i][j];
+            b[k] -= f*b[i];
+        }
+    }
+    double y[3];
+    for ( i = n-1; i >= 0; --i ) {
+        double s = b[i];
+        for ( j = i+1; j < n; ++j ) s -= a[i][j]*y[j];
+        y[i] = s/a[i][i];
+    }
+    for ( i = 0; i < n; ++i ) x[idx[i]] = y[i];
+    return 0;
+}
+
+// Least squares with non-negative costs, the most negative term is dropped until all are
+// positive, as timing noise easily gives a negative cost to one of the collinear terms.
+static int tune_fit(struct tune_sample *m, double x[3])
+{
+    int use[3] = { 1, 1, 1 };
+    for ( ;; ) {
+        if ( tune_solve(m, use, x) ) return -1;
+        int i, worst = -1;
+        for ( i = 0; i < 3; ++i )
+            if ( use[i] && x[i] < 0 && (worst == -1 || x[i] < x[worst]) ) worst = i;
+        if ( worst == -1 ) return 0;
+        use[worst] = 0;
+        if ( !use[0] && !use[1] && !use[2] ) return -1;
+    }
+}
+
+void anno_tune_update(int *n_record, int *max_gap)
+{
+    pthread_mutex_lock(&tune.lock);
+    struct tune_sample *m = &tune.model;
+    if ( tune.n_chunk >= TUNE_MIN_CHUNKS && m->xx[0][1] > 0 && m->xy[0] > 0 ) {
+        // records per pool, from the mean cost per record
+        double ideal = tune.target / (m->xy[0]/m->xx[0][1]);
+        double n = (tune.n_record + ideal)/2;
+        tune.n_record = n < tune.min_record ? tune.min_record : n > tune.max_record ? tune.max_record : (int)n;
+
+        // chunk gap, from the query cost and the scan cost per kb
+        double c[3];
+        if ( tune_fit(m, c) == 0 ) {
+            memcpy(tune.coef, c, sizeof(c));
+            tune.fitted = 1;
+            double gap;
+            if ( c[2] <= 0 ) gap = tune.max_gap;
+            else if ( c[0] <= 0 ) gap = tune.min_gap;
+            else gap = c[0]/c[2]*1000;
+            // move half way, so one noisy fit does not swing the gap
+            gap = (gap + tune.gap)/2;
+            tune.gap = gap < tune.min_gap ? tune.min_gap : gap > tune.max_gap ? tune.max_gap : (int)gap;
+        }
+
+        int i, j;
+        for ( i = 0; i < 3; ++i ) {
+            for ( j = 0; j < 3; ++j ) m->xx[i][j] *= TUNE_DECAY;
+            m->xy[i] *= TUNE_DECAY;
+        }
+    }
+    *n_record = tune.n_record;
+    *max_gap = tune.gap;
+    pthread_mutex_unlock(&tune.lock);
+}
+
+void anno_tune_report(void)
+{
+    pthread_mutex_lock(&tune.lock);
+    if ( tune.fitted )
+        LOG_print("Adaptive chunk : %d records per pool, max gap %d bp. Query %.3f ms, %.3f us per record, %.3f us per kb, fitted from %d chunks.",
+                  tune.n_record, tune.gap, tune.coef[0]*1e3, tune.coef[1]*1e6, tune.coef[2]*1e6, tune.n_chunk);
+    else
+        LOG_print("Adaptive chunk : %d records per pool, max gap %d bp. Too few chunks to fit the cost.", tune.n_record, tune.gap);
+    pthread_mutex_unlock(&tune.lock);
+}
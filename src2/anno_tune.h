@@ -0,0 +1,43 @@
+#ifndef ANNO_TUNE_H
+#define ANNO_TUNE_H
+
+// Adaptive sizing of record pools and annotation chunks. Workers time each chunk and the
+// main thread fits the cost model
+//
+//     time = query + per_record * records + per_kb * span_kb
+//
+// from the recent chunks. Records per pool are set so that a pool takes the target time, and
+// the maximum gap inside a chunk is set to query / per_kb, beyond which a new database query
+// is cheaper than scanning the gap. Both are kept in the user bounds.
+
+// Default bounds of records per pool and max gap in bp.
+#define TUNE_MIN_RECORDS 100
+#define TUNE_MAX_RECORDS 20000
+#define TUNE_MIN_GAP 1000
+#define TUNE_MAX_GAP 1000000
+
+// Per worker accumulator, merged into the model by anno_tune_flush().
+struct tune_sample {
+    int n_chunk;
+    // normal equations of the least squares, x = (1, records, span_kb)
+    double xx[3][3];
+    double xy[3];
+};
+
+extern void anno_tune_init(double target_ms, int n_record, int min_record, int max_record, int min_gap, int max_gap);
+
+extern int anno_tune_enabled(void);
+
+// Add a chunk of n records spanning span bp annotated in seconds.
+extern void anno_tune_add(struct tune_sample *s, int n, int span, double seconds);
+
+// Merge the samples of a worker into the model, and reset them.
+extern void anno_tune_flush(struct tune_sample *s);
+
+// Refit the model, return records of next pool and max gap of its chunks.
+extern void anno_tune_update(int *n_record, int *max_gap);
+
+// Log the fitted model and the current sizes.
+extern void anno_tune_report(void);
+
+#endif
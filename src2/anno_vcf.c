@@ -6,6 +6,7 @@
 #include "htslib/hts.h"
 #include "htslib/kstring.h"
 #include "htslib/bgzf.h"
+#include "htslib/kseq.h"
 
 static int match_allele(bcf1_t *line, bcf1_t *dat)
 {
@@ -24,6 +25,40 @@ static int match_allele(bcf1_t *line, bcf1_t *dat)
     // if no matchs
     return 1;
 }
+// Database id of the contig of line, -1 if not found. Contigs added to the header after init
+// are looked up by name.
+static int anno_vcf_rid2tid(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line)
+{
+    if ( line->rid < f->n_tid ) return f->tid_map[line->rid];
+    if ( f->tbx_idx ) return tbx_name2id(f->tbx_idx, bcf_seqname(hdr, line));
+    return bcf_hdr_name2id(f->hdr, bcf_seqname(hdr, line));
+}
+
+int anno_vcf_filter_id(struct anno_vcf_file *f, bcf_hdr_t *hdr, int id)
+{
+    if ( id < f->n_flt ) return f->flt_map[id];
+    // FILTER appended to the header when parsing VCF records
+    return bcf_hdr_id2int(hdr, BCF_DT_ID, bcf_hdr_int2id(f->hdr, BCF_DT_ID, id));
+}
+
+static void anno_vcf_build_maps(struct anno_vcf_file *f, bcf_hdr_t *hdr)
+{
+    int i;
+    f->n_tid = hdr->n[BCF_DT_CTG];
+    f->tid_map = malloc((f->n_tid > 0 ? f->n_tid : 1)*sizeof(int));
+    for ( i = 0; i < f->n_tid; ++i ) {
+        const char *name = bcf_hdr_id2name(hdr, i);
+        f->tid_map[i] = f->tbx_idx ? tbx_name2id(f->tbx_idx, name) : bcf_hdr_name2id(f->hdr, name);
+    }
+    f->n_flt = f->hdr->n[BCF_DT_ID];
+    f->flt_map = malloc((f->n_flt > 0 ? f->n_flt : 1)*sizeof(int));
+    for ( i = 0; i < f->n_flt; ++i ) {
+        f->flt_map[i] = -1;
+        if ( bcf_hdr_idinfo_exists(f->hdr, BCF_HL_FLT, i) )
+            f->flt_map[i] = bcf_hdr_id2int(hdr, BCF_DT_ID, bcf_hdr_int2id(f->hdr, BCF_DT_ID, i));
+    }
+}
+
 // fill_buffer update returns
 // return -1 on no change
 //         0 on empty
@@ -52,7 +87,7 @@ static int anno_vcf_update_buffer(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_
     int end_pos = l < 0 ? line->pos - l : line->pos;
 
     if ( f->tbx_idx ) {
-        int tid = tbx_name2id(f->tbx_idx, bcf_seqname(hdr, line));
+        int tid = anno_vcf_rid2tid(f, hdr, line);
         if ( tid == -1 ) {
             if ( b->no_such_chrom == 0 ) {
                 warnings("No chromosome %s found in %s.", bcf_seqname(hdr, line), f->fname);
@@ -61,10 +96,11 @@ static int anno_vcf_update_buffer(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_
             return 0;
         }
         f->itr = tbx_itr_queryi(f->tbx_idx, tid, line->pos, end_pos+1);
+        f->stat.n_query++;
     }
     else if ( f->bcf_idx ) {
         // check id in header of database
-        int tid = bcf_hdr_name2id(f->hdr, bcf_seqname(hdr, line));
+        int tid = anno_vcf_rid2tid(f, hdr, line);
         if ( tid == -1 ) {
             if ( b->no_such_chrom == 0 )  {
                 warnings("No chromsome %s found in %s.", bcf_seqname(hdr, line), f->fname);
@@ -73,6 +109,7 @@ static int anno_vcf_update_buffer(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_
             return 0;
         }
         f->itr = bcf_itr_queryi(f->bcf_idx, tid, line->pos, end_pos+1);
+        f->stat.n_query++;
     }
     else goto load_index_failed;
 
@@ -91,13 +128,9 @@ static int anno_vcf_update_buffer(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_
             }
         }
         if ( f->tbx_idx ) {
-            kstring_t str = {0,0,0};
-            if ( tbx_itr_next(f->fp, f->tbx_idx, f->itr, &str) < 0 ) {
-                if ( str.m ) free(str.s);
+            if ( tbx_itr_next(f->fp, f->tbx_idx, f->itr, &b->str) < 0 )
                 break;
-            }
-            vcf_parse1(&str, f->hdr, b->buffer[b->cached]);
-            free(str.s);
+            vcf_parse1(&b->str, f->hdr, b->buffer[b->cached]);
         }
         else if ( f->bcf_idx ) {
             if ( bcf_itr_next(f->fp, f->itr, b->buffer[b->cached]) < 0 )
@@ -119,6 +152,78 @@ static int anno_vcf_update_buffer(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_
     error("Failed to reload index of %s. This error perhaps caused by BUGs. Please report this to shiquan@genomics.cn.", f->fname);
     
 }
+// In chunk mode input records are sorted, so a forward-only cursor is kept over the
+// database and advanced in step with the chunks, each BGZF block is only inflated once.
+// Indexed seek is only performed if cursor is on another chromosome, or the next record
+// of cursor is more than VCF_STREAM_MAX_GAP behind the chunk.
+#define VCF_STREAM_MAX_GAP 100000
+
+static void anno_vcf_buffer_extend(struct anno_vcf_buffer *b)
+{
+    if ( b->cached == b->max ) {
+        b->max += 8;
+        b->buffer = realloc(b->buffer, sizeof(void*)*b->max);
+        int i;
+        for ( i = 8; i > 0; --i) {
+            b->buffer[b->max-i] = bcf_init();
+            b->buffer[b->max-i]->pos = -1;
+        }
+    }
+}
+// seek cursor to the first record overlapping the chunk
+// return 0 on success, -1 on no record in this region
+static int anno_vcf_stream_seek(struct anno_vcf_file *f, int tid, struct anno_pool *pool)
+{
+    struct anno_vcf_buffer *b = f->buffer;
+    b->stream_tid = -1;
+    b->has_next = 0;
+
+    hts_itr_t *itr;
+    if ( f->tbx_idx )
+        itr = tbx_itr_queryi(f->tbx_idx, tid, pool->curr_start, pool->curr_end+1);
+    else
+        itr = bcf_itr_queryi(f->bcf_idx, tid, pool->curr_start, pool->curr_end+1);
+    f->stat.n_query++;
+    
+    if ( itr == NULL )
+        return -1;
+    // offsets are sorted, records overlapping this chunk are all after the first one
+    if ( itr->n_off == 0 ) {
+        hts_itr_destroy(itr);
+        return -1;
+    }
+    uint64_t offset = itr->off[0].u;
+    hts_itr_destroy(itr);
+    
+    if ( bgzf_seek(hts_get_bgzfp(f->fp), offset, SEEK_SET) < 0 )
+        error("Failed to seek %s.", f->fname);
+    
+    b->stream_tid = tid;
+    b->stream_rid = -1;
+    b->stream_end = 0;
+    return 0;
+}
+// read next record of cursor
+// return 0 on success, -1 on end of chromosome
+static int anno_vcf_stream_read(struct anno_vcf_file *f, bcf1_t *rec)
+{
+    struct anno_vcf_buffer *b = f->buffer;
+    if ( f->tbx_idx ) {
+        if ( hts_getline(f->fp, KS_SEP_LINE, &b->str) < 0 )
+            return -1;
+        if ( vcf_parse1(&b->str, f->hdr, rec) ) {
+            warnings("Failed to parse record of %s.", f->fname);
+            return -1;
+        }
+    }
+    else if ( bcf_read(f->fp, f->hdr, rec) ) {
+        return -1;
+    }
+    if ( b->stream_rid == -1 )
+        b->stream_rid = rec->rid;
+
+    return rec->rid == b->stream_rid ? 0 : -1;
+}
 int anno_vcf_update_buffer_chunk(struct anno_vcf_file *f, bcf_hdr_t *hdr, struct anno_pool *pool)
 {
     assert(pool->n_reader > 0);
@@ -126,6 +231,7 @@ int anno_vcf_update_buffer_chunk(struct anno_vcf_file *f, bcf_hdr_t *hdr, struct
     bcf1_t *line = pool->curr_line;
 
     struct anno_vcf_buffer *b = f->buffer;
+    int n_last = b->cached;
     b->cached = 0;
     b->i_chunk = 0;
     if ( b->last_rid != line->rid ) {
@@ -137,76 +243,84 @@ int anno_vcf_update_buffer_chunk(struct anno_vcf_file *f, bcf_hdr_t *hdr, struct
     
     assert( f->itr == NULL );
 
-    if ( f->tbx_idx ) {
-        int tid = tbx_name2id(f->tbx_idx, bcf_seqname(hdr, line));
-        if ( tid == -1 ) {
-            if ( b->no_such_chrom == 0 ) {
-                warnings("No chromosome %s found in %s.", bcf_seqname(hdr, line), f->fname);
-                b->no_such_chrom = 1;
-            }
-            return 0;
+    if ( f->tbx_idx == NULL && f->bcf_idx == NULL )
+        error("Failed to reload index of %s.", f->fname);
+    int tid = anno_vcf_rid2tid(f, hdr, line);
+
+    if ( tid == -1 ) {
+        if ( b->no_such_chrom == 0 ) {
+            warnings("No chromosome %s found in %s.", bcf_seqname(hdr, line), f->fname);
+            b->no_such_chrom = 1;
         }
-        f->itr = tbx_itr_queryi(f->tbx_idx, tid, pool->curr_start, pool->curr_end+1);
+        return 0;
     }
-    else if ( f->bcf_idx ) {
-        // check id in header of database
-        int tid = bcf_hdr_name2id(f->hdr, bcf_seqname(hdr, line));
-        if ( tid == -1 ) {
-            if ( b->no_such_chrom == 0 )  {
-                warnings("No chromsome %s found in %s.", bcf_seqname(hdr, line), f->fname);
-                b->no_such_chrom = 1;
-            }
+
+    // chunks continued by the cursor are counted as cache hits, seeks as misses
+    if ( b->stream_tid != tid || pool->curr_start < b->stream_last
+         || (b->has_next && b->stream_next->pos + VCF_STREAM_MAX_GAP < pool->curr_start) ) {
+        f->stat.n_miss++;
+        if ( anno_vcf_stream_seek(f, tid, pool) )
             return 0;
+    }
+    else {
+        f->stat.n_hit++;
+        // input records at one position may be split into two chunks at the boundary of pools,
+        // database records of this position were consumed by last chunk, so move them to front
+        if ( pool->curr_start == b->stream_last ) {
+            int j;
+            for ( j = n_last; j > 0 && b->buffer[j-1]->pos == pool->curr_start; --j );
+            for ( ; j < n_last; ++j, ++b->cached ) {
+                bcf1_t *rec = b->buffer[b->cached];
+                b->buffer[b->cached] = b->buffer[j];
+                b->buffer[j] = rec;
+            }
         }
-        f->itr = bcf_itr_queryi(f->bcf_idx, tid, pool->curr_start, pool->curr_end+1);    
     }
-    else error("Failed to reload index of %s.", f->fname);
-
-    // no record
-    if ( f->itr == NULL )
-        return 0;
+    b->stream_last = pool->curr_end;
 
     for ( ;; ) {
-        if ( b->cached == b->max ) {
-            b->max += 8;
-            b->buffer = realloc(b->buffer, sizeof(void*)*b->max);
-            int i;
-            for ( i = 8; i > 0; --i) {
-                b->buffer[b->max-i] = bcf_init();
-                b->buffer[b->max-i]->pos = -1;
-            }
+        anno_vcf_buffer_extend(b);
+        bcf1_t *rec = b->buffer[b->cached];
+        if ( b->has_next ) {
+            b->buffer[b->cached] = b->stream_next;
+            b->stream_next = rec;
+            rec = b->buffer[b->cached];
+            b->has_next = 0;
         }
-        if ( f->tbx_idx ) {
-            kstring_t str = {0,0,0};
-            if ( tbx_itr_next(f->fp, f->tbx_idx, f->itr, &str) < 0 ) {
-                if ( str.m ) free(str.s);
-                break;
-            }
-            vcf_parse1(&str, f->hdr, b->buffer[b->cached]);
-            free(str.s);
+        else if ( b->stream_end == 1 ) {
+            break;
         }
-        else if ( f->bcf_idx ) {
-            if ( bcf_itr_next(f->fp, f->itr, b->buffer[b->cached]) < 0 )
-                break;
+        else if ( anno_vcf_stream_read(f, rec) ) {
+            b->stream_end = 1;
+            break;
         }
-        else error("Failed to reload index of %s.", f->fname);
-        
-        b->cached++;
-    }
 
-    if ( f->itr ) {
-        hts_itr_destroy(f->itr);
-        f->itr = NULL;
+        if ( rec->pos < pool->curr_start )
+            continue;
+
+        // keep it for next chunk
+        if ( rec->pos > pool->curr_end ) {
+            b->buffer[b->cached] = b->stream_next;
+            b->stream_next = rec;
+            b->has_next = 1;
+            break;
+        }
+        b->cached++;
     }
 
     return b->cached;
 }
-static struct anno_vcf_buffer *anno_vcf_buffer_init()
+static struct anno_vcf_buffer *anno_vcf_buffer_init(int n_col)
 {
     struct anno_vcf_buffer *b = malloc(sizeof(*b));
     memset(b, 0, sizeof(*b));
+    b->infos = calloc(n_col > 0 ? n_col : 1, sizeof(bcf_info_t));
     b->last_rid = -1;
     b->vcmp = vcmp_init();
+    b->stream_tid = -1;
+    b->stream_rid = -1;
+    b->stream_last = -1;
+    b->stream_next = bcf_init();
     return b;
 }
 static void anno_vcf_buffer_destroy(struct anno_vcf_buffer *b)
@@ -224,6 +338,11 @@ static void anno_vcf_buffer_destroy(struct anno_vcf_buffer *b)
     if ( b->tmps )    free(b->tmps);
     if ( b->tmps2 )   free(b->tmps2);
     if ( b->tmpks.m ) free(b->tmpks.s);
+    if ( b->str.m ) free(b->str.s);
+    free(b->infos);
+    free(b->map[0]);
+    free(b->map[1]);
+    bcf_destroy(b->stream_next);
     free(b);
 }
 struct anno_vcf_file *anno_vcf_file_init(bcf_hdr_t *hdr, const char *fname, char *column)
@@ -271,6 +390,7 @@ struct anno_vcf_file *anno_vcf_file_init(bcf_hdr_t *hdr, const char *fname, char
     f->hdr = bcf_hdr_read(f->fp);
     
     f->cols = malloc(n*sizeof(struct anno_col));
+    f->info_keys = malloc(n*sizeof(int));
     int i;
     kstring_t temp = {0,0,0};
     for ( i = 0; i < n; ++i ) {
@@ -300,6 +420,8 @@ struct anno_vcf_file *anno_vcf_file_init(bcf_hdr_t *hdr, const char *fname, char
             continue;
         }
 
+        f->info_keys[f->n_col] = -1;
+        col->hdr_id = -1;
         if ( strcasecmp("FILTER", ss) == 0 ) {
             col->func.vcf = vcf_setter_filter;
         }
@@ -331,6 +453,13 @@ struct anno_vcf_file *anno_vcf_file_init(bcf_hdr_t *hdr, const char *fname, char
                 default: error("Tag \"%s\" of type not recongized (%d). ", ss, bcf_hdr_id2type(hdr, BCF_HL_INFO, id)); 
             }
             col->number = bcf_hdr_id2length(hdr, BCF_HL_INFO, id);
+            col->hdr_id = id;
+
+            // resolve the tag in database header once, values of other tags are never decoded
+            int key = bcf_hdr_id2int(f->hdr, BCF_DT_ID, ss);
+            if ( bcf_hdr_idinfo_exists(f->hdr, BCF_HL_INFO, key)
+                 && bcf_hdr_id2type(f->hdr, BCF_HL_INFO, key) == bcf_hdr_id2type(hdr, BCF_HL_INFO, id) )
+                f->info_keys[f->n_col] = key;
         } // end else
         col->hdr_key = strdup(ss);
         f->n_col++;
@@ -338,9 +467,10 @@ struct anno_vcf_file *anno_vcf_file_init(bcf_hdr_t *hdr, const char *fname, char
     free(s);
     if ( temp.m ) free(temp.s);
     free(str.s);
-    f->buffer = anno_vcf_buffer_init();
+    f->buffer = anno_vcf_buffer_init(f->n_col);
+    anno_vcf_build_maps(f, hdr);
     if ( f->n_col == 0 ) {
-        anno_vcf_file_destroy(f);
+        anno_vcf_file_destroy(f, 0);
         return NULL;
     }    
     return f;
@@ -352,11 +482,20 @@ struct anno_vcf_file *anno_vcf_file_duplicate(struct anno_vcf_file *f)
     memset(d, 0, sizeof(*d));
     d->fname = f->fname;
     d->fp = hts_open(f->fname, "r");
-    d->hdr = bcf_hdr_read(d->fp);
-    if ( f->bcf_idx )
-        d->bcf_idx = bcf_index_load(f->fname);
-    else if ( f->tbx_idx )
-        d->tbx_idx = tbx_index_load(f->fname);
+    if ( d->fp == NULL )
+        error("%s : %s.", f->fname, strerror(errno));
+    // Index and header are read-only after init, so share them with the original handler
+    // and only keep the file handler and iterator per thread. VCF lines are parsed by
+    // vcf_parse1(), which may append undefined tags to header, so keep a copy of the
+    // header for tabix indexed file.
+    if ( f->bcf_idx ) {
+        d->hdr = f->hdr;
+        d->bcf_idx = f->bcf_idx;
+    }
+    else if ( f->tbx_idx ) {
+        d->hdr = bcf_hdr_dup(f->hdr);
+        d->tbx_idx = f->tbx_idx;
+    }
     else
         error("Try to copy from a empty anno_vcf_file.");
     d->n_col = f->n_col;
@@ -364,18 +503,30 @@ struct anno_vcf_file *anno_vcf_file_duplicate(struct anno_vcf_file *f)
     int i;
     for ( i = 0; i < d->n_col; ++i )
         anno_col_copy(&f->cols[i], &d->cols[i]);
-    d->buffer = anno_vcf_buffer_init();
+    d->info_keys = malloc((d->n_col > 0 ? d->n_col : 1)*sizeof(int));
+    memcpy(d->info_keys, f->info_keys, d->n_col*sizeof(int));
+    d->n_tid = f->n_tid;
+    d->tid_map = malloc((d->n_tid > 0 ? d->n_tid : 1)*sizeof(int));
+    memcpy(d->tid_map, f->tid_map, d->n_tid*sizeof(int));
+    d->n_flt = f->n_flt;
+    d->flt_map = malloc((d->n_flt > 0 ? d->n_flt : 1)*sizeof(int));
+    memcpy(d->flt_map, f->flt_map, d->n_flt*sizeof(int));
+    d->buffer = anno_vcf_buffer_init(d->n_col);
     return d;
 }
 
-void anno_vcf_file_destroy(struct anno_vcf_file *f)
+// l is the thread index, shared index and header are only freed by thread 0
+void anno_vcf_file_destroy(struct anno_vcf_file *f, int l)
 {
     hts_close(f->fp);
-    bcf_hdr_destroy(f->hdr);
-    if ( f->bcf_idx)
-        hts_idx_destroy(f->bcf_idx);
-    else if ( f->tbx_idx )
-        tbx_destroy(f->tbx_idx);
+    if ( l == 0 || f->tbx_idx )
+        bcf_hdr_destroy(f->hdr);
+    if ( l == 0 ) {
+        if ( f->bcf_idx)
+            hts_idx_destroy(f->bcf_idx);
+        else if ( f->tbx_idx )
+            tbx_destroy(f->tbx_idx);
+    }
 
     if ( f->itr )
         hts_itr_destroy(f->itr);
@@ -383,10 +534,45 @@ void anno_vcf_file_destroy(struct anno_vcf_file *f)
     int i;
     for ( i = 0; i < f->n_col; ++i ) free(f->cols[i].hdr_key);
     free(f->cols);
+    free(f->info_keys);
+    free(f->tid_map);
+    free(f->flt_map);
     anno_vcf_buffer_destroy(f->buffer);
     free(f);
 }
 
+// Prepare the matched database record for setters. Walk the shared block once and keep the
+// requested INFO tags in b->infos, values are converted later by the setters. Unlike bcf_unpack(),
+// other tags are only skipped. Allele maps of last pair are dropped.
+static void anno_vcf_match_init(struct anno_vcf_file *f, bcf1_t *rec)
+{
+    struct anno_vcf_buffer *b = f->buffer;
+    int i, j, type, n;
+    b->map_status[0] = b->map_status[1] = 0;
+    for ( j = 0; j < f->n_col; ++j ) b->infos[j].vptr = NULL;
+    if ( rec->shared.l == 0 ) return;
+
+    uint8_t *ptr = (uint8_t*)rec->shared.s;
+    // skip ID, alleles and FILTER
+    for ( i = 0; i < rec->n_allele + 2; ++i ) {
+        n = bcf_dec_size(ptr, &ptr, &type);
+        ptr += n << bcf_type_shift[type];
+    }
+    for ( i = 0; i < rec->n_info; ++i ) {
+        int key = bcf_dec_typed_int1(ptr, &ptr);
+        n = bcf_dec_size(ptr, &ptr, &type);
+        for ( j = 0; j < f->n_col; ++j ) {
+            if ( f->info_keys[j] != key ) continue;
+            bcf_info_t *info = &b->infos[j];
+            info->key = key;
+            info->type = type;
+            info->len = n;
+            info->vptr = ptr;
+        }
+        ptr += n << bcf_type_shift[type];
+    }
+}
+
 int anno_vcf_core(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line)
 {
     int i, j;
@@ -402,7 +588,8 @@ int anno_vcf_core(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line)
             continue;
         if ( match_allele(line, d) )
             continue;
-        
+
+        anno_vcf_match_init(f, d);
         for ( i = 0; i < f->n_col; ++i ) {
             struct anno_col *col = &f->cols[i];
             col->curr_name = bcf_seqname(hdr, line);
@@ -430,6 +617,7 @@ int anno_vcf_chunk(struct anno_vcf_file *f, bcf_hdr_t *hdr, struct anno_pool *po
 
         if ( bcf_get_variant_types(line) == VCF_REF ) continue;
         bcf_unpack(line, BCF_UN_INFO);
+        int matched = 0;
             
         for ( j = b->i_chunk; j < b->cached; ++j) {
             bcf1_t *d = b->buffer[j];
@@ -444,6 +632,8 @@ int anno_vcf_chunk(struct anno_vcf_file *f, bcf_hdr_t *hdr, struct anno_pool *po
             // check allele
             if ( match_allele(line, d) ) continue;
 
+            matched = 1;
+            anno_vcf_match_init(f, d);
             int k;
             for ( k = 0; k < f->n_col; ++k ) {
                 struct anno_col *col = &f->cols[k];
@@ -453,10 +643,18 @@ int anno_vcf_chunk(struct anno_vcf_file *f, bcf_hdr_t *hdr, struct anno_pool *po
                     warnings("Failed to annotate %s:%d with %s.", col->curr_name, col->curr_line, f->fname);
             }
         }
+        f->stat.n_match += matched;
     }
     return 0;
 }
 
+void anno_vcf_file_stat(struct anno_vcf_file *f, struct anno_stat *s)
+{
+    BGZF *b = hts_get_bgzfp(f->fp);
+    anno_stat_add(s, &f->stat);
+    if ( b ) s->n_byte += b->uncompressed_address;
+}
+
 #ifdef ANNO_VCF_MAIN
 
 #include "anno_thread_pool.h"
@@ -653,25 +851,21 @@ int bcfanno_vcf()
     
     for ( ;; ) {
         struct anno_pool *arg = anno_reader(args.fp_input, args.hdr_out, args.n_record);
-        if ( arg->n_reader == 0 )
+        if ( arg->n_reader == 0 ) {
+            anno_pool_release(arg);
             break;
+        }
         arg->arg = &args;
-        int block;
-        do {
-            block = thread_pool_dispatch2(p, q, anno_vcf, arg, 1);
-            if ( ( r = thread_pool_next_result(q) ) ) {
-                // generate output
-                struct anno_pool *data = (struct anno_pool*)r->data;
-                int i;
-                for ( i = 0; i < data->n_reader; ++i ) {
-                    bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
-                    bcf_destroy(data->readers[i]);
-                }
-                free(data->readers);
-                thread_pool_delete_result(r, 1);
-            }
-            // flush output
-        } while ( block == -1);
+        // sleep until the input queue has room, and write the ordered results meanwhile
+        while ( thread_pool_dispatch3(p, q, anno_vcf, arg, &r) == 1 ) {
+            // generate output
+            struct anno_pool *data = (struct anno_pool*)r->data;
+            int i;
+            for ( i = 0; i < data->n_reader; ++i )
+                bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
+            anno_pool_release(data);
+            thread_pool_delete_result(r, 0);
+        }
     }
     
     thread_pool_process_flush(q);
@@ -679,15 +873,14 @@ int bcfanno_vcf()
         // generate output
         struct anno_pool *data = (struct anno_pool*)r->data;
         int i;
-        for ( i = 0; i < data->n_reader; ++i ) {
+        for ( i = 0; i < data->n_reader; ++i )
             bcf_write1(args.fp_out, args.hdr_out, data->readers[i]);
-            bcf_destroy(data->readers[i]);
-        }
-        free(data->readers);
-        thread_pool_delete_result(r, 1);
+        anno_pool_release(data);
+        thread_pool_delete_result(r, 0);
     }
     thread_pool_process_destroy(q);
     thread_pool_destroy(p);
+    anno_pool_freelist_destroy();
     return 0;
 }
 
@@ -698,7 +891,7 @@ void release_memory()
     bcf_hdr_destroy(args.hdr_out);
     int i;
     for ( i = 0; i < args.n_thread; ++i )
-        anno_vcf_file_destroy(args.files[i]);
+        anno_vcf_file_destroy(args.files[i], i);
     free(args.files);
 }
 
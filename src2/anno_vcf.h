@@ -7,6 +7,7 @@
 #include "htslib/vcf.h"
 #include "htslib/tbx.h"
 #include "anno_pool.h"
+#include "anno_stats.h"
 
 struct anno_vcf_buffer {
     int no_such_chrom;
@@ -22,6 +23,30 @@ struct anno_vcf_buffer {
     float *tmpf, *tmpf2, *tmpf3;
     char *tmps, *tmps2, **tmpp, **tmpp2;
     kstring_t tmpks;
+
+    // forward-only cursor over database in chunk mode
+    // chromosome id of cursor in the index, -1 if cursor is not positioned
+    int stream_tid;
+    // chromosome id of records in database header, set by first record after seek
+    int stream_rid;
+    // reach the end of chromosome
+    int stream_end;
+    // end of last chunk, cursor only moves forward
+    int stream_last;
+    // record read from cursor but beyond last chunk, kept for next chunk
+    int has_next;
+    bcf1_t *stream_next;
+    // line buffer for VCF database
+    kstring_t str;
+
+    // INFO of matched database record, only requested columns are decoded, indexed by column,
+    // vptr is NULL if the tag is absent
+    bcf_info_t *infos;
+    // allele maps of matched pair, [0] for Number=A and [1] for Number=R, computed on first use
+    // and shared by all columns; status is 0 if not computed yet, -1 if REFs not compatible
+    int map_status[2];
+    int m_map[2];
+    int *map[2];
 };
 
 struct anno_vcf_file {
@@ -36,15 +61,28 @@ struct anno_vcf_file {
 
     int n_col;
     struct anno_col *cols;
+    // INFO id of each column in database header, -1 for FILTER/ID or tag not defined with the same type
+    int *info_keys;
+    // translation maps built at init, contig id of input header to id in the database index,
+    // FILTER id of database header to id in output header
+    int n_tid, *tid_map;
+    int n_flt, *flt_map;
     struct anno_vcf_buffer *buffer;
+    // counters of this handler, see anno_stats.h
+    struct anno_stat stat;
 };
 
 extern struct anno_vcf_file *anno_vcf_file_init(bcf_hdr_t *hdr, const char *fname, char *column);
-extern void anno_vcf_file_destroy(struct anno_vcf_file *f);
+extern void anno_vcf_file_destroy(struct anno_vcf_file *f, int l);
 extern struct anno_vcf_file *anno_vcf_file_duplicate(struct anno_vcf_file *f);
-extern void anno_vcf_file_destroy(struct anno_vcf_file *f);
+extern void anno_vcf_file_destroy(struct anno_vcf_file *f, int l);
 extern int anno_vcf_core(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line);
 extern int anno_vcf_chunk(struct anno_vcf_file *f, bcf_hdr_t *hdr, struct anno_pool *pool);
+// Add counters of this handler and bytes inflated from the database to s.
+extern void anno_vcf_file_stat(struct anno_vcf_file *f, struct anno_stat *s);
+
+// map FILTER id of database to output header
+extern int anno_vcf_filter_id(struct anno_vcf_file *f, bcf_hdr_t *hdr, int id);
 
 // APIs from vcf_annos.c
 extern int vcf_setter_filter(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col, void *data);
@@ -3,11 +3,19 @@
 #include "anno_bed.h"
 #include "anno_vcf.h"
 #include "anno_col.h"
+#include "anno_sort.h"
+#include "anno_shard.h"
+#include "anno_steal.h"
+#include "anno_stats.h"
+#include "anno_tune.h"
 #include "anno_thread_pool.h"
 #include "config.h"
 #include "htslib/hts.h"
 #include "htslib/tbx.h"
 #include "htslib/vcf.h"
+#include "htslib/thread_pool.h"
+#include "htslib/bgzf.h"
+#include "htslib/hfile.h"
 
 #include "number.h"
 #include "anno_flank.h"
@@ -21,6 +29,8 @@
 
 #include "version.h"
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 struct anno_index {
     // point to hdr_out, DO NOT free it
@@ -37,6 +47,12 @@ struct anno_index {
     struct anno_mc_file *mc_file;
     // flank sequence
     struct seqidx *seqidx;
+    // INFO updates of one pool are merged into records at once
+    struct info_batch *batch;
+    // chunk cost samples of this thread for adaptive sizing
+    struct tune_sample tune;
+    // counters of flank sequences, see anno_stats.h
+    struct anno_stat flank_stat;
 };
 
 extern int bcf_add_flankseq(struct seqidx *idx, bcf_hdr_t *hdr, bcf1_t *line);
@@ -55,15 +71,35 @@ int usage()
     fprintf(stderr, "About : Annotate VCF/BCF file.\n");
     fprintf(stderr, "Version : %s, build with htslib version : %s\n", BCFANNO_VERSION, hts_version());
     fprintf(stderr, "Usage : bcfanno -c config.json in.vcf.gz\n");
+    fprintf(stderr, "        bcfanno merge -o out.bcf part1.bcf part2.bcf ...\n");
     fprintf(stderr, "   -c, --config <file>            configure file, include annotations and tags, see man page for details\n");
     fprintf(stderr, "   -o, --output <file>            write output to a file [standard output]\n");
     fprintf(stderr, "   -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
     fprintf(stderr, "   -q                             quiet mode\n");
     fprintf(stderr, "   -r  [number]                   records per thread. Default is %d.\n", RECORDS_PER_CHUNK);    
-    fprintf(stderr, "   -t, --thread                   thread\n");
-    fprintf(stderr, "   --unsort                       set if input is not sorted by cooridinate, **bad performance**\n");
+    fprintf(stderr, "   -t, --thread                   threads in total. With more than one, the main thread reads input, one thread\n");
+    fprintf(stderr, "                                  writes output, a quarter of the rest (de)compresses BGZF blocks, and the others\n");
+    fprintf(stderr, "                                  annotate and parse VCF lines, at least one. --shard-by-region annotates in all of them\n");
+    fprintf(stderr, "   --task-ms [number]             adapt records per thread (from -r) and max gap of records in a chunk to the\n");
+    fprintf(stderr, "                                  measured annotation cost, so each task takes about this milliseconds.\n");
+    fprintf(stderr, "                                  Not used with GEA database or --shard-by-region\n");
+    fprintf(stderr, "   --records-range [min,max]      bounds of records per thread adapted by --task-ms. Default is %d,%d.\n", TUNE_MIN_RECORDS, TUNE_MAX_RECORDS);
+    fprintf(stderr, "   --gap-range [min,max]          bounds of max gap in bp adapted by --task-ms. Default is %d,%d.\n", TUNE_MIN_GAP, TUNE_MAX_GAP);
+    fprintf(stderr, "   --unsorted                     set if input is not sorted by cooridinate, records are sorted in memory and $TMPDIR,\n");
+    fprintf(stderr, "                                  and written in the input order\n");
+    fprintf(stderr, "   --sort-buffer-mb [number]      megabytes of records sorted in memory before spilled to $TMPDIR. Default is %d.\n", SORT_BUFFER_MB);
+    fprintf(stderr, "   --shard-by-region              split indexed input (BCF, or bgzipped VCF with TBI/CSI index) into regions\n");
+    fprintf(stderr, "                                  and annotate them independently in threads\n");
+    fprintf(stderr, "   --shard [i/N]                  only annotate the i-th (1-based) of N partitions of indexed input, implies\n");
+    fprintf(stderr, "                                  --shard-by-region. Outputs of all partitions are combined by `bcfanno merge`,\n");
+    fprintf(stderr, "                                  which also combines the indexes of partitions if they are indexed\n");
     fprintf(stderr, "   --flank                        if set this flag and reference genome specified in configure, FLKSEQ tag will be generated\n");
     fprintf(stderr, "   --mito                         set the mitochodrial sequence name, default is chrM. Human mito use a different genetic code map!\n");
+    fprintf(stderr, "   --rna-cache-mb [number]        megabytes of transcript sequences cached per thread, 0 to disable. Default is 64.\n");
+    fprintf(stderr, "   --preload-gea                  load whole GEA database into memory, recommended for exome or panel data\n");
+    fprintf(stderr, "   --preload-bed                  load whole BED databases into memory, recommended for small databases like cytoband\n");
+    fprintf(stderr, "   --stats <file.json>            write wall and CPU time, peak memory, time and counters of each database and\n");
+    fprintf(stderr, "                                  busy/idle time of each stage to a JSON file\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Homepage: https://github.com/shiquan/bcfanno\n");
     fprintf(stderr, "\n");
@@ -106,6 +142,16 @@ struct args {
     struct bcfanno_config *config;
 
     int input_unsorted;
+    // sort unsorted input by coordinate and restore the input order at output
+    struct anno_sort *sort;
+    // annotate regions of indexed input in threads, each thread reads input by its own handler
+    int shard_by_region;
+    hts_idx_t *idx;
+    tbx_t *tbx;
+    // annotate partition i_part (0-based) of n_part, set by --shard i/N
+    int i_part;
+    int n_part;
+    htsFile **shard_fps;
     // if this flag and reference genome is set, FLKSEQ will be annotated
     int flank_seq_is_need;
     
@@ -113,7 +159,23 @@ struct args {
     int n_record;
     
     int n_thread;
+    // threads of BGZF (de)compression in multi thread mode, taken from n_thread
+    int n_bgzf;
+    // annotation handlers of each thread, n_index is the thread number before annotate()
+    int n_index;
     struct anno_index **indexs;
+    // work-stealing pool of annotation workers in multi thread mode
+    struct steal_pool *steal;
+
+    // shared htslib pool to inflate input and deflate output BGZF blocks
+    htsThreadPool hts_pool;
+    // input is VCF text, parse lines in worker threads instead of main thread
+    int parse_in_workers;
+    // output is VCF text, format records in worker threads instead of writer thread
+    int format_in_workers;
+    // annotators write different tags, so annotators of a small range may run as separate tasks
+    int task_graph;
+    atomic_uint_fast64_t n_graph;
 
     uint64_t total_record;
 } args = {
@@ -130,9 +192,22 @@ struct args {
     .quiet        = 0,
     .n_thread     = 1,
     .input_unsorted = 0,
+    .sort         = NULL,
+    .shard_by_region = 0,
+    .idx          = NULL,
+    .tbx          = NULL,
+    .i_part       = 0,
+    .n_part       = 1,
+    .shard_fps    = NULL,
     .flank_seq_is_need = 0,
     .n_record     = RECORDS_PER_CHUNK,
+    .n_index      = 0,
     .indexs       = NULL,
+    .steal        = NULL,
+    .hts_pool     = {NULL, 0},
+    .parse_in_workers  = 0,
+    .format_in_workers = 0,
+    .task_graph   = 0,
     .total_record = 0,
 };
 
@@ -187,6 +262,7 @@ struct anno_index *anno_index_init(bcf_hdr_t *hdr, struct bcfanno_config *config
     else idx->seqidx = NULL;
     
     idx->hdr_out = hdr;
+    idx->batch = info_batch_init();
     
     return idx;
 }
@@ -207,19 +283,21 @@ struct anno_index *anno_index_duplicate(struct anno_index *idx)
     // if ( idx->hgvs ) d->hgvs = anno_hgvs_file_duplicate(idx->hgvs);
     if ( idx->mc_file ) d->mc_file = anno_mc_file_duplicate(idx->mc_file);
     if ( idx->seqidx ) d->seqidx = sequence_index_duplicate(idx->seqidx);
+    d->batch = info_batch_init();
     return d;
 }
 void anno_index_destroy(struct anno_index *idx, int l)
 {
-    extern void sequence_index_destroy(struct seqidx *idx);
+    extern void sequence_index_destroy(struct seqidx *idx, int l);
     int i;
-    for ( i = 0; i < idx->n_vcf; ++i ) anno_vcf_file_destroy(idx->vcf_files[i]);
-    for ( i = 0; i < idx->n_bed; ++i ) anno_bed_file_destroy(idx->bed_files[i]);
+    for ( i = 0; i < idx->n_vcf; ++i ) anno_vcf_file_destroy(idx->vcf_files[i], l);
+    for ( i = 0; i < idx->n_bed; ++i ) anno_bed_file_destroy(idx->bed_files[i], l);
     if ( idx->vcf_files ) free(idx->vcf_files);
     if ( idx->bed_files ) free(idx->bed_files);
     // if ( idx->hgvs ) anno_hgvs_file_destroy(idx->hgvs);
     if ( idx->mc_file) anno_mc_file_destroy(idx->mc_file, l);
-    if ( idx->seqidx ) sequence_index_destroy(idx->seqidx);
+    if ( idx->seqidx ) sequence_index_destroy(idx->seqidx, l);
+    info_batch_destroy(idx->batch);
     free(idx);
 }
 
@@ -237,6 +315,13 @@ int parse_args(int argc, char **argv)
     const char *thread = 0;
     const char *record = 0;
     const char *mito = 0;
+    const char *rna_cache = 0;
+    const char *sort_buffer = 0;
+    const char *shard = 0;
+    const char *task_ms = 0;
+    const char *records_range = 0;
+    const char *gap_range = 0;
+    const char *stats = 0;
     for (i = 1; i < argc; ) {
 	const char *a = argv[i++];
 	if ( strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0)
@@ -256,10 +341,22 @@ int parse_args(int argc, char **argv)
             args.input_unsorted = 1;
             continue;
         }
+        if ( strcmp(a, "--shard-by-region") == 0 ) {
+            args.shard_by_region = 1;
+            continue;
+        }
         if ( strcmp(a, "--flank") == 0 ) {
             args.flank_seq_is_need = 1;
             continue;
         }
+        if ( strcmp(a, "--preload-gea") == 0 ) {
+            mc_handler_set_preload(1);
+            continue;
+        }
+        if ( strcmp(a, "--preload-bed") == 0 ) {
+            anno_bed_set_preload(1);
+            continue;
+        }
             
         const char **var = 0;
 	if ( strcmp(a, "-c") == 0 || strcmp(a, "--config") == 0 ) 
@@ -274,6 +371,20 @@ int parse_args(int argc, char **argv)
             var = &record;
         else if ( strcmp(a, "--mito") == 0 )
             var = &mito;
+        else if ( strcmp(a, "--rna-cache-mb") == 0 )
+            var = &rna_cache;
+        else if ( strcmp(a, "--sort-buffer-mb") == 0 )
+            var = &sort_buffer;
+        else if ( strcmp(a, "--shard") == 0 )
+            var = &shard;
+        else if ( strcmp(a, "--task-ms") == 0 )
+            var = &task_ms;
+        else if ( strcmp(a, "--records-range") == 0 )
+            var = &records_range;
+        else if ( strcmp(a, "--gap-range") == 0 )
+            var = &gap_range;
+        else if ( strcmp(a, "--stats") == 0 )
+            var = &stats;
         
 	if ( var != 0 ) {
 	    if (i == argc) error("Missing an argument after %s", a);
@@ -296,6 +407,8 @@ int parse_args(int argc, char **argv)
 	LOG_print("Args: %s", args.commands.s);
     }
     
+    if ( stats ) anno_stats_set_output(stats);
+
     if ( args.fname_json == 0 ) {
 	fprintf(stderr, "[error] No configure file is specified. Use -h for help message.\n");
 	//fprintf(stderr, "[notice] %s.\n", DONOT_POST_ERR_STRING);
@@ -329,6 +442,26 @@ int parse_args(int argc, char **argv)
     if ( type.format  != vcf && type.format != bcf )
         error("Unsupported input format, only accept BCF/VCF format. %s", args.fname_input);
 
+    if ( shard ) {
+        int i_part, n_part;
+        char c;
+        if ( sscanf(shard, "%d/%d%c", &i_part, &n_part, &c) != 2 || n_part < 1 || i_part < 1 || i_part > n_part )
+            error("Bad argument of --shard, %s. Should be i/N, 1 <= i <= N.", shard);
+        args.i_part = i_part - 1;
+        args.n_part = n_part;
+        args.shard_by_region = 1;
+    }
+    if ( args.shard_by_region == 1 ) {
+        if ( args.input_unsorted == 1 )
+            error("--shard-by-region requires sorted input, conflict with --unsorted.");
+        if ( type.format == bcf )
+            args.idx = bcf_index_load(args.fname_input);
+        else if ( type.compression == bgzf )
+            args.tbx = tbx_index_load(args.fname_input);
+        if ( args.idx == NULL && args.tbx == NULL )
+            error("--shard and --shard-by-region require indexed BCF or bgzipped VCF input. %s", args.fname_input);
+    }
+
     if ( thread ) {
         args.n_thread = str2int((char*)thread);
         if ( args.n_thread < 1 ) args.n_thread = 1;
@@ -337,6 +470,11 @@ int parse_args(int argc, char **argv)
         args.n_record = str2int((char*)record);
         if ( args.n_record < 0 ) args.n_record = 1000;
     }
+    if ( rna_cache ) {
+        int mb = str2int((char*)rna_cache);
+        if ( mb < 0 ) error("Bad argument of --rna-cache-mb, %s.", rna_cache);
+        mc_handler_set_rna_cache_size((size_t)mb<<20);
+    }
         
     // init output type
     int out_type = FT_VCF;
@@ -354,8 +492,29 @@ int parse_args(int argc, char **argv)
 		error("The output type \"%d\" not recognised\n", out_type);
 	};
     }
+    args.output_type = out_type;
     // init output file handler
     args.fp_out = args.fname_output == 0 ? hts_open("-", hts_bcf_wmode(out_type)) : hts_open(args.fname_output, hts_bcf_wmode(out_type));
+    if ( args.fp_out == NULL )
+        error("Failed to open %s.", args.fname_output == 0 ? "-" : args.fname_output);
+
+    // in multi-thread mode, -t threads are shared by the main thread splitting input lines, the
+    // writer thread, the htslib pool (de)compressing BGZF blocks with a quarter of the rest, and
+    // the annotation workers which also parse and format VCF lines, see annotate()
+    // in shard mode, workers read input and write segments by themselves
+    if ( args.n_thread > 1 && args.shard_by_region == 0 ) {
+        args.n_bgzf = args.fp_input->is_bgzf || args.fp_out->is_bgzf ? (args.n_thread - 2)/4 : 0;
+        if ( args.n_bgzf > 0 ) {
+            args.hts_pool.pool = hts_tpool_init(args.n_bgzf);
+            if ( args.hts_pool.pool == NULL )
+                error("Failed to init thread pool.");
+            hts_set_opt(args.fp_input, HTS_OPT_THREAD_POOL, &args.hts_pool);
+            hts_set_opt(args.fp_out, HTS_OPT_THREAD_POOL, &args.hts_pool);
+        }
+        // records of unsorted input are read by the sorter and restored at output
+        args.parse_in_workers = type.format == vcf && args.input_unsorted == 0;
+        args.format_in_workers = (args.fp_out->format.format == vcf || args.fp_out->format.format == text_format) && args.input_unsorted == 0;
+    }
 
 //    if ( annotation_file_is_gea_format == 0 ) { // assume it is genepredext format
         // set genepredExt format
@@ -367,6 +526,14 @@ int parse_args(int argc, char **argv)
     if ( args.hdr == NULL)
 	error("Failed to parse header of input.");
 
+    if ( args.input_unsorted == 1 ) {
+        int mb = SORT_BUFFER_MB;
+        if ( sort_buffer ) {
+            mb = str2int((char*)sort_buffer);
+            if ( mb < 1 ) error("Bad argument of --sort-buffer-mb, %s.", sort_buffer);
+        }
+        args.sort = anno_sort_init(args.hdr, (size_t)mb<<20);
+    }
 
     // set Mito environment
     if ( mito == NULL ) 
@@ -388,6 +555,28 @@ int parse_args(int argc, char **argv)
     args.indexs[0] = anno_index_init(args.hdr, args.config);
     for ( i = 1; i < args.n_thread; ++i )
         args.indexs[i] = anno_index_duplicate(args.indexs[0]);
+    args.n_index = args.n_thread;
+    
+    if ( task_ms == NULL && (records_range || gap_range) )
+        error("%s only bounds the adapted values of --task-ms.", records_range ? "--records-range" : "--gap-range");
+    if ( task_ms ) {
+        int ms = str2int((char*)task_ms);
+        int min_record = TUNE_MIN_RECORDS, max_record = TUNE_MAX_RECORDS;
+        int min_gap = TUNE_MIN_GAP, max_gap = TUNE_MAX_GAP;
+        char c;
+        if ( ms < 1 ) error("Bad argument of --task-ms, %s.", task_ms);
+        if ( records_range && (sscanf(records_range, "%d,%d%c", &min_record, &max_record, &c) != 2 || min_record < 1 || max_record < min_record) )
+            error("Bad argument of --records-range, %s. Should be min,max.", records_range);
+        if ( gap_range && (sscanf(gap_range, "%d,%d%c", &min_gap, &max_gap, &c) != 2 || min_gap < 1 || max_gap < min_gap) )
+            error("Bad argument of --gap-range, %s. Should be min,max.", gap_range);
+        // GEA retrieves nearby genes at the edges of chunks, the result depends on chunk sizes
+        if ( args.indexs[0]->mc_file )
+            warnings("--task-ms%s is ignored with GEA database, GEA results depend on chunk sizes.", records_range || gap_range ? " with its ranges" : "");
+        else if ( args.shard_by_region )
+            warnings("--task-ms%s is ignored with --shard-by-region.", records_range || gap_range ? " with its ranges" : "");
+        else
+            anno_tune_init(ms, args.n_record, min_record, max_record, min_gap, max_gap);
+    }
     
     kstring_t str = {0,0,0};
     ksprintf(&str, "##bcfannoVersion=%s+htslib-%s\n", BCFANNO_VERSION, hts_version());
@@ -398,7 +587,6 @@ int parse_args(int argc, char **argv)
     
     // write header to output    
     bcf_hdr_write(args.fp_out, args.hdr);
-    free(args.commands.s);
     free(str.s);
     return 0;
 }
@@ -407,11 +595,375 @@ void memory_release()
 {
     hts_close(args.fp_input);
     hts_close(args.fp_out);
+    if ( args.sort ) anno_sort_destroy(args.sort);
+    if ( args.idx ) hts_idx_destroy(args.idx);
+    if ( args.tbx ) tbx_destroy(args.tbx);
+    if ( args.hts_pool.pool ) hts_tpool_destroy(args.hts_pool.pool);
     bcfanno_config_destroy(args.config);
     bcf_hdr_destroy(args.hdr);
     int i;
-    for ( i = 0; i < args.n_thread; ++i ) anno_index_destroy(args.indexs[i], i);
+    for ( i = 0; i < args.n_index; ++i ) anno_index_destroy(args.indexs[i], i);
     free(args.indexs);
+    free(args.commands.s);
+    anno_pool_freelist_destroy();
+}
+
+// Monotonic clock in seconds, for the stage times and chunk costs.
+static double anno_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Annotators of a chunk, GEA first, then VCF and BED databases in config order. Flank sequences
+// are not counted, they are written to the lines directly, see anno_flank_chunk().
+static int anno_annotator_count(struct anno_index *index)
+{
+    return (index->mc_file ? 1 : 0) + index->n_vcf + index->n_bed;
+}
+
+enum { ANNOTATOR_GEA, ANNOTATOR_VCF, ANNOTATOR_BED };
+
+// Type of annotator k, and its index in the handlers of this type.
+static int anno_annotator_type(struct anno_index *index, int k, int *j)
+{
+    if ( index->mc_file ) {
+        if ( k == 0 ) {
+            *j = 0;
+            return ANNOTATOR_GEA;
+        }
+        k--;
+    }
+    if ( k < index->n_vcf ) {
+        *j = k;
+        return ANNOTATOR_VCF;
+    }
+    *j = k - index->n_vcf;
+    return ANNOTATOR_BED;
+}
+
+static struct anno_col *anno_annotator_cols(struct anno_index *index, int k, int *n_col)
+{
+    int j;
+    switch ( anno_annotator_type(index, k, &j) ) {
+        case ANNOTATOR_GEA:
+            *n_col = index->mc_file->n_col;
+            return index->mc_file->cols;
+        case ANNOTATOR_VCF:
+            *n_col = index->vcf_files[j]->n_col;
+            return index->vcf_files[j]->cols;
+        default:
+            *n_col = index->bed_files[j]->n_col;
+            return index->bed_files[j]->cols;
+    }
+}
+
+static struct anno_stat *anno_annotator_stat(struct anno_index *index, int k)
+{
+    int j;
+    switch ( anno_annotator_type(index, k, &j) ) {
+        case ANNOTATOR_GEA: return &index->mc_file->stat;
+        case ANNOTATOR_VCF: return &index->vcf_files[j]->stat;
+        default: return &index->bed_files[j]->stat;
+    }
+}
+
+// Run annotator k on the current chunk of pool.
+static void anno_annotator_chunk(struct anno_index *index, int k, struct anno_pool *pool)
+{
+    int j;
+    struct anno_stat *s = anno_annotator_stat(index, k);
+    double start = anno_stats_enabled() ? anno_now() : 0;
+    //if ( index->hgvs )
+    // anno_hgvs_chunk(index->hgvs, index->hdr_out, pool);
+    switch ( anno_annotator_type(index, k, &j) ) {
+        case ANNOTATOR_GEA:
+            anno_mc_chunk(index->mc_file, index->hdr_out, pool);
+            break;
+        case ANNOTATOR_VCF:
+            anno_vcf_chunk(index->vcf_files[j], index->hdr_out, pool);
+            break;
+        default:
+            anno_bed_chunk(index->bed_files[j], index->hdr_out, pool);
+    }
+    s->n_record += pool->n_chunk - pool->i_chunk;
+    if ( start > 0 ) s->time += anno_now() - start;
+}
+
+static void anno_flank_chunk(struct anno_index *index, struct anno_pool *pool)
+{
+    int i;
+    if ( args.flank_seq_is_need == 1 && index->seqidx ) {
+        double start = anno_stats_enabled() ? anno_now() : 0;
+        for ( i = pool->i_chunk; i < pool->n_chunk; ++i) 
+            bcf_add_flankseq(index->seqidx, index->hdr_out, pool->readers[i]);
+        index->flank_stat.n_record += pool->n_chunk - pool->i_chunk;
+        if ( start > 0 ) index->flank_stat.time += anno_now() - start;
+    }
+}
+
+// Annotate the next chunk of records from pool->n_chunk, not beyond pool->n_reader.
+static void anno_chunk_annotate(struct anno_index *index, struct anno_pool *pool)
+{
+    int i, n = anno_annotator_count(index);
+    double start = anno_tune_enabled() ? anno_now() : 0;
+    update_chunk_region(pool);
+    for ( i = 0; i < n; ++i )
+        anno_annotator_chunk(index, i, pool);
+    anno_flank_chunk(index, pool);
+    if ( start > 0 )
+        anno_tune_add(&index->tune, pool->n_chunk - pool->i_chunk, pool->curr_end - pool->curr_start + 1, anno_now() - start);
+}
+
+// Annotate records of a pool chunk by chunk.
+static void anno_pool_annotate(struct anno_index *index, struct anno_pool *pool)
+{
+    while ( pool->n_chunk < pool->n_reader )
+        anno_chunk_annotate(index, pool);
+}
+
+// Records [beg, end) of a pool.
+struct anno_range {
+    struct anno_pool *pool;
+    int beg;
+    int end;
+};
+
+// Records annotated between two checks for splitting, if chunks can be cut.
+#define SPLIT_STEP 128
+
+static void anno_range_core(void *arg, int idx);
+
+// Split point of the remaining records [beg, end), or -1 if too small. Chunks of GEA retrieve
+// nearby genes at their edges, so with GEA the pool is only split at chunk boundaries from
+// anno_pool_chunks(), and each chunk gives the same result as without splitting.
+static int anno_range_split(struct anno_index *index, struct anno_pool *pool, int beg, int end)
+{
+    int mid = beg + (end - beg)/2;
+    if ( index->mc_file == NULL ) return end - beg >= SPLIT_STEP*2 ? mid : -1;
+    // first chunk boundary after mid
+    int lo = 0, hi = pool->n_bound;
+    while ( lo < hi ) {
+        int k = (lo + hi)/2;
+        if ( pool->bounds[k] <= mid ) lo = k + 1;
+        else hi = k;
+    }
+    return lo < pool->n_bound && pool->bounds[lo] < end ? pool->bounds[lo] : -1;
+}
+
+// Annotators of the records [beg, end) of a pool run as separate tasks, each into its own INFO
+// batch, and the last task to finish merges the batches into the lines in config order. So a
+// small input with many databases is not annotated database by database in one thread.
+struct anno_graph;
+struct anno_graph_task {
+    struct anno_graph *g;
+    int k;
+};
+struct anno_graph {
+    // chunks of the records, cut in the same way as anno_range_annotate()
+    int n_view;
+    struct anno_pool *views;
+    int n_task;
+    struct anno_graph_task *tasks;
+    struct info_batch **batches;
+    // unfinished tasks, plus one held by the spawner until all tasks are spawned
+    atomic_int n_left;
+};
+
+// Released INFO batches of the graphs, reused by later graphs.
+static struct {
+    pthread_mutex_t lock;
+    int n, m;
+    struct info_batch **a;
+} graph_batches = { PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL };
+
+static struct info_batch *anno_graph_batch_get()
+{
+    struct info_batch *b = NULL;
+    pthread_mutex_lock(&graph_batches.lock);
+    if ( graph_batches.n > 0 ) b = graph_batches.a[--graph_batches.n];
+    pthread_mutex_unlock(&graph_batches.lock);
+    return b ? b : info_batch_init();
+}
+
+static void anno_graph_batch_put(struct info_batch *b)
+{
+    pthread_mutex_lock(&graph_batches.lock);
+    if ( graph_batches.n == graph_batches.m ) {
+        graph_batches.m = graph_batches.m == 0 ? 16 : graph_batches.m<<1;
+        graph_batches.a = realloc(graph_batches.a, graph_batches.m*sizeof(void*));
+    }
+    graph_batches.a[graph_batches.n++] = b;
+    pthread_mutex_unlock(&graph_batches.lock);
+}
+
+static void anno_graph_batches_destroy()
+{
+    int i;
+    for ( i = 0; i < graph_batches.n; ++i ) info_batch_destroy(graph_batches.a[i]);
+    free(graph_batches.a);
+    graph_batches.n = graph_batches.m = 0;
+    graph_batches.a = NULL;
+}
+
+// Annotators may run concurrently only if no two of them write the same tag, or END which changes
+// the length of records seen by the others. Otherwise the result depends on their order.
+static int anno_graph_check(struct anno_index *index)
+{
+    int n = anno_annotator_count(index), k, l, i, j;
+    for ( k = 0; k < n; ++k ) {
+        int n_col;
+        struct anno_col *cols = anno_annotator_cols(index, k, &n_col);
+        for ( i = 0; i < n_col; ++i ) {
+            if ( strcmp(cols[i].hdr_key, "END") == 0 ) return 0;
+            for ( l = k + 1; l < n; ++l ) {
+                int n_col2;
+                struct anno_col *cols2 = anno_annotator_cols(index, l, &n_col2);
+                for ( j = 0; j < n_col2; ++j )
+                    if ( strcmp(cols[i].hdr_key, cols2[j].hdr_key) == 0 ) return 0;
+            }
+        }
+    }
+    return n > 1;
+}
+
+// Called by the last task of a graph. Flank sequences are written to the lines before merge, the
+// same as anno_chunk_annotate() does.
+static void anno_graph_merge(struct anno_graph *g, struct anno_index *index)
+{
+    int i;
+    for ( i = 0; i < g->n_view; ++i )
+        anno_flank_chunk(index, &g->views[i]);
+    for ( i = 1; i < g->n_task; ++i ) {
+        info_batch_append(g->batches[0], g->batches[i]);
+        anno_graph_batch_put(g->batches[i]);
+    }
+    info_batch_end(g->batches[0]);
+    anno_graph_batch_put(g->batches[0]);
+    free(g->views);
+    free(g->tasks);
+    free(g->batches);
+    free(g);
+}
+
+static void anno_graph_core(void *arg, int idx)
+{
+    struct anno_graph_task *t = (struct anno_graph_task*) arg;
+    struct anno_graph *g = t->g;
+    struct anno_index *index = args.indexs[idx];
+    int i;
+    anno_hdr_rdlock();
+    info_batch_begin(g->batches[t->k]);
+    for ( i = 0; i < g->n_view; ++i ) {
+        // annotators may move the cursor of their view
+        struct anno_pool view = g->views[i];
+        anno_annotator_chunk(index, t->k, &view);
+    }
+    info_batch_begin(NULL);
+    if ( atomic_fetch_sub(&g->n_left, 1) == 1 ) anno_graph_merge(g, index);
+    anno_hdr_unlock();
+}
+
+static void anno_graph_spawn(struct anno_index *index, struct anno_pool *pool, int beg, int end, int idx)
+{
+    struct anno_graph *g = malloc(sizeof(*g));
+    int i, m = 0;
+    struct anno_pool view;
+    memset(&view, 0, sizeof(view));
+    view.m = pool->m;
+    view.readers = pool->readers;
+    view.max_gap = pool->max_gap;
+    view.n_chunk = beg;
+    g->n_view = 0;
+    g->views = NULL;
+    while ( view.n_chunk < end ) {
+        view.n_reader = end;
+        if ( index->mc_file == NULL && end - view.n_chunk > SPLIT_STEP ) view.n_reader = view.n_chunk + SPLIT_STEP;
+        update_chunk_region(&view);
+        if ( g->n_view == m ) {
+            m = m == 0 ? 8 : m<<1;
+            g->views = realloc(g->views, m*sizeof(struct anno_pool));
+        }
+        g->views[g->n_view++] = view;
+    }
+    // the lines are shared by the tasks, unpack them and cache the variant types before, so the
+    // annotators only read them
+    for ( i = beg; i < end; ++i ) {
+        bcf_unpack(pool->readers[i], BCF_UN_INFO);
+        bcf_get_variant_types(pool->readers[i]);
+    }
+    g->n_task = anno_annotator_count(index);
+    g->tasks = malloc(g->n_task*sizeof(struct anno_graph_task));
+    g->batches = malloc(g->n_task*sizeof(void*));
+    // the tasks may finish and free g while the rest are spawned, so hold a reference
+    atomic_init(&g->n_left, g->n_task + 1);
+    for ( i = 0; i < g->n_task; ++i ) {
+        g->batches[i] = anno_graph_batch_get();
+        g->tasks[i].g = g;
+        g->tasks[i].k = i;
+    }
+    atomic_fetch_add(&args.n_graph, 1);
+    int n_task = g->n_task;
+    struct anno_graph_task *tasks = g->tasks;
+    for ( i = 0; i < n_task; ++i )
+        steal_pool_spawn(args.steal, idx, anno_graph_core, &tasks[i]);
+    if ( atomic_fetch_sub(&g->n_left, 1) == 1 ) {
+        anno_graph_merge(g, index);
+        // merge detaches the batch of this thread, the caller goes on with its own range
+        info_batch_begin(index->batch);
+    }
+}
+
+// Annotate a range of records. When other workers are starving, the back half of the remaining
+// records is split off as a sub-task, so a pool in a dense region is not left to one thread
+// while the ordered output waits for it. If the rest is too small to split, its annotators
+// run as a task graph instead.
+static void anno_range_annotate(struct anno_range *r, int idx)
+{
+    struct anno_index *index = args.indexs[idx];
+    struct anno_pool *pool = r->pool;
+    // a view of the pool, chunks are cut from view.n_chunk to view.n_reader
+    struct anno_pool view;
+    memset(&view, 0, sizeof(view));
+    view.m = pool->m;
+    view.readers = pool->readers;
+    view.max_gap = pool->max_gap;
+
+    info_batch_begin(index->batch);
+    int i = r->beg;
+    while ( i < r->end ) {
+        if ( steal_pool_hungry(args.steal) ) {
+            int mid = anno_range_split(index, pool, i, r->end);
+            if ( mid > i ) {
+                struct anno_range *sub = malloc(sizeof(*sub));
+                sub->pool = pool;
+                sub->beg = mid;
+                sub->end = r->end;
+                r->end = mid;
+                steal_pool_spawn(args.steal, idx, anno_range_core, sub);
+            }
+            else if ( args.task_graph == 1 ) {
+                anno_graph_spawn(index, pool, i, r->end, idx);
+                break;
+            }
+        }
+        view.n_chunk = i;
+        view.n_reader = r->end;
+        if ( index->mc_file == NULL && view.n_reader - i > SPLIT_STEP ) view.n_reader = i + SPLIT_STEP;
+        anno_chunk_annotate(index, &view);
+        i = view.n_chunk;
+    }
+    info_batch_end(index->batch);
+    anno_tune_flush(&index->tune);
+}
+
+static void anno_range_core(void *arg, int idx)
+{
+    anno_hdr_rdlock();
+    anno_range_annotate((struct anno_range*)arg, idx);
+    anno_hdr_unlock();
+    free(arg);
 }
 
 void *anno_core(void *arg, int idx)
@@ -419,117 +971,286 @@ void *anno_core(void *arg, int idx)
 
     assert(idx >= 0);
 
-    struct anno_index *index = args.indexs[idx];
     struct anno_pool  *pool  = (struct anno_pool*) arg;
     
-    int i, j ;
-    // IMPROVE HERE: read line by line may not require sorted input but highly CPU consume, read a chunk of records
-    // based on the start and end of pool will highly improve the performance
-    if ( args.input_unsorted == 1 ) {
-        for ( i = 0; i < pool->n_reader; ++i ) {
+    if ( pool->n_lines > 0 && anno_pool_parse(pool, args.hdr) )
+        error("Failed to parse input VCF record.");
 
-            bcf1_t *line = pool->readers[i];
-            if ( bcf_get_variant_types(line) == VCF_REF )
-                continue;
+    // unsorted input is sorted by anno_sort_reader(), so always retrieve attributes in chunk
+    struct anno_index *index = args.indexs[idx];
+    if ( index->mc_file ) anno_pool_chunks(pool);
+    struct anno_range r = { pool, 0, pool->n_reader };
+    anno_hdr_rdlock();
+    anno_range_annotate(&r, idx);
+    anno_hdr_unlock();
 
-            // if ( index->hgvs ) 
-            // anno_hgvs_core(index->hgvs, index->hdr_out, line);
+    return pool;
+}
 
-            // if ( index->mc_file ) do not support unsorted input
+// Called after all the chunks of pool are annotated.
+void *anno_finish(void *arg, int idx)
+{
+    struct anno_pool *pool = (struct anno_pool*) arg;
+    if ( args.format_in_workers == 1 ) {
+        anno_hdr_rdlock();
+        if ( anno_pool_format(pool, args.hdr) )
+            error("Failed to format output VCF record.");
+        anno_hdr_unlock();
+    }
+    return pool;
+}
 
-            for ( j = 0; j < index->n_vcf; ++j )
-                anno_vcf_core(index->vcf_files[j], index->hdr_out, line);
-        
-            for ( j = 0; j < index->n_bed; ++j )
-                anno_bed_core(index->bed_files[j], index->hdr_out, line);
+// Write formatted VCF text to output, same with vcf_write() but for a block of lines.
+static int vcf_write_text(htsFile *fp, kstring_t *str)
+{
+    ssize_t ret;
+    if ( fp->format.compression != no_compression )
+        ret = bgzf_write(fp->fp.bgzf, str->s, str->l);
+    else
+        ret = hwrite(fp->fp.hfile, str->s, str->l);
+    return ret == str->l ? 0 : -1;
+}
 
-            if ( args.flank_seq_is_need == 1 && index->seqidx )
-                bcf_add_flankseq(index->seqidx, index->hdr_out, line);
-        }
+// Write annotated records of a chunk and release it. The writer runs in a pool with only
+// one thread, so chunks are written in the same order they are dispatched.
+void *anno_writer(void *arg, int idx)
+{
+    struct anno_pool *pool = (struct anno_pool*) arg;
+    int i;
+    anno_hdr_rdlock();
+    if ( args.input_unsorted == 1 ) {
+        // written in the input order after all records are annotated
+        anno_sort_restore(args.sort, pool);
+    }
+    else if ( args.format_in_workers == 1 ) {
+        if ( pool->formatted.l > 0 && vcf_write_text(args.fp_out, &pool->formatted) )
+            error("Failed to write output.");
     }
-    // retrieve attributes in chunk
     else {
-        for ( ;; ) {
-            if ( pool->n_chunk == pool->n_reader ) break;
-            update_chunk_region(pool);
-            
-            //if ( index->hgvs )
-            // anno_hgvs_chunk(index->hgvs, index->hdr_out, pool);
-            if ( index->mc_file )
-                anno_mc_chunk(index->mc_file, index->hdr_out, pool);
-            
-            for ( i = 0; i < index->n_vcf; ++i )
-                anno_vcf_chunk(index->vcf_files[i], index->hdr_out, pool);
-            for ( i = 0; i < index->n_bed; ++i )                
-                anno_bed_chunk(index->bed_files[i], index->hdr_out, pool);
-        }
-        if ( args.flank_seq_is_need == 1 && index->seqidx ) {
-            for ( i = 0; i < pool->n_reader; ++i) 
-                bcf_add_flankseq(index->seqidx, index->hdr_out, pool->readers[i]);
-        }
+        for ( i = 0; i < pool->n_reader; ++i )
+            if ( bcf_write1(args.fp_out, args.hdr, pool->readers[i]) )
+                error("Failed to write output.");
     }
-    
+    anno_hdr_unlock();
+    anno_pool_release(pool);
+    return NULL;
+}
+
+// Read next pool of input records.
+static struct anno_pool *anno_next_pool(int *n)
+{
+    struct anno_pool *pool;
+    int max_gap = 0;
+    if ( anno_tune_enabled() )
+        anno_tune_update(&args.n_record, &max_gap);
+    if ( args.input_unsorted == 1 ) {
+        pool = anno_sort_reader(args.sort, args.n_record);
+        *n = pool->n_reader;
+    }
+    else if ( args.parse_in_workers ) {
+        pool = anno_reader_lines(args.fp_input, args.n_record);
+        *n = pool->n_lines;
+    }
+    else {
+        pool = anno_reader(args.fp_input, args.hdr, args.n_record);
+        *n = pool->n_reader;
+    }
+    pool->max_gap = max_gap;
+    if ( args.input_unsorted == 0 )
+        args.total_record += (uint64_t)*n;
     return pool;
 }
 
+// Sort all records of unsorted input before annotation.
+static void anno_sort_prepare()
+{
+    args.total_record = anno_sort_input(args.sort, args.fp_input);
+    if ( quiet_mode == 0 )
+        LOG_print("Sort %llu unsorted records, %d buffers spilled.", (unsigned long long)args.total_record, anno_sort_spilled(args.sort));
+}
+
+// Write annotated records of unsorted input in the input order.
+static void anno_sort_finish()
+{
+    if ( anno_sort_write(args.sort, args.fp_out) )
+        error("Failed to write output.");
+}
+
+// Report time of the main thread and the thread stages, so -t and -r can be sized. Workers
+// mostly idle means reading is the bottleneck, main thread mostly blocked means annotation
+// or writing is. Stages are also kept for --stats.
+static void anno_stage_report(const char *name, double busy, double idle, double blocked)
+{
+    anno_stats_stage(name, 1, busy, idle, blocked);
+    if ( quiet_mode == 0 )
+        LOG_print("Stage %-8s : busy %.2fs, idle %.2fs, blocked %.2fs.", name, busy, idle, blocked);
+}
+
+static void anno_pool_stage_report(const char *name, struct thread_pool *p)
+{
+    struct thread_pool_stat s;
+    thread_pool_stat(p, &s);
+    anno_stats_stage(name, thread_pool_size(p), s.busy*1e-6, s.idle*1e-6, s.blocked*1e-6);
+    if ( quiet_mode == 0 )
+        LOG_print("Stage %-8s : %d threads, busy %.2fs, idle %.2fs, blocked %.2fs.", name, thread_pool_size(p), s.busy*1e-6, s.idle*1e-6, s.blocked*1e-6);
+}
+
+static void anno_steal_stage_report(const char *name, struct steal_pool *p)
+{
+    struct thread_pool_stat s;
+    uint64_t n_spawn, n_steal;
+    steal_pool_stat(p, &s);
+    steal_pool_counts(p, &n_spawn, &n_steal);
+    anno_stats_stage(name, steal_pool_size(p), s.busy*1e-6, s.idle*1e-6, s.blocked*1e-6);
+    if ( quiet_mode == 0 )
+        LOG_print("Stage %-8s : %d threads, busy %.2fs, idle %.2fs, %llu sub-tasks spawned, %llu jobs stolen.", name, steal_pool_size(p), s.busy*1e-6, s.idle*1e-6, (unsigned long long)n_spawn, (unsigned long long)n_steal);
+}
+
 int annotate_light()
 {
     struct anno_index *idx = args.indexs[0];
+    // stages run in turn in one thread, so none is idle or blocked
+    double read_time = 0, anno_time = 0, write_time = 0, t0, t1;
 
-    if ( args.input_unsorted == 1 ) {
-        bcf1_t *line = bcf_init();
-        int j;
-        while ( bcf_read(args.fp_input, args.hdr, line) == 0 ) {
-            args.total_record ++;
-            if ( line->rid == -1 ) goto output_line;
-            if ( bcf_get_variant_types(line) == VCF_REF) goto output_line;
-
-            //if ( idx->hgvs )
-            //  anno_hgvs_core(idx->hgvs, idx->hdr_out, line);
-            
-            for ( j = 0; j < idx->n_vcf; ++j )
-                anno_vcf_core(idx->vcf_files[j], idx->hdr_out, line);
-            
-            for ( j = 0; j < idx->n_bed; ++j )
-                anno_bed_core(idx->bed_files[j], idx->hdr_out, line);
+    if ( args.input_unsorted == 1 ) anno_sort_prepare();
 
-            if ( args.flank_seq_is_need == 1 && idx->seqidx ) bcf_add_flankseq(idx->seqidx, idx->hdr_out, line);
-          output_line:
-            bcf_write1(args.fp_out, args.hdr, line);
+    for ( ;; ) {
+        int n, i;
+        t0 = anno_now();
+        struct anno_pool *pool = anno_next_pool(&n);
+        t1 = anno_now();
+        read_time += t1 - t0;
+        if ( n == 0 ) {
+            anno_pool_release(pool);
+            break;
+        }
+        info_batch_begin(idx->batch);
+        anno_pool_annotate(idx, pool);
+        info_batch_end(idx->batch);
+        anno_tune_flush(&idx->tune);
+        t0 = anno_now();
+        anno_time += t0 - t1;
+        if ( args.input_unsorted == 1 )
+            anno_sort_restore(args.sort, pool);
+        else {
+            for ( i = 0; i < pool->n_reader; ++i)
+                bcf_write1(args.fp_out, args.hdr, pool->readers[i]);
         }
+        anno_pool_release(pool);
+        write_time += anno_now() - t0;
     }
-    else {
+
+    if ( args.input_unsorted == 1 ) {
+        t0 = anno_now();
+        anno_sort_finish();
+        write_time += anno_now() - t0;
+    }
+    anno_stage_report("read", read_time, 0, 0);
+    anno_stage_report("annotate", anno_time, 0, 0);
+    anno_stage_report("write", write_time, 0, 0);
+    
+    return 0;
+}
+
+// Annotate a region task into its temporary segment.
+void *anno_shard_core(void *arg, int idx)
+{
+    struct shard_task *task = (struct shard_task*) arg;
+    struct anno_index *index = args.indexs[idx];
+    int i, j;
+    if ( args.shard_fps[idx] == NULL ) {
+        args.shard_fps[idx] = hts_open(args.fname_input, "r");
+        if ( args.shard_fps[idx] == NULL ) error("Failed to open %s.", args.fname_input);
+    }
+    htsFile *fp = args.shard_fps[idx];
+    htsFile *out = anno_shard_open(task, hts_bcf_wmode(args.output_type));
+
+    for ( i = 0; i < task->n_reg; ++i ) {
+        struct shard_region *reg = &task->regs[i];
+        hts_itr_t *itr = args.tbx ? tbx_itr_queryi(args.tbx, reg->tid, reg->beg, reg->end) : bcf_itr_queryi(args.idx, reg->tid, reg->beg, reg->end);
+        if ( itr == NULL ) continue;
         for ( ;; ) {
-            struct anno_pool *pool = anno_reader(args.fp_input, args.hdr, args.n_record);
-            args.total_record += (uint64_t)pool->n_reader;
-            if ( pool == 0 || pool->n_reader == 0) break;
-            int i;
-            for ( ;; ) {
-                if ( pool->n_chunk == pool->n_reader ) break;
-                update_chunk_region(pool);
-
-                //  if ( idx->hgvs )
-                //  anno_hgvs_chunk(idx->hgvs, idx->hdr_out, pool);
-                if ( idx->mc_file )
-                    anno_mc_chunk(idx->mc_file, idx->hdr_out, pool);
-                
-                for ( i = 0; i < idx->n_vcf; ++i )
-                    anno_vcf_chunk(idx->vcf_files[i], idx->hdr_out, pool);
-                for ( i = 0; i < idx->n_bed; ++i )                
-                    anno_bed_chunk(idx->bed_files[i], idx->hdr_out, pool);
-            }
-            if ( args.flank_seq_is_need == 1 && idx->seqidx ) {
-                for ( i = 0; i < pool->n_reader; ++i) 
-                    bcf_add_flankseq(idx->seqidx, idx->hdr_out, pool->readers[i]);                
-            }
-            for ( i = 0; i < pool->n_reader; ++i) {
-                bcf_write1(args.fp_out, args.hdr, pool->readers[i]);
-                bcf_destroy(pool->readers[i]);
+            struct anno_pool *pool = anno_reader_region(fp, args.tbx, itr, reg->beg, args.n_record);
+            if ( pool->n_lines > 0 && anno_pool_parse(pool, args.hdr) )
+                error("Failed to parse input VCF record.");
+            if ( pool->n_reader == 0 ) {
+                anno_pool_release(pool);
+                break;
             }
-            free(pool->readers);                
+            anno_hdr_rdlock();
+            info_batch_begin(index->batch);
+            anno_pool_annotate(index, pool);
+            info_batch_end(index->batch);
+            for ( j = 0; j < pool->n_reader; ++j )
+                if ( bcf_write1(out, args.hdr, pool->readers[j]) )
+                    error("Failed to write temporary segment %s.", task->fname);
+            anno_hdr_unlock();
+            task->n_record += pool->n_reader;
+            anno_pool_release(pool);
         }
+        hts_itr_destroy(itr);
     }
-    
+    if ( hts_close(out) ) error("Failed to close temporary segment %s.", task->fname);
+    return task;
+}
+
+static void anno_shard_write(struct shard_task *task)
+{
+    if ( anno_shard_append(args.fp_out, task) )
+        error("Failed to write output.");
+    args.total_record += task->n_record;
+}
+
+// Annotate region tasks in threads, the segments are appended to output in order.
+int annotate_shard()
+{
+    int i, n_task;
+    // several tasks per thread, so a slow region does not hold the others
+    struct shard_task *tasks = anno_shard_plan(args.tbx ? args.tbx->idx : args.idx, args.tbx, args.hdr, args.i_part, args.n_part, args.n_thread*4, &n_task);
+    if ( quiet_mode == 0 ) {
+        if ( args.n_part > 1 )
+            LOG_print("Annotate partition %d/%d of input.", args.i_part+1, args.n_part);
+        LOG_print("Split input into %d region tasks.", n_task);
+    }
+
+    args.shard_fps = calloc(args.n_thread, sizeof(htsFile*));
+    struct thread_pool *p = thread_pool_init(args.n_thread);
+    struct thread_pool_process *q = thread_pool_process_init(p, args.n_thread*2, 0);
+    struct thread_pool_result  *r;
+    int n_done = 0;
+    double append_time = 0, wait_time = 0, t0;
+
+    for ( i = 0; i < n_task; ++i ) {
+        int ret;
+        while ( (ret = thread_pool_dispatch3(p, q, anno_shard_core, &tasks[i], &r)) == 1 ) {
+            t0 = anno_now();
+            anno_shard_write(r->data);
+            append_time += anno_now() - t0;
+            thread_pool_delete_result(r, 0);
+            n_done++;
+        }
+        if ( ret == -1 ) error("Failed to dispatch region tasks to thread pool.");
+    }
+    while ( n_done < n_task ) {
+        t0 = anno_now();
+        if ( (r = thread_pool_next_result_wait(q)) == NULL )
+            error("Failed to retrieve annotated segments from thread pool.");
+        wait_time += anno_now() - t0;
+        t0 = anno_now();
+        anno_shard_write(r->data);
+        append_time += anno_now() - t0;
+        thread_pool_delete_result(r, 0);
+        n_done++;
+    }
+    anno_pool_stage_report("annotate", p);
+    anno_stage_report("append", append_time, wait_time, thread_pool_process_blocked(q)*1e-6);
+    thread_pool_process_destroy(q);
+    thread_pool_destroy(p);
+
+    for ( i = 0; i < args.n_thread; ++i )
+        if ( args.shard_fps[i] ) hts_close(args.shard_fps[i]);
+    free(args.shard_fps);
+    anno_shard_tasks_destroy(tasks, n_task);
     return 0;
 }
 
@@ -537,61 +1258,117 @@ int annotate()
 {
     if ( args.test_databases_only == 1) return 0;
 
+    if ( args.shard_by_region == 1 ) return annotate_shard();
+
     // lightweight mode
     if ( args.n_thread == 1 ) return annotate_light();
 
-    // keep 1 thread to maintain main stream    
-    args.n_thread = args.n_thread-1;
+    // keep threads for main stream, writer and BGZF pool, see parse_args()
+    args.n_thread = args.n_thread - 2 - args.n_bgzf;
+    if ( args.n_thread < 1 ) args.n_thread = 1;
     
     // multi thread mode
-    struct thread_pool *p = thread_pool_init(args.n_thread);
-    struct thread_pool_process *q = thread_pool_process_init(p, args.n_thread*2, 0);
-    struct thread_pool_result  *r;
+    args.steal = steal_pool_init(args.n_thread, args.n_thread*2, anno_finish);
+    args.task_graph = anno_graph_check(args.indexs[0]);
+    atomic_init(&args.n_graph, 0);
+    void *data;
+
+    // writer stage
+    struct thread_pool *wp = thread_pool_init(1);
+    struct thread_pool_process *wq = thread_pool_process_init(wp, args.n_thread*2, 1);
+
+    double read_time = 0, wait_time = 0, t0;
 
+    if ( args.input_unsorted == 1 ) anno_sort_prepare();
+    
     for ( ;; ) {
-        struct anno_pool *arg = anno_reader(args.fp_input, args.hdr, args.n_record);
-        args.total_record += (uint64_t)arg->n_reader;
-        if ( arg->n_reader == 0 )
+        int n;
+        t0 = anno_now();
+        struct anno_pool *arg = anno_next_pool(&n);
+        read_time += anno_now() - t0;
+        if ( n == 0 ) {
+            anno_pool_release(arg);
             break;
-        
-        int block;
-        do {
-            block = thread_pool_dispatch2(p, q, anno_core, arg, 1);
-            if ( (r = thread_pool_next_result(q))) {
-                struct anno_pool *d = (struct anno_pool*)r->data;
-                int i;
-                for ( i = 0; i < d->n_reader; ++i) {
-                    bcf_write1(args.fp_out, args.hdr, d->readers[i]);
-                    bcf_destroy(d->readers[i]);
-                }
-                free(d->readers);                
-                thread_pool_delete_result(r, 1);
-            }
-        } while (block == -1);
+        }
+
+        // sleep until a result slot is free, and pass ordered results to writer meanwhile
+        while ( steal_pool_submit(args.steal, anno_core, arg, &data) == 1 )
+            thread_pool_dispatch(wp, wq, anno_writer, data);
     }
 
-    thread_pool_process_flush(q);
-    while (( r = thread_pool_next_result(q) )) {
-        struct anno_pool *d = (struct anno_pool*)r->data;
-        int i;
-        for ( i = 0; i < d->n_reader; ++i) {
-            bcf_write1(args.fp_out, args.hdr, d->readers[i]);
-            bcf_destroy(d->readers[i]);
-        }
-        free(d->readers);
-        thread_pool_delete_result(r, 1);
+    for ( ;; ) {
+        t0 = anno_now();
+        if ( steal_pool_next_result_wait(args.steal, &data) ) break;
+        wait_time += anno_now() - t0;
+        thread_pool_dispatch(wp, wq, anno_writer, data);
     }
-    thread_pool_process_destroy(q);
-    thread_pool_destroy(p);
+    thread_pool_process_flush(wq);
+    // main thread blocks on full slots of annotate stage and full queue of write stage
+    anno_stage_report("read", read_time, wait_time, (steal_pool_submit_blocked(args.steal) + thread_pool_process_blocked(wq))*1e-6);
+    anno_steal_stage_report("annotate", args.steal);
+    if ( quiet_mode == 0 && args.task_graph == 1 )
+        LOG_print("Stage %-8s : %llu small ranges annotated by %d concurrent annotators.", "graph", (unsigned long long)atomic_load(&args.n_graph), anno_annotator_count(args.indexs[0]));
+    anno_pool_stage_report("write", wp);
+    thread_pool_process_destroy(wq);
+    thread_pool_destroy(wp);
+    steal_pool_destroy(args.steal);
+    args.steal = NULL;
+    anno_graph_batches_destroy();
+
+    if ( args.input_unsorted == 1 ) anno_sort_finish();
 
     return 0;
 }
 
-#include <time.h>
+// Sum the counters of each annotator over threads for --stats, before the handlers are released.
+static void anno_stats_collect()
+{
+    int i, j, k;
+    struct anno_stat s;
+    if ( args.n_index == 0 ) return;
+    struct anno_index *index = args.indexs[0];
+    int n = anno_annotator_count(index);
+    for ( k = 0; k < n; ++k ) {
+        memset(&s, 0, sizeof(s));
+        for ( i = 0; i < args.n_index; ++i ) {
+            struct anno_index *d = args.indexs[i];
+            switch ( anno_annotator_type(d, k, &j) ) {
+                case ANNOTATOR_GEA:
+                    anno_mc_file_stat(d->mc_file, &s);
+                    break;
+                case ANNOTATOR_VCF:
+                    anno_vcf_file_stat(d->vcf_files[j], &s);
+                    break;
+                default:
+                    anno_bed_file_stat(d->bed_files[j], &s);
+            }
+        }
+        switch ( anno_annotator_type(index, k, &j) ) {
+            case ANNOTATOR_GEA:
+                anno_stats_annotator("gea", index->mc_file->h->data_fname, &s);
+                break;
+            case ANNOTATOR_VCF:
+                anno_stats_annotator("vcf", index->vcf_files[j]->fname, &s);
+                break;
+            default:
+                anno_stats_annotator("bed", index->bed_files[j]->fname, &s);
+        }
+    }
+    if ( args.flank_seq_is_need == 1 && index->seqidx ) {
+        memset(&s, 0, sizeof(s));
+        for ( i = 0; i < args.n_index; ++i ) anno_stat_add(&s, &args.indexs[i]->flank_stat);
+        anno_stats_annotator("flank", args.config->reference_path, &s);
+    }
+}
 
 int main(int argc, char **argv)
 {
-    clock_t t = clock();
+    extern int bcfanno_merge(int argc, char **argv);
+    
+    anno_stats_start();
+
+    if ( argc > 1 && strcmp(argv[1], "merge") == 0 )
+        return bcfanno_merge(argc-1, argv+1);
     
     if ( parse_args(argc, argv) )
         return 1;
@@ -599,12 +1376,16 @@ int main(int argc, char **argv)
     if ( annotate() )
         return 1;
 
+    if ( anno_stats_enabled() ) {
+        anno_stats_collect();
+        anno_stats_write(BCFANNO_VERSION, args.commands.s, args.n_index, args.total_record);
+    }
+
     memory_release();
 
     if ( quiet_mode == 0 ) {
-        t = clock() -t;
-        double time_taken = ((double)t)/CLOCKS_PER_SEC;
-        LOG_print("Annotate %lld records in %.2f seconds.", args.total_record, time_taken);
+        if ( anno_tune_enabled() ) anno_tune_report();
+        LOG_print("Annotate %llu records in %.2f seconds, CPU time %.2f seconds. Record pool reuse rate %.2f%%.", (unsigned long long)args.total_record, anno_stats_wall(), anno_stats_cpu(), anno_pool_reuse_rate());
     }
     return 0;
 }
@@ -0,0 +1,462 @@
+// bcfanno_merge.c - Combine the outputs of bcfanno --shard i/N
+#include "utils.h"
+#include "anno_shard.h"
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "htslib/bgzf.h"
+#include "htslib/hfile.h"
+#include "htslib/tbx.h"
+#include "htslib/kstring.h"
+#include "htslib/khash.h"
+#include "htslib/khash_str2int.h"
+#include "htslib/hts_endian.h"
+
+static int merge_usage()
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About : Concatenate outputs of bcfanno --shard i/N in order. BGZF blocks are copied without decompression.\n");
+    fprintf(stderr, "Usage : bcfanno merge -o out.bcf part1.bcf part2.bcf ...\n");
+    fprintf(stderr, "   -o, --output <file>            write output to a file [standard output]\n");
+    fprintf(stderr, "   --no-index                     do not build CSI (BCF) or TBI (VCF) index for output file\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Index of the parts (part.bcf.csi or part.vcf.gz.tbi) are combined for output if all exist,\n");
+    fprintf(stderr, "otherwise the output is read again to build the index.\n");
+    fprintf(stderr, "\n");
+    return 1;
+}
+
+// Header text without the command lines of bcfanno, which are different between the parts.
+static void merge_header_text(bcf_hdr_t *hdr, kstring_t *str)
+{
+    kstring_t tmp = {0,0,0};
+    if ( bcf_hdr_format(hdr, 0, &tmp) ) error("Failed to format header.");
+    str->l = 0;
+    char *p = tmp.s;
+    while ( *p ) {
+        char *q = strchr(p, '\n');
+        q = q ? q + 1 : p + strlen(p);
+        if ( strncmp(p, "##bcfannoCommand=", 17) != 0 ) kputsn(p, q - p, str);
+        p = q;
+    }
+    free(tmp.s);
+}
+
+// Chunks of one bin of a part index, the meta bin keeps the offsets of contig and the numbers of
+// records instead.
+struct merge_bin {
+    uint64_t loff;
+    int n, m;
+    hts_pair64_t *list;
+};
+
+KHASH_MAP_INIT_INT(merge_bin, struct merge_bin)
+
+struct merge_ref {
+    // contig name of TBI, CSI of BCF uses the contig ids of header
+    char *name;
+    khash_t(merge_bin) *bins;
+    // linear index of TBI
+    int n_intv;
+    uint64_t *intv;
+};
+
+// CSI or TBI index combined from the parts.
+struct merge_index {
+    int fmt, min_shift, n_lvls;
+    // configure of TBI, format, col_seq, col_beg, col_end, meta and skip
+    uint8_t conf[24];
+    int n_ref, m_ref;
+    struct merge_ref *refs;
+    void *names;
+    uint64_t n_no_coor;
+};
+
+// Virtual offsets of a part in the output. Blocks after the header are copied, so offsets move
+// by whole blocks; the records in the same block with the header are compressed again, pieces of
+// them are mapped one by one.
+struct merge_offset {
+    uint64_t hdr_block, next_block, out_base;
+    int n_piece;
+    struct {
+        uint32_t in;
+        uint64_t out;
+    } piece[4];
+};
+
+static uint64_t merge_offset_map(const struct merge_offset *m, uint64_t voff)
+{
+    uint64_t c = voff >> 16, u = voff & 0xffff;
+    if ( c >= m->next_block || m->n_piece == 0 ) {
+        if ( c < m->next_block ) return m->out_base << 16;
+        return (c - m->next_block + m->out_base) << 16 | u;
+    }
+    int i = m->n_piece - 1;
+    while ( i > 0 && m->piece[i].in > u ) i--;
+    return m->piece[i].out + (u - m->piece[i].in);
+}
+
+static int merge_read(BGZF *fp, void *buf, int l)
+{
+    return bgzf_read(fp, buf, l) == l ? 0 : -1;
+}
+
+static int merge_read_u32(BGZF *fp, uint32_t *v)
+{
+    uint8_t buf[4];
+    if ( merge_read(fp, buf, 4) ) return -1;
+    *v = le_to_u32(buf);
+    return 0;
+}
+
+static int merge_read_u64(BGZF *fp, uint64_t *v)
+{
+    uint8_t buf[8];
+    if ( merge_read(fp, buf, 8) ) return -1;
+    *v = le_to_u64(buf);
+    return 0;
+}
+
+static struct merge_ref *merge_index_ref(struct merge_index *idx, int tid, const char *name)
+{
+    if ( name ) {
+        if ( khash_str2int_get(idx->names, name, &tid) == 0 ) return &idx->refs[tid];
+        tid = idx->n_ref;
+    }
+    if ( tid >= idx->m_ref ) {
+        int m = idx->m_ref;
+        idx->m_ref = tid + 1 > m*2 ? tid + 1 : m*2;
+        idx->refs = realloc(idx->refs, idx->m_ref*sizeof(struct merge_ref));
+        memset(idx->refs + m, 0, (idx->m_ref - m)*sizeof(struct merge_ref));
+    }
+    if ( tid >= idx->n_ref ) idx->n_ref = tid + 1;
+    struct merge_ref *ref = &idx->refs[tid];
+    if ( name ) {
+        ref->name = strdup(name);
+        khash_str2int_set(idx->names, ref->name, tid);
+    }
+    if ( ref->bins == NULL ) ref->bins = kh_init(merge_bin);
+    return ref;
+}
+
+// Add the index of one part, offsets are mapped to the output. Return -1 if the index can not be
+// read, or is different from the former parts.
+static int merge_index_add(struct merge_index *idx, const char *fn, int i_part, const struct merge_offset *map)
+{
+    BGZF *fp = bgzf_open(fn, "r");
+    if ( fp == NULL ) return -1;
+    int ret = -1;
+    char magic[4];
+    uint32_t min_shift = 14, n_lvls = 5, l_meta, n_ref, l_nm = 0, i, j, k;
+    uint8_t conf[28] = {0};
+    char *names = NULL;
+    if ( merge_read(fp, magic, 4) ) goto fail;
+    int fmt = memcmp(magic, "CSI\1", 4) == 0 ? HTS_FMT_CSI : memcmp(magic, "TBI\1", 4) == 0 ? HTS_FMT_TBI : -1;
+    if ( fmt == HTS_FMT_CSI ) {
+        // CSI of tabix keeps contig names in the meta, only the CSI of BCF is combined
+        if ( merge_read_u32(fp, &min_shift) || merge_read_u32(fp, &n_lvls) || merge_read_u32(fp, &l_meta) || l_meta ) goto fail;
+        if ( merge_read_u32(fp, &n_ref) ) goto fail;
+    }
+    else if ( fmt == HTS_FMT_TBI ) {
+        if ( merge_read_u32(fp, &n_ref) || merge_read(fp, conf, 28) ) goto fail;
+        l_nm = le_to_u32(conf + 24);
+        names = malloc(l_nm + 1);
+        if ( merge_read(fp, names, l_nm) ) goto fail;
+        names[l_nm] = 0;
+    }
+    else goto fail;
+
+    if ( i_part == 0 ) {
+        idx->fmt = fmt;
+        idx->min_shift = min_shift;
+        idx->n_lvls = n_lvls;
+        memcpy(idx->conf, conf, 24);
+        idx->names = khash_str2int_init();
+    }
+    else if ( idx->fmt != fmt || idx->min_shift != min_shift || idx->n_lvls != n_lvls || (fmt == HTS_FMT_TBI && memcmp(idx->conf, conf, 24)) )
+        goto fail;
+
+    uint32_t meta_bin = ((1u << (3*n_lvls + 3)) - 1) / 7 + 1;
+    char *name = names;
+    for ( i = 0; i < n_ref; ++i ) {
+        if ( fmt == HTS_FMT_TBI && name >= names + l_nm ) goto fail;
+        struct merge_ref *ref = merge_index_ref(idx, i, fmt == HTS_FMT_TBI ? name : NULL);
+        if ( fmt == HTS_FMT_TBI ) name += strlen(name) + 1;
+        uint32_t n_bin;
+        if ( merge_read_u32(fp, &n_bin) ) goto fail;
+        for ( j = 0; j < n_bin; ++j ) {
+            uint32_t bin, n_chunk;
+            uint64_t loff = 0;
+            if ( merge_read_u32(fp, &bin) ) goto fail;
+            if ( fmt == HTS_FMT_CSI && merge_read_u64(fp, &loff) ) goto fail;
+            if ( merge_read_u32(fp, &n_chunk) || n_chunk > INT32_MAX/16 ) goto fail;
+            if ( loff ) loff = merge_offset_map(map, loff);
+
+            int absent;
+            khint_t kh = kh_put(merge_bin, ref->bins, bin, &absent);
+            struct merge_bin *b = &kh_val(ref->bins, kh);
+            if ( absent ) {
+                memset(b, 0, sizeof(*b));
+                b->loff = loff;
+            }
+            else if ( loff < b->loff ) b->loff = loff;
+            if ( b->n + n_chunk > b->m ) {
+                b->m = b->n + n_chunk;
+                b->list = realloc(b->list, b->m*sizeof(hts_pair64_t));
+            }
+            hts_pair64_t *chunks = b->list + b->n;
+            for ( k = 0; k < n_chunk; ++k )
+                if ( merge_read_u64(fp, &chunks[k].u) || merge_read_u64(fp, &chunks[k].v) ) goto fail;
+            if ( bin == meta_bin ) {
+                // offsets of the contig and the numbers of mapped and unmapped records
+                if ( n_chunk != 2 ) goto fail;
+                chunks[0].u = merge_offset_map(map, chunks[0].u);
+                chunks[0].v = merge_offset_map(map, chunks[0].v);
+                if ( b->n ) {
+                    if ( chunks[0].v > b->list[0].v ) b->list[0].v = chunks[0].v;
+                    b->list[1].u += chunks[1].u;
+                    b->list[1].v += chunks[1].v;
+                }
+                else b->n = 2;
+                continue;
+            }
+            for ( k = 0; k < n_chunk; ++k ) {
+                chunks[k].u = merge_offset_map(map, chunks[k].u);
+                chunks[k].v = merge_offset_map(map, chunks[k].v);
+            }
+            b->n += n_chunk;
+        }
+        if ( fmt == HTS_FMT_TBI ) {
+            uint32_t n_intv;
+            if ( merge_read_u32(fp, &n_intv) || n_intv > INT32_MAX/8 ) goto fail;
+            if ( n_intv > ref->n_intv ) {
+                ref->intv = realloc(ref->intv, n_intv*sizeof(uint64_t));
+                memset(ref->intv + ref->n_intv, 0, (n_intv - ref->n_intv)*sizeof(uint64_t));
+                ref->n_intv = n_intv;
+            }
+            // the smallest offset of records in each interval, zero for no records
+            for ( k = 0; k < n_intv; ++k ) {
+                uint64_t off;
+                if ( merge_read_u64(fp, &off) ) goto fail;
+                if ( off == 0 ) continue;
+                off = merge_offset_map(map, off);
+                if ( ref->intv[k] == 0 || off < ref->intv[k] ) ref->intv[k] = off;
+            }
+        }
+    }
+    uint64_t n_no_coor;
+    if ( merge_read_u64(fp, &n_no_coor) == 0 ) idx->n_no_coor += n_no_coor;
+    ret = 0;
+
+  fail:
+    free(names);
+    if ( bgzf_close(fp) ) ret = -1;
+    return ret;
+}
+
+static int merge_write_u32(BGZF *fp, uint32_t v)
+{
+    uint8_t buf[4];
+    u32_to_le(v, buf);
+    return bgzf_write(fp, buf, 4) == 4 ? 0 : -1;
+}
+
+static int merge_write_u64(BGZF *fp, uint64_t v)
+{
+    uint8_t buf[8];
+    u64_to_le(v, buf);
+    return bgzf_write(fp, buf, 8) == 8 ? 0 : -1;
+}
+
+static int merge_index_save(struct merge_index *idx, const char *fn)
+{
+    BGZF *fp = bgzf_open(fn, "w");
+    if ( fp == NULL ) return -1;
+    int i, j, ret = -1;
+    if ( idx->fmt == HTS_FMT_CSI ) {
+        if ( bgzf_write(fp, "CSI\1", 4) != 4 || merge_write_u32(fp, idx->min_shift) || merge_write_u32(fp, idx->n_lvls) || merge_write_u32(fp, 0) )
+            goto fail;
+        if ( merge_write_u32(fp, idx->n_ref) ) goto fail;
+    }
+    else {
+        uint32_t l_nm = 0;
+        for ( i = 0; i < idx->n_ref; ++i ) l_nm += strlen(idx->refs[i].name) + 1;
+        if ( bgzf_write(fp, "TBI\1", 4) != 4 || merge_write_u32(fp, idx->n_ref) || bgzf_write(fp, idx->conf, 24) != 24 || merge_write_u32(fp, l_nm) )
+            goto fail;
+        for ( i = 0; i < idx->n_ref; ++i )
+            if ( bgzf_write(fp, idx->refs[i].name, strlen(idx->refs[i].name) + 1) < 0 ) goto fail;
+    }
+    for ( i = 0; i < idx->n_ref; ++i ) {
+        struct merge_ref *ref = &idx->refs[i];
+        khint_t k;
+        if ( merge_write_u32(fp, ref->bins ? kh_size(ref->bins) : 0) ) goto fail;
+        if ( ref->bins ) {
+            for ( k = kh_begin(ref->bins); k != kh_end(ref->bins); ++k ) {
+                if ( !kh_exist(ref->bins, k) ) continue;
+                struct merge_bin *b = &kh_val(ref->bins, k);
+                if ( merge_write_u32(fp, kh_key(ref->bins, k)) ) goto fail;
+                if ( idx->fmt == HTS_FMT_CSI && merge_write_u64(fp, b->loff) ) goto fail;
+                if ( merge_write_u32(fp, b->n) ) goto fail;
+                for ( j = 0; j < b->n; ++j )
+                    if ( merge_write_u64(fp, b->list[j].u) || merge_write_u64(fp, b->list[j].v) ) goto fail;
+            }
+        }
+        if ( idx->fmt == HTS_FMT_TBI ) {
+            if ( merge_write_u32(fp, ref->n_intv) ) goto fail;
+            // intervals without records of any part point to the next records, as tabix does
+            for ( j = ref->n_intv - 2; j >= 0; --j )
+                if ( ref->intv[j] == 0 ) ref->intv[j] = ref->intv[j+1];
+            for ( j = 0; j < ref->n_intv; ++j )
+                if ( merge_write_u64(fp, ref->intv[j]) ) goto fail;
+        }
+    }
+    if ( merge_write_u64(fp, idx->n_no_coor) ) goto fail;
+    ret = 0;
+
+  fail:
+    if ( bgzf_close(fp) ) ret = -1;
+    return ret;
+}
+
+static void merge_index_destroy(struct merge_index *idx)
+{
+    int i;
+    for ( i = 0; i < idx->n_ref; ++i ) {
+        struct merge_ref *ref = &idx->refs[i];
+        if ( ref->bins ) {
+            khint_t k;
+            for ( k = kh_begin(ref->bins); k != kh_end(ref->bins); ++k )
+                if ( kh_exist(ref->bins, k) ) free(kh_val(ref->bins, k).list);
+            kh_destroy(merge_bin, ref->bins);
+        }
+        free(ref->intv);
+        free(ref->name);
+    }
+    free(idx->refs);
+    if ( idx->names ) khash_str2int_destroy(idx->names);
+    memset(idx, 0, sizeof(*idx));
+}
+
+int bcfanno_merge(int argc, char **argv)
+{
+    const char *fname_output = NULL;
+    int build_index = 1;
+    int i, n_input = 0;
+    const char **inputs = malloc(argc*sizeof(char*));
+    for ( i = 1; i < argc; ) {
+        const char *a = argv[i++];
+        if ( strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0 ) {
+            free(inputs);
+            return merge_usage();
+        }
+        if ( strcmp(a, "--no-index") == 0 ) {
+            build_index = 0;
+            continue;
+        }
+        if ( strcmp(a, "-o") == 0 || strcmp(a, "--output") == 0 ) {
+            if ( i == argc ) error("Missing an argument after %s", a);
+            fname_output = argv[i++];
+            continue;
+        }
+        if ( a[0] == '-' && a[1] ) error("Unknown parameter. %s", a);
+        inputs[n_input++] = a;
+    }
+    if ( n_input == 0 ) {
+        free(inputs);
+        return merge_usage();
+    }
+
+    htsFile *out = NULL;
+    bcf_hdr_t *hdr0 = NULL;
+    kstring_t text0 = {0,0,0}, text = {0,0,0};
+    enum htsExactFormat format = unknown_format;
+    struct merge_offset *maps = calloc(n_input, sizeof(struct merge_offset));
+    if ( build_index && fname_output == NULL ) {
+        warnings("Output is written to standard output, index is not built.");
+        build_index = 0;
+    }
+    for ( i = 0; i < n_input; ++i ) {
+        htsFile *fp = hts_open(inputs[i], "r");
+        if ( fp == NULL ) error("Failed to open %s.", inputs[i]);
+        const htsFormat *type = hts_get_format(fp);
+        if ( (type->format != vcf && type->format != bcf) || type->compression != bgzf )
+            error("Only BGZF compressed BCF or VCF is supported. %s", inputs[i]);
+        bcf_hdr_t *hdr = bcf_hdr_read(fp);
+        if ( hdr == NULL ) error("Failed to parse header of %s.", inputs[i]);
+
+        if ( i == 0 ) {
+            format = type->format;
+            hdr0 = hdr;
+            merge_header_text(hdr0, &text0);
+            out = hts_open(fname_output ? fname_output : "-", format == bcf ? "wb" : "wz");
+            if ( out == NULL ) error("Failed to open %s.", fname_output ? fname_output : "-");
+            if ( bcf_hdr_write(out, hdr0) ) error("Failed to write header.");
+        }
+        else {
+            if ( type->format != format ) error("Format of %s is different from %s.", inputs[i], inputs[0]);
+            merge_header_text(hdr, &text);
+            if ( text.l != text0.l || memcmp(text.s, text0.s, text.l) != 0 )
+                error("Header of %s is different from %s.", inputs[i], inputs[0]);
+            bcf_hdr_destroy(hdr);
+        }
+
+        // records in the same block with the header are compressed again, the following
+        // blocks are copied as they are
+        BGZF *bgzf = fp->fp.bgzf;
+        BGZF *bgzf_out = out->fp.bgzf;
+        struct merge_offset *map = &maps[i];
+        map->hdr_block = bgzf->block_address;
+        while ( bgzf->block_offset < bgzf->block_length ) {
+            // pieces end at the blocks of output
+            int l = bgzf->block_length - bgzf->block_offset;
+            if ( l > BGZF_BLOCK_SIZE - bgzf_out->block_offset ) l = BGZF_BLOCK_SIZE - bgzf_out->block_offset;
+            map->piece[map->n_piece].in = bgzf->block_offset;
+            map->piece[map->n_piece].out = bgzf_tell(bgzf_out);
+            map->n_piece++;
+            if ( bgzf_write(bgzf_out, (char*)bgzf->uncompressed_block + bgzf->block_offset, l) < 0 )
+                error("Failed to write output.");
+            bgzf->block_offset += l;
+        }
+        if ( bgzf_flush(bgzf_out) ) error("Failed to write output.");
+        map->next_block = htell(bgzf->fp);
+        map->out_base = htell(bgzf_out->fp);
+        if ( anno_shard_copy_blocks(bgzf->fp, bgzf_out->fp, 1) )
+            error("Failed to copy records of %s.", inputs[i]);
+        // blocks are copied under BGZF, keep its offset for the next part
+        bgzf_out->block_address = htell(bgzf_out->fp);
+        hts_close(fp);
+    }
+    if ( hts_close(out) ) error("Failed to close output.");
+    bcf_hdr_destroy(hdr0);
+    free(text0.s);
+    free(text.s);
+
+    if ( build_index ) {
+        // combine the indexes of parts, virtual offsets are moved to the output
+        struct merge_index idx;
+        memset(&idx, 0, sizeof(idx));
+        kstring_t fn = {0,0,0};
+        for ( i = 0; i < n_input; ++i ) {
+            fn.l = 0;
+            ksprintf(&fn, "%s.%s", inputs[i], format == bcf ? "csi" : "tbi");
+            if ( merge_index_add(&idx, fn.s, i, &maps[i]) ) {
+                warnings("Failed to read index %s, build index from the output.", fn.s);
+                break;
+            }
+        }
+        int ret;
+        if ( i == n_input ) {
+            fn.l = 0;
+            ksprintf(&fn, "%s.%s", fname_output, format == bcf ? "csi" : "tbi");
+            ret = merge_index_save(&idx, fn.s);
+        }
+        else {
+            ret = format == bcf ? bcf_index_build(fname_output, 14) : tbx_index_build(fname_output, 0, &tbx_conf_vcf);
+        }
+        if ( ret ) error("Failed to build index for %s.", fname_output);
+        merge_index_destroy(&idx);
+        free(fn.s);
+    }
+    free(maps);
+    free(inputs);
+    return 0;
+}
@@ -26,6 +26,7 @@
 #include "number.h"
 #include "htslib/bgzf.h"
 #include "htslib/khash.h"
+#include "faidx_def.h"
 
 struct faidx_val {
     int32_t line_len, line_blen;
@@ -113,9 +114,31 @@ int trans_retrieve_version(void *_fai, const char *trans)
     return -1;
 }
 
-#ifdef FAIDX_DEF_MAIN
+// Duplicate a faidx handler for another thread. The sequence index is shared with the
+// original handler, only the FASTA file is reopened. Destroy it by faidx_share_destroy()
+// and keep the original handler alive until all the duplicates are destroyed.
+faidx_t *faidx_share(faidx_t *_fai, const char *fn)
+{
+    struct faidx *fai = (struct faidx*)_fai;
+    struct faidx *d = malloc(sizeof(*d));
+    memcpy(d, fai, sizeof(*d));
+    d->bgzf = bgzf_open(fn, "rb");
+    if ( d->bgzf == NULL )
+        error("Failed to open %s : %s.", fn, strerror(errno));
+    if ( d->bgzf->is_compressed == 1 && bgzf_index_load(d->bgzf, fn, ".gzi") < 0 )
+        error("Failed to load .gzi index of %s.", fn);
+    return (faidx_t*)d;
+}
 
-#include "htslib/faidx.h"
+void faidx_share_destroy(faidx_t *_fai)
+{
+    struct faidx *fai = (struct faidx*)_fai;
+    if ( fai == NULL ) return;
+    bgzf_close(fai->bgzf);
+    free(fai);
+}
+
+#ifdef FAIDX_DEF_MAIN
 
 struct args {
     faidx_t *fai;
@@ -0,0 +1,12 @@
+#ifndef FAIDX_DEF_H
+#define FAIDX_DEF_H
+
+#include "htslib/faidx.h"
+
+extern int trans_retrieve_version(void *_fai, const char *trans);
+
+extern faidx_t *faidx_share(faidx_t *fai, const char *fn);
+
+extern void faidx_share_destroy(faidx_t *fai);
+
+#endif
@@ -27,6 +27,7 @@
 #include "htslib/faidx.h"
 #include "htslib/vcf.h"
 #include "anno_flank.h"
+#include "faidx_def.h"
 
 // export flank sequence arount target variant
 static int flank_size = 10;
@@ -47,23 +48,28 @@ struct seqidx* load_sequence_index(const char *file)
         free(idx);
         return NULL;
     }
+    idx->win = seq_window_init(idx->idx, SEQ_WINDOW_SIZE);
     return idx;
 }
+// share the index with the original one, only reopen the sequence file
 struct seqidx *sequence_index_duplicate(struct seqidx *idx)
 {
     if ( idx == NULL ) return NULL;
              
     struct seqidx *d = malloc(sizeof(*d));
     d->file = idx->file;
-    d->idx = fai_load(d->file);
-    assert(d->idx);
+    d->idx = faidx_share(idx->idx, d->file);
+    d->win = seq_window_init(d->idx, SEQ_WINDOW_SIZE);
     return d;
 }
 
-void sequence_index_destroy(struct seqidx *idx)
+// l is the thread index, the shared index is only freed by thread 0
+void sequence_index_destroy(struct seqidx *idx, int l)
 {
     if ( idx ) {
-        fai_destroy(idx->idx);
+        seq_window_destroy(idx->win);
+        if ( l == 0 ) fai_destroy(idx->idx);
+        else faidx_share_destroy(idx->idx);
         free(idx);
     }
 }
@@ -86,7 +92,7 @@ int bcf_add_flankseq(struct seqidx *idx, bcf_hdr_t *hdr, bcf1_t *line)
     int end = line->pos + line->rlen + flank_size;
     int start = line->pos + 1 - flank_size;
     int l_seq = 0;
-    char *seq = faidx_fetch_seq(idx->idx, name, start-1, end-1, &l_seq);
+    char *seq = seq_window_fetch(idx->win, name, start-1, end-1, &l_seq);
     if ( seq == NULL || end - start + 1 != l_seq ) {
         if ( seq ) free(seq);
         return 1;
@@ -111,6 +111,28 @@ int gea_hdr_sync(struct gea_hdr *h)
             h->id[i][kh_val(d,k).id].val = &kh_val(d,k);
         }
     }
+
+    // classify bioTypes once, so records could be checked by id
+    h->biotype_flags = realloc(h->biotype_flags, h->n[GEA_DT_BIOTYPE] + 1);
+    h->mrna_id = h->nrna_id = h->gene_id = -1;
+    for (i = 0; i < h->n[GEA_DT_BIOTYPE]; i++) {
+        const char *key = h->id[GEA_DT_BIOTYPE][i].key;
+        h->biotype_flags[i] = 0;
+        if ( key == NULL ) continue;
+        if ( strcmp(key, "mRNA") == 0 ) {
+            h->mrna_id = i;
+            h->biotype_flags[i] = GEA_BIOTYPE_MRNA;
+        }
+        else if ( strcmp(key, "ncRNA") == 0 ) {
+            h->nrna_id = i;
+            h->biotype_flags[i] = GEA_BIOTYPE_NCRNA;
+        }
+        else if ( strcmp(key, "Gene") == 0 ) {
+            h->gene_id = i;
+            h->biotype_flags[i] = GEA_BIOTYPE_GENE;
+        }
+        else if ( strcmp(key, "TFBS") == 0 ) h->biotype_flags[i] = GEA_BIOTYPE_TFBS;
+    }
     h->dirty = 0;
     return 0;
 }
@@ -770,17 +792,15 @@ void gea_hdr_destroy(struct gea_hdr *h)
         gea_hrec_destroy(h->hrec[i]);
     if (h->n_hrec) free(h->hrec);
     if (h->samples) free(h->samples);
+    if (h->biotype_flags) free(h->biotype_flags);
     //free(h->keep_samples);
     //free(h->transl[0]); free(h->transl[1]);
     free(h->mem.s);
     free(h);
 }
 
-struct gea_hdr *bea_hdr_read(htsFile *hfp)
+struct gea_hdr *bgea_hdr_read(BGZF *fp)
 {
-    if (hfp->is_bgzf == 0) return gea_hdr_read(hfp);
-
-    BGZF *fp = hfp->fp.bgzf;
     uint8_t magic[5];
     struct gea_hdr *h;
     h = gea_hdr_init("r");
@@ -817,6 +837,12 @@ struct gea_hdr *bea_hdr_read(htsFile *hfp)
     return NULL;
 }
 
+struct gea_hdr *bea_hdr_read(htsFile *hfp)
+{
+    if (hfp->is_bgzf == 0) return gea_hdr_read(hfp);
+    return bgea_hdr_read(hfp->fp.bgzf);
+}
+
 int bea_hdr_write(htsFile *hfp, struct gea_hdr *h)
 {
     if (!h) {
@@ -842,6 +868,206 @@ int bea_hdr_write(htsFile *hfp, struct gea_hdr *h)
     return 0;
 }
 
+struct gea_hdr *gea_hdr_duplicate(const struct gea_hdr *hdr)
+{
+    kstring_t htxt = {0,0,0};
+    struct gea_hdr *h = gea_hdr_init("r");
+    if ( h == NULL ) error("Failed to allocate gea header.");
+    gea_hdr_format(hdr, &htxt);
+    if ( gea_hdr_parse(h, htxt.s) < 0 ) {
+        gea_hdr_destroy(h);
+        h = NULL;
+    }
+    free(htxt.s);
+    return h;
+}
+
+// BGEA, binary GEA. Header is written by bea_hdr_write(), followed by records in below layout, all integers
+// are little-endian int32_t.
+//
+//   block_len, the length of this record in bytes, block_len itself excluded
+//   rid, chromStart, chromEnd, strand, biotype, cStart, cEnd, blockCount, n_cigar, n_info, l_shared, l_name,
+//   l_geneName, unpacked, utr5_length, cds_length, reference_length
+//   name[l_name], geneName[l_geneName], l_* is -1 if string is NULL
+//   blockPair[0][blockCount], blockPair[1][blockCount]
+//   cigars[n_cigar], packed same as gea_record::cigars
+//   loc[0][blockCount], loc[1][blockCount], only if BGEA_LOC is set in unpacked
+//   shared[l_shared], encoded INFO
+//
+// Records are stored in the state after gea_unpack(GEA_UN_TRANS|GEA_UN_CIGAR), so reading a BGEA record is
+// only copying arrays. INFO is still decoded lazily by gea_unpack().
+#define BGEA_N_FIXED 17
+#define BGEA_LOC     0x100
+
+static void bgea_put_i32s(kstring_t *s, const int *a, int n)
+{
+    int i;
+    ks_resize(s, s->l + n*4);
+    for ( i = 0; i < n; ++i, s->l += 4 ) i32_to_le(a[i], (uint8_t*)s->s + s->l);
+}
+static void bgea_put_str(kstring_t *s, const char *str, int l)
+{
+    if ( l > 0 ) kputsn(str, l, s);
+}
+static int *bgea_get_i32s(uint8_t **p, int n)
+{
+    int i, *a = (int*)malloc(n*sizeof(int));
+    if ( a == NULL ) error("Failed to allocate memory.");
+    for ( i = 0; i < n; ++i, *p += 4 ) a[i] = le_to_i32(*p);
+    return a;
+}
+static char *bgea_get_str(uint8_t **p, int l)
+{
+    if ( l < 0 ) return NULL;
+    char *s = (char*)malloc(l+1);
+    if ( s == NULL ) error("Failed to allocate memory.");
+    memcpy(s, *p, l);
+    s[l] = '\0';
+    *p += l;
+    return s;
+}
+
+int bgea_write(htsFile *hfp, const struct gea_hdr *hdr, struct gea_record *v)
+{
+    kstring_t *s = &hfp->line;
+    int unpacked = v->unpacked & (GEA_UN_CIGAR|GEA_UN_TRANS);
+    if ( (unpacked & GEA_UN_TRANS) && v->c.loc[0] ) unpacked |= BGEA_LOC;
+    // INFO may be modified after unpack, not support yet
+    if ( v->d.shared_dirty ) return -1;
+
+    int l_name = v->name ? strlen(v->name) : -1;
+    int l_gene = v->geneName ? strlen(v->geneName) : -1;
+    int x[BGEA_N_FIXED+1] = {
+        0, v->rid, v->chromStart, v->chromEnd, v->strand, v->biotype, v->cStart, v->cEnd, v->blockCount,
+        v->n_cigar, v->n_info, v->shared.l, l_name, l_gene, unpacked,
+        v->c.utr5_length, v->c.cds_length, v->c.reference_length,
+    };
+    s->l = 0;
+    bgea_put_i32s(s, x, BGEA_N_FIXED+1);
+    bgea_put_str(s, v->name, l_name);
+    bgea_put_str(s, v->geneName, l_gene);
+    if ( v->blockCount > 0 ) {
+        bgea_put_i32s(s, v->blockPair[0], v->blockCount);
+        bgea_put_i32s(s, v->blockPair[1], v->blockCount);
+    }
+    if ( v->n_cigar > 0 ) bgea_put_i32s(s, v->cigars, v->n_cigar);
+    if ( unpacked & BGEA_LOC ) {
+        bgea_put_i32s(s, v->c.loc[0], v->blockCount);
+        bgea_put_i32s(s, v->c.loc[1], v->blockCount);
+    }
+    bgea_put_str(s, v->shared.s, v->shared.l);
+    i32_to_le(s->l - 4, (uint8_t*)s->s);
+
+    return bgzf_write(hfp->fp.bgzf, s->s, s->l) == s->l ? 0 : -1;
+}
+
+static int bgea_read1(BGZF *fp, struct gea_record *v)
+{
+    uint8_t buf[4], *p;
+    int ret = bgzf_read(fp, buf, 4);
+    if ( ret == 0 ) return -1; // end of file
+    if ( ret != 4 ) return -2;
+    
+    gea_clear(v);
+    
+    uint32_t l = le_to_u32(buf);
+    if ( l < BGEA_N_FIXED*4 ) return -2;
+    kstring_t *s = &v->shared;
+    if ( ks_resize(s, l) ) return -2;
+    if ( bgzf_read(fp, s->s, l) != (ssize_t)l ) return -2;
+
+    p = (uint8_t*)s->s;
+    int x[BGEA_N_FIXED], i;
+    for ( i = 0; i < BGEA_N_FIXED; ++i, p += 4 ) x[i] = le_to_i32(p);
+
+    // lengths and counts should fit in the rest of block, corrupted records are not read
+    int64_t left = l - BGEA_N_FIXED*4;
+    if ( x[0] < 0 || x[7] < 0 || x[8] < 0 || x[9] < 0 || x[10] < 0 || x[11] < -1 || x[12] < -1 ) return -2;
+    int64_t need = (int64_t)x[10] + (x[11] > 0 ? x[11] : 0) + (x[12] > 0 ? x[12] : 0)
+        + (int64_t)x[7]*(x[13] & BGEA_LOC ? 16 : 8) + (int64_t)x[8]*4;
+    if ( need != left ) return -2;
+    v->rid        = x[0];
+    v->chromStart = x[1];
+    v->chromEnd   = x[2];
+    v->strand     = x[3];
+    v->biotype    = x[4];
+    v->cStart     = x[5];
+    v->cEnd       = x[6];
+    v->blockCount = x[7];
+    v->n_cigar    = x[8];
+    v->n_info     = x[9];
+    v->name       = bgea_get_str(&p, x[11]);
+    v->geneName   = bgea_get_str(&p, x[12]);
+    if ( v->blockCount > 0 ) {
+        v->blockPair[0] = bgea_get_i32s(&p, v->blockCount);
+        v->blockPair[1] = bgea_get_i32s(&p, v->blockCount);
+    }
+    if ( v->n_cigar > 0 ) v->cigars = bgea_get_i32s(&p, v->n_cigar);
+    if ( x[13] & BGEA_LOC ) {
+        v->c.loc[0] = bgea_get_i32s(&p, v->blockCount);
+        v->c.loc[1] = bgea_get_i32s(&p, v->blockCount);
+    }
+    v->c.utr5_length      = x[14];
+    v->c.cds_length       = x[15];
+    v->c.reference_length = x[16];
+    v->unpacked = x[13] & (GEA_UN_CIGAR|GEA_UN_TRANS);
+
+    // shared INFO is the tail of this block
+    if ( (char*)p + x[10] != s->s + l ) return -2;
+    memmove(s->s, p, x[10]);
+    s->l = x[10];
+    return 0;
+}
+
+int bgea_read(BGZF *fp, const struct gea_hdr *hdr, struct gea_record *v)
+{
+    int ret = bgea_read1(fp, v);
+    if ( ret < 0 ) return ret;
+    if ( v->rid >= hdr->n[GEA_DT_CTG] ) return -2;
+    return 0;
+}
+
+int bgea_readrec(BGZF *fp, void *data, void *rec, int *tid, int *beg, int *end)
+{
+    struct bgea_tid_map *map = (struct bgea_tid_map*)data;
+    struct gea_record *v = (struct gea_record*)rec;
+    int ret = bgea_read1(fp, v);
+    if ( ret < 0 ) return ret;
+    if ( v->rid >= map->n ) return -2;
+    *tid = map->tids[v->rid];
+    *beg = v->chromStart;
+    *end = v->chromEnd;
+    return 0;
+}
+
+struct bgea_tid_map *bgea_tid_map(const struct gea_hdr *hdr, tbx_t *idx)
+{
+    int i, n = hdr->n[GEA_DT_CTG];
+    struct bgea_tid_map *map = (struct bgea_tid_map*)malloc(sizeof(*map));
+    if ( map == NULL ) error("Failed to allocate memory.");
+    map->n = n;
+    map->tids = (int*)malloc((n > 0 ? n : 1)*sizeof(int));
+    if ( map->tids == NULL ) error("Failed to allocate memory.");
+    for ( i = 0; i < n; ++i ) map->tids[i] = tbx_name2id(idx, hdr->id[GEA_DT_CTG][i].key);
+    return map;
+}
+
+void bgea_tid_map_destroy(struct bgea_tid_map *map)
+{
+    free(map->tids);
+    free(map);
+}
+
+int bgea_check_format(const char *fn)
+{
+    BGZF *fp = bgzf_open(fn, "r");
+    if ( fp == NULL ) return -1;
+    uint8_t magic[5];
+    int ret = bgzf_read(fp, magic, 5) == 5 && memcmp(magic, "BEA\2\2", 5) == 0 ? 0 : -1;
+    bgzf_close(fp);
+    return ret;
+}
+
 int gea_check_format(const char *fn)
 {
     htsFile *fp = hts_open(fn, "r");
@@ -1386,8 +1612,7 @@ int gea_unpack(const struct gea_hdr *hdr, struct gea_record *b, int which)
         b->unpacked |= GEA_UN_CIGAR;
         
         // only consider alignment state of transcript
-        if ( strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "mRNA") != 0 &&
-             strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "ncRNA") != 0 )
+        if ( !gea_is_transcript(hdr, b) )
             return 0; 
 
         // alignmentState
@@ -1457,8 +1682,7 @@ int gea_unpack(const struct gea_hdr *hdr, struct gea_record *b, int which)
     
     if ( which & GEA_UN_TRANS && !(b->unpacked&GEA_UN_TRANS) ) {
         // check if gene
-        if ( strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "mRNA") != 0 &&
-             strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "ncRNA") != 0 )
+        if ( !gea_is_transcript(hdr, b) )
             return 0; 
 
         b->unpacked |= GEA_UN_TRANS;
@@ -1478,7 +1702,7 @@ int gea_unpack(const struct gea_hdr *hdr, struct gea_record *b, int which)
         // int cds_length = 0;
         int loc = 0;
         int exon_start, exon_end, exon_length;
-        int is_coding = strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "mRNA") == 0 ? 1 : 0;
+        int is_coding = gea_is_mrna(hdr, b) ? 1 : 0;
         int i;
         for ( i = 0; i < 2; i++ ) {
             c->loc[i] = malloc(b->blockCount*sizeof(int));
@@ -1720,9 +1944,11 @@ void gea_clear(struct gea_record *v)
             v->d.fmt[i].p_free = 0;
         }
     }
-    if ( (v->unpacked | GEA_UN_TRANS) && ( v->blockCount > 0) ) {
+    // records may be recycled, so reset the coding structure after releasing it
+    if ( (v->unpacked & GEA_UN_TRANS) && ( v->blockCount > 0) ) {
         free(v->c.loc[0]); free(v->c.loc[1]);
     }
+    memset(&v->c, 0, sizeof(struct gea_coding_transcript));
     if ( v->blockCount > 0) {
         free(v->blockPair[0]); free(v->blockPair[1]);
         v->blockCount = 0;
@@ -1742,6 +1968,10 @@ void gea_clear(struct gea_record *v)
 void gea_destroy(struct gea_record *v)
 {
     gea_clear(v);
+    if ( v->d.m_info ) free(v->d.info);
+    if ( v->d.m_fmt ) free(v->d.fmt);
+    if ( v->shared.m ) free(v->shared.s);
+    if ( v->indiv.m ) free(v->indiv.s);
     free(v);
 }
 
@@ -1780,7 +2010,7 @@ int main(int argc, char **argv)
     struct gea_record *v = gea_init();
     for (;;) {
         if ( gea_read(fp, hdr, v) ) break;
-        if ( strcmp(hdr->id[GEA_DT_BIOTYPE][v->biotype].key, "mRNA") && strcmp(hdr->id[GEA_DT_BIOTYPE][v->biotype].key, "ncRNA") ) continue;
+        if ( !gea_is_transcript(hdr, v) ) continue;
         gea_unpack(hdr, v, GEA_UN_CIGAR|GEA_UN_TRANS);
         int i;
         for ( i = 0; i < v->blockCount; ++i ) {
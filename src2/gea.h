@@ -161,6 +161,8 @@ struct gea_hdr {
     int mrna_id;
     int nrna_id;
     int gene_id;
+    // GEA_BIOTYPE_* flags of each bioType id, updated in gea_hdr_sync()
+    uint8_t *biotype_flags;
     
     struct gea_id_pair *id[GEA_DICT_ALL];
     void *dict[GEA_DICT_ALL];
@@ -171,6 +173,18 @@ struct gea_hdr {
     kstring_t mem;
 };
 
+#define GEA_BIOTYPE_MRNA   1 // mRNA
+#define GEA_BIOTYPE_NCRNA  2 // ncRNA
+#define GEA_BIOTYPE_GENE   4 // Gene
+#define GEA_BIOTYPE_TFBS   8 // TFBS
+#define GEA_BIOTYPE_TRANS  (GEA_BIOTYPE_MRNA|GEA_BIOTYPE_NCRNA)
+
+#define gea_biotype_flag(hdr, v)  ((hdr)->biotype_flags[(v)->biotype])
+#define gea_is_mrna(hdr, v)       (gea_biotype_flag(hdr, v) & GEA_BIOTYPE_MRNA)
+#define gea_is_transcript(hdr, v) (gea_biotype_flag(hdr, v) & GEA_BIOTYPE_TRANS)
+#define gea_is_gene(hdr, v)       (gea_biotype_flag(hdr, v) & GEA_BIOTYPE_GENE)
+#define gea_is_tfbs(hdr, v)       (gea_biotype_flag(hdr, v) & GEA_BIOTYPE_TFBS)
+
 #define gea_hdr_id2type(hdr, id) ((hdr)->id[GEA_DT_ID][id].val->info>>4 & 0xf)
 #define gea_hdr_id2length(hdr, id) ((hdr)->id[GEA_DT_ID][id].val->info>>8 & 0xf)
 #define gea_hdr_id2number(hdr, id) ((hdr)->id[GEA_DT_ID][id].val->info>>12)
@@ -304,7 +318,8 @@ int gea_check_format(const char *fn);
 struct gea_hdr *gea_hdr_read(htsFile *fp);
 int gea_hdr_write(htsFile *fp, const struct gea_hdr *hdr);
 void gea_hdr_destroy(struct gea_hdr *h);
-//struct gea_hdr *gea_hdr_duplicate(struct gea_hdr *h);
+// Duplicate header by formatting and parsing it again, so dictionary ids are the same as reading the header from file
+struct gea_hdr *gea_hdr_duplicate(const struct gea_hdr *h);
 
 // Append new GEA header line, return 0 on success
 int gea_hdr_append(struct gea_hdr *hdr, const char *line);
@@ -313,6 +328,27 @@ int gea_hdr_append(struct gea_hdr *hdr, const char *line);
 int gea_read(htsFile *fp,const struct gea_hdr *hdr, struct gea_record *rec);
 int gea_write(htsFile *fp, const struct gea_hdr *hdr, struct gea_record *rec);
 
+// Binary GEA (BGEA), records are kept in unpacked state (GEA_UN_TRANS|GEA_UN_CIGAR), see gea.c for the layout.
+// BGEA is indexed by CSI with contig names in the tabix meta block, load it by tbx_index_load().
+// hts_open() cannot detect BGEA, open it by bgzf_open() for reading.
+struct gea_hdr *bgea_hdr_read(BGZF *fp);
+struct gea_hdr *bea_hdr_read(htsFile *fp);
+int bea_hdr_write(htsFile *fp, struct gea_hdr *hdr);
+// return 0 for BGEA format, -1 for others
+int bgea_check_format(const char *fn);
+// return 0 on success, -1 on end of file, < -1 on error
+int bgea_read(BGZF *fp, const struct gea_hdr *hdr, struct gea_record *rec);
+int bgea_write(htsFile *fp, const struct gea_hdr *hdr, struct gea_record *rec);
+// map from header contig ids to index ids, -1 for contigs not indexed
+struct bgea_tid_map {
+    int n;
+    int *tids;
+};
+// hts_readrec_func for hts_itr_next(), data should be the map from header contig ids to index ids, see bgea_tid_map()
+int bgea_readrec(BGZF *fp, void *data, void *rec, int *tid, int *beg, int *end);
+struct bgea_tid_map *bgea_tid_map(const struct gea_hdr *hdr, tbx_t *idx);
+void bgea_tid_map_destroy(struct bgea_tid_map *map);
+
 struct gea_format *gea_get_fmt(const struct gea_hdr *hdr, struct gea_record *rec, const char *key);
 bcf_info_t   *gea_get_info(const struct gea_hdr *hdr, struct gea_record *rec, const char *key);
 
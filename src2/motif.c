@@ -1058,27 +1058,26 @@ int main(int argc, char **argv)
             
             struct anno_pool *arg = anno_reader(args.fp_in, args.bcf_hdr, args.n_record);
             
-            if ( arg->n_reader == 0 )
+            if ( arg->n_reader == 0 ) {
+            
+                anno_pool_release(arg);
+            
                 break;
             
+            }
+            
             arg->arg = M;
             
-            int block;
-            do {
-                block = thread_pool_dispatch2(p, q, anno_pwm, arg, 1);
-                if ( ( r = thread_pool_next_result(q) ) ) {
-                    // generate output
-                    struct anno_pool *data = (struct anno_pool*)r->data;
-                    int i;
-                    for ( i = 0; i < data->n_reader; ++i ) {
-                        bcf_write1(args.fp_out, args.bcf_hdr, data->readers[i]);
-                        bcf_destroy(data->readers[i]);
-                    }
-                    free(data->readers);
-                    thread_pool_delete_result(r, 1);
-                }
-                // flush output
-            } while ( block == -1);
+            // sleep until the input queue has room, and write the ordered results meanwhile
+            while ( thread_pool_dispatch3(p, q, anno_pwm, arg, &r) == 1 ) {
+                // generate output
+                struct anno_pool *data = (struct anno_pool*)r->data;
+                int i;
+                for ( i = 0; i < data->n_reader; ++i )
+                    bcf_write1(args.fp_out, args.bcf_hdr, data->readers[i]);
+                anno_pool_release(data);
+                thread_pool_delete_result(r, 0);
+            }
         }
 
         thread_pool_process_flush(q);
@@ -1087,15 +1086,14 @@ int main(int argc, char **argv)
             // generate output
             struct anno_pool *data = (struct anno_pool*)r->data;
             int i;
-            for ( i = 0; i < data->n_reader; ++i ) {
+            for ( i = 0; i < data->n_reader; ++i )
                 bcf_write1(args.fp_out, args.bcf_hdr, data->readers[i]);
-                bcf_destroy(data->readers[i]);
-            }
-            free(data->readers);
-            thread_pool_delete_result(r, 1);
+            anno_pool_release(data);
+            thread_pool_delete_result(r, 0);
         }
         thread_pool_process_destroy(q);
         thread_pool_destroy(p);
+        anno_pool_freelist_destroy();
         for ( i = 0; i < args.n_thread; ++i ) MTF_destory(M[i]);
         free(M);
     }
@@ -0,0 +1,208 @@
+#include "utils.h"
+#include "htslib/khash.h"
+#include "seq_cache.h"
+
+struct seq_cache_node {
+    char *name;
+    char *seq;
+    int len;
+    struct seq_cache_node *prev;
+    struct seq_cache_node *next;
+};
+
+KHASH_MAP_INIT_STR(seq_cache, struct seq_cache_node*)
+
+struct seq_cache {
+    faidx_t *fai;
+    khash_t(seq_cache) *hash;
+    // most recently used at head, evict from tail
+    struct seq_cache_node *head;
+    struct seq_cache_node *tail;
+    size_t bytes;
+    size_t max_bytes;
+    uint64_t hit;
+    uint64_t miss;
+};
+
+struct seq_cache *seq_cache_init(faidx_t *fai, size_t max_bytes)
+{
+    struct seq_cache *c = malloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
+    c->fai = fai;
+    c->max_bytes = max_bytes;
+    c->hash = kh_init(seq_cache);
+    return c;
+}
+
+static void seq_cache_unlink(struct seq_cache *c, struct seq_cache_node *n)
+{
+    if ( n->prev ) n->prev->next = n->next;
+    else c->head = n->next;
+    if ( n->next ) n->next->prev = n->prev;
+    else c->tail = n->prev;
+    n->prev = n->next = NULL;
+}
+
+static void seq_cache_push_head(struct seq_cache *c, struct seq_cache_node *n)
+{
+    n->prev = NULL;
+    n->next = c->head;
+    if ( c->head ) c->head->prev = n;
+    c->head = n;
+    if ( c->tail == NULL ) c->tail = n;
+}
+
+static void seq_cache_evict(struct seq_cache *c)
+{
+    while ( c->bytes > c->max_bytes && c->tail && c->tail != c->head ) {
+        struct seq_cache_node *n = c->tail;
+        seq_cache_unlink(c, n);
+        khiter_t k = kh_get(seq_cache, c->hash, n->name);
+        if ( k != kh_end(c->hash) ) kh_del(seq_cache, c->hash, k);
+        c->bytes -= n->len;
+        free(n->name);
+        free(n->seq);
+        free(n);
+    }
+}
+
+void seq_cache_destroy(struct seq_cache *c)
+{
+    struct seq_cache_node *n = c->head;
+    while ( n ) {
+        struct seq_cache_node *t = n->next;
+        free(n->name);
+        free(n->seq);
+        free(n);
+        n = t;
+    }
+    kh_destroy(seq_cache, c->hash);
+    free(c);
+}
+
+static struct seq_cache_node *seq_cache_load(struct seq_cache *c, const char *name)
+{
+    khiter_t k = kh_get(seq_cache, c->hash, name);
+    if ( k != kh_end(c->hash) ) {
+        struct seq_cache_node *n = kh_val(c->hash, k);
+        c->hit++;
+        if ( n != c->head ) {
+            seq_cache_unlink(c, n);
+            seq_cache_push_head(c, n);
+        }
+        return n;
+    }
+    c->miss++;
+
+    // sequence larger than the whole cache, do not keep it
+    int l = faidx_seq_len(c->fai, name);
+    if ( l <= 0 || (size_t)l > c->max_bytes ) return NULL;
+
+    struct seq_cache_node *n = malloc(sizeof(*n));
+    n->seq = faidx_fetch_seq(c->fai, name, 0, l-1, &n->len);
+    if ( n->seq == NULL || n->len <= 0 ) {
+        if ( n->seq ) free(n->seq);
+        free(n);
+        return NULL;
+    }
+    n->name = strdup(name);
+    int ret;
+    k = kh_put(seq_cache, c->hash, n->name, &ret);
+    kh_val(c->hash, k) = n;
+    seq_cache_push_head(c, n);
+    c->bytes += n->len;
+    seq_cache_evict(c);
+    return n;
+}
+
+char *seq_cache_fetch(struct seq_cache *c, const char *name, int beg, int end, int *len)
+{
+    struct seq_cache_node *n = c->max_bytes ? seq_cache_load(c, name) : NULL;
+    if ( n == NULL ) return faidx_fetch_seq(c->fai, name, beg, end, len);
+
+    // clip the region as faidx_fetch_seq() does
+    if ( end < beg ) beg = end;
+    if ( beg < 0 ) beg = 0;
+    else if ( n->len <= beg ) beg = n->len - 1;
+    if ( end < 0 ) end = 0;
+    else if ( n->len <= end ) end = n->len - 1;
+
+    *len = end - beg + 1;
+    char *s = malloc(*len + 1);
+    memcpy(s, n->seq + beg, *len);
+    s[*len] = '\0';
+    return s;
+}
+
+void seq_cache_stat(struct seq_cache *c, uint64_t *hit, uint64_t *miss)
+{
+    *hit = c->hit;
+    *miss = c->miss;
+}
+
+struct seq_window {
+    faidx_t *fai;
+    int size;
+    char *name;
+    // cached sequence of [beg, beg+len)
+    int beg;
+    int len;
+    char *seq;
+};
+
+struct seq_window *seq_window_init(faidx_t *fai, int size)
+{
+    struct seq_window *w = malloc(sizeof(*w));
+    memset(w, 0, sizeof(*w));
+    w->fai = fai;
+    w->size = size;
+    return w;
+}
+
+void seq_window_destroy(struct seq_window *w)
+{
+    if ( w->name ) free(w->name);
+    if ( w->seq ) free(w->seq);
+    free(w);
+}
+
+char *seq_window_fetch(struct seq_window *w, const char *name, int beg, int end, int *len)
+{
+    int l = faidx_seq_len(w->fai, name);
+    if ( l <= 0 ) return faidx_fetch_seq(w->fai, name, beg, end, len);
+
+    // clip the region as faidx_fetch_seq() does
+    if ( end < beg ) beg = end;
+    if ( beg < 0 ) beg = 0;
+    else if ( l <= beg ) beg = l - 1;
+    if ( end < 0 ) end = 0;
+    else if ( l <= end ) end = l - 1;
+
+    if ( w->name == NULL || strcmp(w->name, name) != 0 || beg < w->beg || end >= w->beg + w->len ) {
+        // reload window, keep a little upstream for the minus strand lookups
+        int wbeg = beg - 64 < 0 ? 0 : beg - 64;
+        int wend = wbeg + w->size > end ? wbeg + w->size : end;
+        if ( wend >= l ) wend = l - 1;
+        if ( w->seq ) free(w->seq);
+        w->seq = faidx_fetch_seq(w->fai, name, wbeg, wend, &w->len);
+        if ( w->seq == NULL || w->len != wend - wbeg + 1 ) {
+            if ( w->seq ) free(w->seq);
+            w->seq = NULL;
+            w->len = 0;
+            if ( w->name ) free(w->name);
+            w->name = NULL;
+            return faidx_fetch_seq(w->fai, name, beg, end, len);
+        }
+        if ( w->name == NULL || strcmp(w->name, name) != 0 ) {
+            if ( w->name ) free(w->name);
+            w->name = strdup(name);
+        }
+        w->beg = wbeg;
+    }
+
+    *len = end - beg + 1;
+    char *s = malloc(*len + 1);
+    memcpy(s, w->seq + beg - w->beg, *len);
+    s[*len] = '\0';
+    return s;
+}
@@ -0,0 +1,36 @@
+#ifndef SEQ_CACHE_H
+#define SEQ_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "htslib/faidx.h"
+
+// LRU cache of whole sequences retrieved from a faidx index, such as transcript sequences.
+// Not thread safe, keep one cache per thread.
+struct seq_cache;
+
+// max_bytes == 0 disable the cache, sequences will be fetched from faidx directly
+extern struct seq_cache *seq_cache_init(faidx_t *fai, size_t max_bytes);
+
+extern void seq_cache_destroy(struct seq_cache *c);
+
+// Same semantics as faidx_fetch_seq(), return a new allocated sequence of [beg, end], 0 based.
+extern char *seq_cache_fetch(struct seq_cache *c, const char *name, int beg, int end, int *len);
+
+// hits and misses of cache
+extern void seq_cache_stat(struct seq_cache *c, uint64_t *hit, uint64_t *miss);
+
+// Window of genomic sequence around the last lookup, used for short flank lookups of sorted
+// variants. Not thread safe, keep one window per thread.
+struct seq_window;
+
+#define SEQ_WINDOW_SIZE 65536
+
+extern struct seq_window *seq_window_init(faidx_t *fai, int size);
+
+extern void seq_window_destroy(struct seq_window *w);
+
+// Same semantics as faidx_fetch_seq(), return a new allocated sequence of [beg, end], 0 based.
+extern char *seq_window_fetch(struct seq_window *w, const char *name, int beg, int end, int *len);
+
+#endif
@@ -11,6 +11,35 @@
 #include "htslib/vcf.h"
 #include "htslib/kstring.h"
 
+// Same as bcf_get_info_values(), but read values of column col from the INFO decoded by
+// anno_vcf_decode_info(), so no header lookup or unpacking of database record is needed.
+static int vcf_info_values(struct anno_vcf_file *f, struct anno_col *col, void **dst, int *ndst, int type)
+{
+    int icol = col - f->cols;
+    if ( f->info_keys[icol] == -1 ) return -1;  // no such INFO field in database header
+    bcf_info_t *info = &f->buffer->infos[icol];
+    if ( info->vptr == NULL ) return type==BCF_HT_FLAG ? 0 : -3;  // the tag is not present in this record
+    return bcf_info_get_values(info, dst, ndst, type);
+}
+
+// Map alleles of line to database record for Number=A (number is BCF_VL_A) or Number=R columns.
+// The map is only computed once for each matched pair, NULL if REFs are not compatible.
+static int *vcf_allele_map(struct anno_vcf_file *f, bcf1_t *line, int number, int nals, char **als)
+{
+    struct anno_vcf_buffer *b = f->buffer;
+    int k = number == BCF_VL_A ? 0 : 1;
+    if ( b->map_status[k] == 0 ) {
+        int ndst = k == 0 ? line->n_allele - 1 : line->n_allele;
+        int *map = vcmp_map_ARvalues(b->vcmp,ndst,nals,als,line->n_allele,line->d.allele);
+        if ( map ) {
+            hts_expand(int, ndst, b->m_map[k], b->map[k]);
+            memcpy(b->map[k], map, ndst*sizeof(int));
+        }
+        b->map_status[k] = map ? 1 : -1;
+    }
+    return b->map_status[k] == 1 ? b->map[k] : NULL;
+}
+
 int vcf_setter_filter(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col, void *data)
 {
     int i;
@@ -23,15 +52,13 @@ int vcf_setter_filter(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, str
     if ( col->replace==SET_OR_APPEND || col->replace==REPLACE_MISSING ) {
         if ( col->replace==REPLACE_MISSING && line->d.n_flt ) return 0; // only update missing FILTER
         for ( i = 0; i < rec->d.n_flt; i++) {
-            const char *flt = bcf_hdr_int2id(f->hdr, BCF_DT_ID, rec->d.flt[i]);
-            bcf_add_filter(hdr, line, bcf_hdr_id2int(hdr, BCF_DT_ID, flt));
+            bcf_add_filter(hdr, line, anno_vcf_filter_id(f, hdr, rec->d.flt[i]));
         }
         return 0;
     }
     hts_expand(int,rec->d.n_flt,b->mtmpi,b->tmpi);
     for ( i = 0; i < rec->d.n_flt; i++) {
-        const char *flt = bcf_hdr_int2id(f->hdr, BCF_DT_ID, rec->d.flt[i]);
-        b->tmpi[i] = bcf_hdr_id2int(hdr, BCF_DT_ID, flt);
+        b->tmpi[i] = anno_vcf_filter_id(f, hdr, rec->d.flt[i]);
     }
     bcf_update_filter(hdr,line,NULL,0);
     bcf_update_filter(hdr,line,b->tmpi,rec->d.n_flt);
@@ -66,14 +93,13 @@ int vcf_setter_qual(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, struc
 }
 int vcf_setter_info_flag(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col, void *data)
 {
-    bcf1_t *rec = (bcf1_t*) data;
     //struct anno_vcf_buffer *b = f->buffer;
 
-    int flag = bcf_get_info_flag(f->hdr,rec,col->hdr_key,NULL,NULL);
-    assert(flag >= 0);
-    int ret = bcf_get_info_flag(hdr,line,col->hdr_key,NULL,NULL);
+    int flag = vcf_info_values(f,col,NULL,NULL,BCF_HT_FLAG);
+    if ( flag < 0 ) return 0;
+    int ret = bcf_get_info_values_id(line,col->hdr_id,NULL,NULL,BCF_HT_FLAG);
     if ( ret == -3 ) {
-        bcf_update_info_flag(hdr,line,col->hdr_key,NULL,flag);
+        bcf_update_info_fixed_id(hdr,line,col->hdr_id,NULL,flag,BCF_HT_FLAG);
     } 
     return 0;
 }
@@ -89,14 +115,14 @@ static int setter_ARinfo_int32(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *
     }
 
     int ndst = col->number==BCF_VL_A ? line->n_allele - 1 : line->n_allele;
-    int *map = vcmp_map_ARvalues(b->vcmp,ndst,nals,als,line->n_allele,line->d.allele);
+    int *map = vcf_allele_map(f,line,col->number,nals,als);
     if ( !map ) {
         error_return("REF alleles not compatible at %s:%d", bcf_seqname(hdr, line), line->pos +1);
         return 1;
     }
     
     // fill in any missing values in the target VCF (or all, if not present)
-    int ntmpi2 = bcf_get_info_float(hdr, line, col->hdr_key, &b->tmpi2, &b->mtmpi2);
+    int ntmpi2 = bcf_get_info_values_id(line, col->hdr_id, (void**)&b->tmpi2, &b->mtmpi2, BCF_HT_INT);
 
     if ( ntmpi2 < ndst )
         hts_expand(int32_t,ndst,b->mtmpi2,b->tmpi2);
@@ -112,7 +138,7 @@ static int setter_ARinfo_int32(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *
 
         b->tmpi2[i] = b->tmpi[ map[i] ];
     }
-    return bcf_update_info_int32_fixed(hdr,line,col->hdr_key,b->tmpi2,ndst);
+    return bcf_update_info_fixed_id(hdr,line,col->hdr_id,b->tmpi2,ndst,BCF_HT_INT);
 }
 
 int vcf_setter_info_int(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col, void *data)
@@ -121,23 +147,21 @@ int vcf_setter_info_int(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, s
     struct anno_vcf_buffer *b = f->buffer;
     if ( !(line->unpacked & BCF_UN_INFO) )
         bcf_unpack(line, BCF_UN_INFO);
-    if ( !(rec->unpacked & BCF_UN_INFO) )
-        bcf_unpack(rec, BCF_UN_INFO);
     
-    int ntmpi = bcf_get_info_int32(f->hdr, rec, col->hdr_key, &b->tmpi, &b->mtmpi);
+    int ntmpi = vcf_info_values(f, col, (void**)&b->tmpi, &b->mtmpi, BCF_HT_INT);
 
     if ( ntmpi < 0 ) return 0;    // nothing to add
 
     // check missing tag come first, changed by shiquan, 2018/01/30
     if ( col->replace==REPLACE_MISSING ) {    
-        int ret = bcf_get_info_int32(hdr, line, col->hdr_key, &b->tmpi2, &b->mtmpi2);
+        int ret = bcf_get_info_values_id(line, col->hdr_id, (void**)&b->tmpi2, &b->mtmpi2, BCF_HT_INT);
         if ( ret>0 && b->tmpi2[0]!=bcf_int32_missing ) return 0;
     }
     
     if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
         return setter_ARinfo_int32(f,hdr,line,col,rec->n_allele,rec->d.allele,ntmpi);
    
-    return bcf_update_info_int32_fixed(hdr,line,col->hdr_key,b->tmpi,ntmpi);
+    return bcf_update_info_fixed_id(hdr,line,col->hdr_id,b->tmpi,ntmpi,BCF_HT_INT);
 }
 static int setter_ARinfo_real(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col, int nals, char **als, int ntmpf)
 {
@@ -150,11 +174,11 @@ static int setter_ARinfo_real(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *l
     
     int ndst = col->number==BCF_VL_A ? line->n_allele - 1 : line->n_allele;
 
-    int *map = vcmp_map_ARvalues(b->vcmp,ndst,nals,als,line->n_allele,line->d.allele);
+    int *map = vcf_allele_map(f,line,col->number,nals,als);
     if ( !map ) error("REF alleles not compatible at %s:%d\n", bcf_seqname(hdr, line), line->pos +1);
 
     // fill in any missing values in the target VCF (or all, if not present)
-    int ntmpf2 = bcf_get_info_float(hdr, line, col->hdr_key, &b->tmpf2, &b->mtmpf2);
+    int ntmpf2 = bcf_get_info_values_id(line, col->hdr_id, (void**)&b->tmpf2, &b->mtmpf2, BCF_HT_REAL);
     if ( ntmpf2 < ndst )
         hts_expand(float,ndst,b->mtmpf2,b->tmpf2);
 
@@ -172,7 +196,7 @@ static int setter_ARinfo_real(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *l
 
         b->tmpf2[i] = b->tmpf[ map[i] ];
     }
-    return bcf_update_info_float_fixed(hdr,line,col->hdr_key,b->tmpf2,ndst);
+    return bcf_update_info_fixed_id(hdr,line,col->hdr_id,b->tmpf2,ndst,BCF_HT_REAL);
 }
 int vcf_setter_info_real(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col, void *data)
 {
@@ -181,22 +205,20 @@ int vcf_setter_info_real(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line,
 
     if ( !(line->unpacked & BCF_UN_INFO) )
         bcf_unpack(line, BCF_UN_INFO);
-    if ( !(rec->unpacked & BCF_UN_INFO) )
-        bcf_unpack(rec, BCF_UN_INFO);
     
-    int ntmpf = bcf_get_info_float(f->hdr,rec,col->hdr_key,&b->tmpf,&b->mtmpf);    
+    int ntmpf = vcf_info_values(f, col, (void**)&b->tmpf, &b->mtmpf, BCF_HT_REAL);
     if ( ntmpf < 0 ) return 0;    // nothing to add
 
     // check missing tag come first, changed by shiquan, 2018/01/30
     if ( col->replace==REPLACE_MISSING ) {
-        int ret = bcf_get_info_float(hdr, line, col->hdr_key, &b->tmpf2, &b->mtmpf2);
+        int ret = bcf_get_info_values_id(line, col->hdr_id, (void**)&b->tmpf2, &b->mtmpf2, BCF_HT_REAL);
         if ( ret>0 && !bcf_float_is_missing(b->tmpf2[0]) ) return 0;
     }
 
     if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
         return setter_ARinfo_real(f,hdr,line,col,rec->n_allele,rec->d.allele,ntmpf);
 
-    return bcf_update_info_float_fixed(hdr,line,col->hdr_key,b->tmpf,ntmpf);
+    return bcf_update_info_fixed_id(hdr,line,col->hdr_id,b->tmpf,ntmpf,BCF_HT_REAL);
 }
 
 static int copy_string_field(char *src, int isrc, int src_len, kstring_t *dst, int idst)
@@ -255,7 +277,7 @@ static int setter_ARinfo_string(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t
         error("Incorrect number of values (%d) for the %s tag at %s:%d\n", nsrc,col->hdr_key,bcf_seqname(hdr,line),line->pos+1);
 
     int ndst = col->number==BCF_VL_A ? line->n_allele - 1 : line->n_allele;
-    int *map = vcmp_map_ARvalues(b->vcmp,ndst,nals,als,line->n_allele,line->d.allele);
+    int *map = vcf_allele_map(f,line,col->number,nals,als);
     if ( !map ) {
         error_return("REF alleles not compatible at %s:%d", bcf_seqname(hdr, line), line->pos+1);
         return 1;
@@ -263,7 +285,7 @@ static int setter_ARinfo_string(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t
 
     // fill in any missing values in the target VCF (or all, if not present)
     int i, empty = 0, nstr, mstr = b->tmpks.m;
-    nstr = bcf_get_info_string(hdr, line, col->hdr_key, &b->tmpks.s, &mstr); 
+    nstr = bcf_get_info_values_id(line, col->hdr_id, (void**)&b->tmpks.s, &mstr, BCF_HT_STR);
     b->tmpks.m = mstr;
     if ( nstr<0 || (nstr==1 && b->tmpks.s[0]=='.' && b->tmpks.s[1]==0) ) {
         empty = 0;
@@ -291,7 +313,7 @@ static int setter_ARinfo_string(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t
         int ret = copy_string_field(b->tmps,map[i],lsrc,&b->tmpks,i);
         assert( ret==0 );
     }
-    return bcf_update_info_string_fixed(hdr,line,col->hdr_key,b->tmpks.s);
+    return bcf_update_info_fixed_id(hdr,line,col->hdr_id,b->tmpks.s,1,BCF_HT_STR);
 }
 int vcf_setter_info_str(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col, void *data)
 {
@@ -299,19 +321,17 @@ int vcf_setter_info_str(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line, s
     struct anno_vcf_buffer *b = f->buffer;
     if ( !(line->unpacked & BCF_UN_INFO) )
         bcf_unpack(line, BCF_UN_INFO);
-    if ( !(rec->unpacked & BCF_UN_INFO) )
-        bcf_unpack(rec, BCF_UN_INFO);
-    int ntmps = bcf_get_info_string(f->hdr,rec,col->hdr_key,&b->tmps,&b->mtmps);
+    int ntmps = vcf_info_values(f, col, (void**)&b->tmps, &b->mtmps, BCF_HT_STR);
     if ( ntmps < 0 ) return 0;    // nothing to add
 
     // check missing tag come first, changed by shiquan, 2018/01/30 
     if ( col->replace==REPLACE_MISSING ) {
-        int ret = bcf_get_info_string(hdr, line, col->hdr_key, &b->tmps2, &b->mtmps2);
+        int ret = bcf_get_info_values_id(line, col->hdr_id, (void**)&b->tmps2, &b->mtmps2, BCF_HT_STR);
         if ( ret>0 && (b->tmps2[0]!='.' || b->tmps2[1]!=0) ) return 0;
     }
    
     if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
         return setter_ARinfo_string(f,hdr,line,col,rec->n_allele,rec->d.allele);
     
-    return bcf_update_info_string(hdr,line,col->hdr_key,b->tmps);
+    return bcf_update_info_fixed_id(hdr,line,col->hdr_id,b->tmps,1,BCF_HT_STR);
 }
@@ -0,0 +1,323 @@
+#!/bin/bash
+# Regression runs of bcfanno, called by `make test` in the top directory. Inputs are made from the
+# bundled example databases, outputs of threads, chunk sizes and the other modes are compared with
+# the expected outputs in test/expected.
+
+cd "$(dirname "$0")/.." || exit 1
+
+BCFANNO=${BCFANNO:-./bcfanno}
+GEA2BGEA=./gea2bgea
+BGZIP=htslib-1.6/bgzip
+TABIX=htslib-1.6/tabix
+HTSFILE=htslib-1.6/htsfile
+
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/bcfanno_test.XXXXXX") || exit 1
+trap 'rm -rf "$tmp"' EXIT
+export TMPDIR=$tmp
+
+n_test=0
+n_fail=0
+
+fail()
+{
+    echo "FAIL $1"
+    n_fail=$((n_fail+1))
+}
+
+# annotate NAME ARGS... : annotate into $tmp/NAME.vcf, the bcfanno header lines are removed
+annotate()
+{
+    local name=$1
+    shift
+    if ! $BCFANNO "$@" -o $tmp/$name.out > $tmp/$name.log 2>&1; then
+        tail -3 $tmp/$name.log
+        return 1
+    fi
+    gzip -dcf $tmp/$name.out | grep -v '^##bcfanno' > $tmp/$name.vcf
+}
+
+# check NAME REF ARGS... : annotate with ARGS and compare with the output of REF
+check()
+{
+    local name=$1 ref=$2
+    shift 2
+    n_test=$((n_test+1))
+    if ! annotate $name "$@"; then
+        fail "$name, bcfanno $*"
+    elif ! cmp -s $tmp/$ref.vcf $tmp/$name.vcf; then
+        fail "$name, bcfanno $*, differs from $ref"
+    else
+        echo "ok   $name"
+    fi
+}
+
+# check_records NAME REF : same records with REF regardless of order
+check_records()
+{
+    n_test=$((n_test+1))
+    if cmp -s <(grep -v '^#' $tmp/$2.vcf | sort) <(grep -v '^#' $tmp/$1.vcf | sort); then
+        echo "ok   $1 records"
+    else
+        fail "$1, records differ from $2"
+    fi
+}
+
+# check_log NAME PATTERN : log of NAME should match PATTERN
+check_log()
+{
+    n_test=$((n_test+1))
+    if grep -q "$2" $tmp/$1.log; then
+        echo "ok   $1 log"
+    else
+        fail "$1, no \"$2\" in log"
+    fi
+}
+
+for f in $BCFANNO $GEA2BGEA $BGZIP $TABIX $HTSFILE; do
+    [ -x $f ] || { echo "$f is not built."; exit 1; }
+done
+
+# Records every 13 bp over BRCA1 of the example database, and records at the dbSNP positions with
+# each allele repeated, so records of one position are split into pools by small -r.
+header()
+{
+    gzip -dc example/toy.vcf.gz | grep '^#'
+}
+records()
+{
+    awk 'BEGIN {
+        split("A C G T", b, " ");
+        for ( pos = 41196001; pos < 41278000; pos += 13 ) {
+            ref = b[pos%4+1]; alt = b[(pos+1)%4+1];
+            if ( pos%7 == 0 ) alt = ref "T";
+            printf "chr17\t%d\t.\t%s\t%s\t.\t.\t.\tGT\t0/1\n", pos, ref, alt;
+        }
+    }'
+}
+dbsnp_records()
+{
+    awk 'BEGIN {
+        split("41223242:G 41234451:G 41258504:A", v, " ");
+        split("A C G T", b, " ");
+        for ( i = 1; i <= 3; ++i ) {
+            split(v[i], p, ":");
+            for ( k = 0; k < 3; ++k )
+                for ( j = 1; j <= 4; ++j )
+                    if ( b[j] != p[2] ) printf "chr17\t%d\t.\t%s\t%s\t.\t.\t.\tGT\t0/1\n", p[1], p[2], b[j];
+            printf "chr17\t%d\t.\t%s\tC\t.\t.\t.\tGT\t0/1\n", p[1]+1, p[2];
+        }
+    }'
+}
+{ header; { records; dbsnp_records; } | sort -s -k2,2n; } | $BGZIP -c > $tmp/in.vcf.gz
+$TABIX -p vcf $tmp/in.vcf.gz
+{ header; { records; dbsnp_records; } | awk 'BEGIN { srand(13) } { print rand() "\t" $0 }' | sort -k1,1 | cut -f2-; } > $tmp/shuf.vcf
+{ header; dbsnp_records | sort -s -k2,2n; } | $BGZIP -c > $tmp/dup.vcf.gz
+
+$GEA2BGEA -o $tmp/toy.bgea example/toy.gea.gz || exit 1
+
+# Expected outputs of the inputs above, made by the single thread bcfanno of 86e756a, before the
+# multi-thread pipeline, with the bcfanno header lines removed. full.vcf.gz is annotated with
+# full.json below, db.vcf.gz and dup.vcf.gz with db.json.
+for f in test/expected/*.vcf.gz; do
+    gzip -dc $f > $tmp/expected_$(basename $f .vcf.gz).vcf
+done
+
+# paths in config are relative to the config file
+ex=$PWD/example
+cat > $tmp/full.json <<EOF
+{
+    "hgvs": {
+        "gene_data":"$ex/toy.gea.gz",
+        "refseq":"$ex/toy_transcripts.fa",
+        "columns":"MolecularConsequence,ExonIntron,Gene,Transcript,HGVSnom,AAlength",
+    },
+    "vcfs": [
+        { "file":"$ex/toy_dbsnp.bcf", "columns":"DBSNP_CAF,RS,DBSNP_VP,CLNSIG", },
+        { "file":"$ex/toy_hgmd.bcf", "columns":"HGMD_disease,HGMD_tag,HGMD_acc_num", },
+    ],
+    "beds": [
+        { "file":"$ex/toy_cytoband.bed.gz", "columns":"CytoBand", },
+    ],
+}
+EOF
+sed "s#$ex/toy.gea.gz#$tmp/toy.bgea#" $tmp/full.json > $tmp/bgea.json
+# without GEA, its results depend on chunk sizes
+cat > $tmp/db.json <<EOF
+{
+    "vcfs": [
+        { "file":"$ex/toy_dbsnp.bcf", "columns":"DBSNP_CAF,RS,DBSNP_VP,CLNSIG", },
+        { "file":"$ex/toy_hgmd.bcf", "columns":"HGMD_disease,HGMD_tag,HGMD_acc_num", },
+    ],
+    "beds": [
+        { "file":"$ex/toy_cytoband.bed.gz", "columns":"CytoBand", },
+    ],
+}
+EOF
+
+check full expected_full -c $tmp/full.json -t 1 -r 50 $tmp/in.vcf.gz
+check db expected_db -c $tmp/db.json -t 1 -r 100000 $tmp/in.vcf.gz
+check dup expected_dup -c $tmp/db.json -t 1 -r 100000 $tmp/dup.vcf.gz
+
+# work stealing and the task graph of small ranges
+check full_r5 expected_full -c $tmp/full.json -t 1 -r 5 $tmp/in.vcf.gz
+check threads_4 expected_full -c $tmp/full.json -t 4 -r 50 $tmp/in.vcf.gz
+check threads_8 expected_full -c $tmp/full.json -t 8 -r 50 -O z $tmp/in.vcf.gz
+check threads_8_db expected_db -c $tmp/db.json -t 8 -r 20 $tmp/in.vcf.gz
+check threads_4_r5 expected_full -c $tmp/full.json -t 4 -r 5 $tmp/in.vcf.gz
+check threads_8_r5 expected_full -c $tmp/full.json -t 8 -r 5 $tmp/in.vcf.gz
+check threads_8_r1 expected_full -c $tmp/full.json -t 8 -r 1 $tmp/in.vcf.gz
+
+# forward cursor, records of one position are split into two chunks at the boundaries of pools
+for r in 1 2 5 7; do
+    check cursor_r${r} expected_dup -c $tmp/db.json -t 1 -r $r $tmp/dup.vcf.gz
+    check cursor_r${r}_t4 expected_dup -c $tmp/db.json -t 4 -r $r $tmp/dup.vcf.gz
+done
+check cursor_in_r7 expected_db -c $tmp/db.json -t 4 -r 7 $tmp/in.vcf.gz
+
+# adaptive records per pool and chunk gap
+check tune expected_db -c $tmp/db.json -t 4 --task-ms 1 --records-range 5,500 $tmp/in.vcf.gz
+check tune_gap expected_db -c $tmp/db.json -t 4 --task-ms 1 --gap-range 100,100000 $tmp/in.vcf.gz
+# ranges only bound the values adapted by --task-ms, they are rejected without it
+n_test=$((n_test+1))
+if ! annotate tune_no_ms -c $tmp/db.json -t 4 --records-range 5,500 $tmp/in.vcf.gz > /dev/null \
+        && grep -q "records-range only bounds" $tmp/tune_no_ms.log; then
+    echo "ok   tune_no_ms"
+else
+    fail "tune_no_ms, --records-range without --task-ms is not rejected"
+fi
+
+# external sort of unsorted input, forced to spill by a small buffer
+annotate unsorted -c $tmp/full.json -t 1 -r 50 --unsorted $tmp/shuf.vcf || exit 1
+check_records unsorted expected_full
+n_test=$((n_test+1))
+if cmp -s <(grep -v '^#' $tmp/shuf.vcf | cut -f1-5) <(grep -v '^#' $tmp/unsorted.vcf | cut -f1-5); then
+    echo "ok   unsorted order"
+else
+    fail "unsorted, records are not in the order of input"
+fi
+check unsorted_spill unsorted -c $tmp/full.json -t 1 -r 50 --unsorted --sort-buffer-mb 1 $tmp/shuf.vcf
+check_log unsorted_spill "[1-9][0-9]* buffers spilled"
+check unsorted_spill_t4 unsorted -c $tmp/full.json -t 4 -r 50 --unsorted --sort-buffer-mb 1 $tmp/shuf.vcf
+
+# shard by region, and partitions combined by bcfanno merge
+check shard expected_db -c $tmp/db.json -t 4 --shard-by-region -O z $tmp/in.vcf.gz
+check shard_t2 expected_db -c $tmp/db.json -t 2 --shard-by-region $tmp/in.vcf.gz
+n_test=$((n_test+1))
+parts=
+for i in 1 2 3; do
+    annotate part$i -c $tmp/db.json -t 2 --shard $i/3 -O z $tmp/in.vcf.gz || break
+    grep -q -v '^#' $tmp/part$i.vcf || break
+    $TABIX -p vcf $tmp/part$i.out || break
+    parts="$parts $tmp/part$i.out"
+done
+if [ "$parts" != " $tmp/part1.out $tmp/part2.out $tmp/part3.out" ]; then
+    fail "merge, --shard $i/3 failed or is empty"
+elif $BCFANNO merge -o $tmp/merge.vcf.gz $parts > $tmp/merge.log 2>&1 \
+        && gzip -dc $tmp/merge.vcf.gz | grep -v '^##bcfanno' | cmp -s $tmp/expected_db.vcf -; then
+    echo "ok   merge"
+else
+    fail "merge, bcfanno merge of --shard 1/3 to 3/3 differs from expected_db"
+fi
+# index combined from the parts, queries are the same with the index built from merged output
+n_test=$((n_test+1))
+cp $tmp/merge.vcf.gz $tmp/merge_tabix.vcf.gz
+$TABIX -p vcf $tmp/merge_tabix.vcf.gz
+query()
+{
+    for r in chr17 chr17:41196001-41200000 chr17:41215000-41240000 chr17:41250000-41280000; do $TABIX $1 $r; done
+}
+if ! grep -q "build index" $tmp/merge.log && [ -s $tmp/merge.vcf.gz.tbi ] && cmp -s <(query $tmp/merge.vcf.gz) <(query $tmp/merge_tabix.vcf.gz); then
+    echo "ok   merge index"
+else
+    fail "merge index, queries differ from tabix index of merged output"
+fi
+# BCF parts, indexed by merging each alone; CSI combined from them is the same as the one built
+# from the merged output
+n_test=$((n_test+1))
+for i in 1 2 3; do
+    $BCFANNO -c $tmp/db.json -t 2 --shard $i/3 -O b -o $tmp/part$i.bcf $tmp/in.vcf.gz > /dev/null 2>&1
+    $BCFANNO merge -o $tmp/part${i}_csi.bcf $tmp/part$i.bcf > /dev/null 2>&1
+done
+if $BCFANNO merge -o $tmp/merge.bcf $tmp/part{1,2,3}_csi.bcf > $tmp/merge_bcf.log 2>&1 && ! grep -q "build index" $tmp/merge_bcf.log \
+        && $BCFANNO merge -o $tmp/merge_rebuild.bcf $tmp/part{1,2,3}.bcf > /dev/null 2>&1 \
+        && cmp -s <(gzip -dc $tmp/merge.bcf.csi) <(gzip -dc $tmp/merge_rebuild.bcf.csi) \
+        && $HTSFILE -c $tmp/merge.bcf | grep -v '^##bcfanno' | cmp -s $tmp/expected_db.vcf -; then
+    echo "ok   merge bcf"
+else
+    fail "merge bcf, BCF parts or their combined CSI differ"
+fi
+
+# ANNOVARname generated from GEA
+n_test=$((n_test+1))
+sed 's/"columns":"MolecularConsequence,/"columns":"ANNOVARname,MolecularConsequence,/' $tmp/full.json > $tmp/annovar.json
+if annotate annovar -c $tmp/annovar.json -t 1 -r 50 $tmp/in.vcf.gz \
+        && grep -q $'^chr17\t41197704\t.*ANNOVARname=BRCA1:NM_007298:exon22:c.T2271G:p.S757R,BRCA1:NM_007297:exon22:c.T5442G:p.S1814R,' $tmp/annovar.vcf; then
+    echo "ok   annovar"
+else
+    fail "annovar, ANNOVARname not generated"
+fi
+
+# BED tag already in input is kept, only the records without it are filled
+n_test=$((n_test+1))
+printf '{ "beds": [ { "file":"%s", "columns":"CytoBand", }, ], }\n' $ex/toy_cytoband.bed.gz > $tmp/cyto.json
+{ header | grep '^##'
+  echo '##INFO=<ID=CytoBand,Number=1,Type=String,Description="Cytoband">'
+  header | grep '^#CHROM'
+  records | head -4 | awk 'BEGIN { OFS="\t" } NR%2 { $8 = "CytoBand=mine" } { print }'; } > $tmp/cyto_in.vcf
+printf 'CytoBand=mine\nCytoBand=q21.31\nCytoBand=mine\nCytoBand=q21.31\n' > $tmp/cyto_expected
+if annotate cyto -c $tmp/cyto.json $tmp/cyto_in.vcf && grep -v '^#' $tmp/cyto.vcf | cut -f8 | cmp -s $tmp/cyto_expected - \
+        && annotate cyto_preload -c $tmp/cyto.json --preload-bed $tmp/cyto_in.vcf && cmp -s $tmp/cyto.vcf $tmp/cyto_preload.vcf; then
+    echo "ok   cyto"
+else
+    fail "cyto, existing BED tag of input not kept"
+fi
+
+# Number=A integer tag already in input, only the missing values are filled, alleles are mapped
+n_test=$((n_test+1))
+vcf_head='##fileformat=VCFv4.2\n##contig=<ID=chr17,length=83257441>\n##INFO=<ID=XAC,Number=A,Type=Integer,Description="Allele count">\n'
+{ printf "$vcf_head#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n"
+  printf 'chr17\t41200000\t.\tA\tC,G\t.\t.\tXAC=3,4\nchr17\t41200100\t.\tT\tA\t.\t.\tXAC=7\n'; } | $BGZIP -c > $tmp/xac_db.vcf.gz
+$TABIX -p vcf $tmp/xac_db.vcf.gz
+printf '{ "vcfs": [ { "file":"%s", "columns":"XAC", }, ], }\n' $tmp/xac_db.vcf.gz > $tmp/xac.json
+printf "$vcf_head#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n" > $tmp/xac_in.vcf
+printf 'chr17\t41200000\t.\tA\tG,C\t.\t.\tXAC=.,9\nchr17\t41200100\t.\tT\tA\t.\t.\tXAC=1\nchr17\t41200100\t.\tT\tA\t.\t.\t.\n' >> $tmp/xac_in.vcf
+printf 'XAC=4,9\nXAC=1\nXAC=7\n' > $tmp/xac_expected
+if annotate xac -c $tmp/xac.json $tmp/xac_in.vcf && grep -v '^#' $tmp/xac.vcf | cut -f8 | cmp -s $tmp/xac_expected -; then
+    echo "ok   xac"
+else
+    fail "xac, missing values of Number=A integer tag not filled"
+fi
+
+# BGEA converted from the example GEA database
+check bgea expected_full -c $tmp/bgea.json -t 1 -r 50 $tmp/in.vcf.gz
+check bgea_t4 expected_full -c $tmp/bgea.json -t 4 -r 50 $tmp/in.vcf.gz
+
+# BGEA with the block count of its first record corrupted, annotation should fail instead of
+# taking the rest of the file as empty; the toy BGEA is one BGZF block, so its index still fits
+n_test=$((n_test+1))
+gzip -dc $tmp/toy.bgea > $tmp/bad.raw
+l_hdr=$(od -A n -t u4 -j 5 -N 4 $tmp/bad.raw)
+printf '\377\377\377\177' | dd of=$tmp/bad.raw bs=1 seek=$((9+l_hdr+32)) conv=notrunc 2> /dev/null
+$BGZIP -c $tmp/bad.raw > $tmp/bad.bgea
+cp $tmp/toy.bgea.csi $tmp/bad.bgea.csi
+sed "s#$tmp/toy.bgea#$tmp/bad.bgea#" $tmp/bgea.json > $tmp/bad.json
+if ! annotate bad_bgea -c $tmp/bad.json -t 1 -r 50 $tmp/in.vcf.gz > /dev/null && grep -q "Failed to read $tmp/bad.bgea" $tmp/bad_bgea.log; then
+    echo "ok   bad_bgea"
+else
+    fail "bad_bgea, corrupted BGEA record is not reported"
+fi
+
+# BED records loaded into memory, alone and with the gene records
+check preload_bed expected_db -c $tmp/db.json -t 1 -r 100000 --preload-bed $tmp/in.vcf.gz
+check preload_bed_t4 expected_db -c $tmp/db.json -t 4 -r 7 --preload-bed $tmp/in.vcf.gz
+check preload expected_full -c $tmp/full.json -t 1 -r 50 --preload-gea --preload-bed $tmp/in.vcf.gz
+check preload_t4 expected_full -c $tmp/full.json -t 4 -r 50 --preload-gea --preload-bed $tmp/in.vcf.gz
+
+# gene records loaded into memory, from GEA and BGEA
+check preload_gea expected_full -c $tmp/full.json -t 1 -r 50 --preload-gea $tmp/in.vcf.gz
+check preload_gea_t4 expected_full -c $tmp/full.json -t 4 -r 5 --preload-gea $tmp/in.vcf.gz
+check preload_bgea expected_full -c $tmp/bgea.json -t 1 -r 50 --preload-gea $tmp/in.vcf.gz
+check preload_bgea_t4 expected_full -c $tmp/bgea.json -t 4 -r 50 --preload-gea $tmp/in.vcf.gz
+
+echo "$((n_test-n_fail))/$n_test tests passed."
+[ $n_fail -eq 0 ]
@@ -0,0 +1 @@
+#define BCFANNO_VERSION ""